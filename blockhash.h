@@ -0,0 +1,97 @@
+#ifndef __BLOCKHASH_H_
+
+#define __BLOCKHASH_H_
+
+// Fast non-cryptographic block hash (XXH64). Used to fingerprint blocks so that
+// files can be compared without reading both at once.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define BH_P1	0x9E3779B185EBCA87ULL
+#define BH_P2	0xC2B2AE3D27D4EB4FULL
+#define BH_P3	0x165667B19E3779F9ULL
+#define BH_P4	0x85EBCA77C2B2AE63ULL
+#define BH_P5	0x27D4EB2F165667C5ULL
+
+static inline uint64_t bh_rotl(const uint64_t x, const int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t bh_read64(const uint8_t *const p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;	// Little-endian hosts only, like the rest of the tools.
+}
+
+static inline uint32_t bh_read32(const uint8_t *const p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t bh_round(uint64_t acc, const uint64_t input) {
+	acc += input * BH_P2;
+	acc = bh_rotl(acc, 31);
+	return acc * BH_P1;
+}
+
+static inline uint64_t bh_merge(uint64_t acc, const uint64_t val) {
+	acc ^= bh_round(0, val);
+	return acc * BH_P1 + BH_P4;
+}
+
+static inline uint64_t blockhash64(const uint8_t *data, const size_t n, const uint64_t seed) {
+	const uint8_t *const end = data + n;
+	uint64_t h;
+
+	if (n >= 32) {
+		uint64_t v1 = seed + BH_P1 + BH_P2;
+		uint64_t v2 = seed + BH_P2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - BH_P1;
+		const uint8_t *const limit = end - 32;
+		do {
+			v1 = bh_round(v1, bh_read64(data));
+			v2 = bh_round(v2, bh_read64(data + 8));
+			v3 = bh_round(v3, bh_read64(data + 16));
+			v4 = bh_round(v4, bh_read64(data + 24));
+			data += 32;
+		} while (data <= limit);
+
+		h = bh_rotl(v1, 1) + bh_rotl(v2, 7) + bh_rotl(v3, 12) + bh_rotl(v4, 18);
+		h = bh_merge(h, v1);
+		h = bh_merge(h, v2);
+		h = bh_merge(h, v3);
+		h = bh_merge(h, v4);
+	}
+	else {
+		h = seed + BH_P5;
+	}
+
+	h += n;
+
+	for (; data + 8 <= end; data += 8) {
+		h ^= bh_round(0, bh_read64(data));
+		h = bh_rotl(h, 27) * BH_P1 + BH_P4;
+	}
+	if (data + 4 <= end) {
+		h ^= (uint64_t)bh_read32(data) * BH_P1;
+		h = bh_rotl(h, 23) * BH_P2 + BH_P3;
+		data += 4;
+	}
+	for (; data < end; data++) {
+		h ^= *data * BH_P5;
+		h = bh_rotl(h, 11) * BH_P1;
+	}
+
+	h ^= h >> 33;
+	h *= BH_P2;
+	h ^= h >> 29;
+	h *= BH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+#endif
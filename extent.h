@@ -0,0 +1,239 @@
+#ifndef __EXTENT_H_
+
+#define __EXTENT_H_
+
+// Extent maps: where a file's data is, read once up front into a sorted array.
+//
+// extmap_load() asks the filesystem with FIEMAP, a few hundred extents per call, and falls back
+// to walking SEEK_DATA/SEEK_HOLE where there's no FIEMAP (tmpfs, NFS, qcow2 inputs). Unwritten
+// (preallocated) extents read as nulls, so they're holes here. Touching extents are merged, so
+// every gap in the array is a hole.
+//
+// An extwalk_t goes over two maps together, in order, and hands out the stretches where either
+// has data, each tagged with who has it: EXT_IN_1 and EXT_IN_2 are the differences, EXT_SHARED
+// the intersection, and all of them together the union. Holes in both are skipped for free.
+//
+// extmap_seek() answers SEEK_DATA/SEEK_HOLE from a map, for code that wants an lseek().
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "probes.h"
+
+#define EXTMAP_FIEMAP_BATCH	256	// Extents per FIEMAP call.
+
+typedef struct {
+		uint64_t off;
+		uint64_t end;
+	} extent_t;
+
+typedef struct {
+		extent_t *ext;	// Sorted, disjoint and not touching.
+		size_t n;
+		size_t cap;
+		uint64_t size;	// Nothing at or past this.
+	} extmap_t;
+
+enum {
+		EXT_IN_1	= 1,
+		EXT_IN_2	= 2,
+		EXT_SHARED	= EXT_IN_1 | EXT_IN_2,
+	};
+
+typedef struct {
+		const extmap_t *m[2];
+		size_t i[2];	// First extent of each that ends after pos.
+		uint64_t pos;
+		uint64_t hi;
+	} extwalk_t;
+
+static inline void extmap_free(extmap_t m[const static 1]) {
+	free(m->ext);
+	*m = (extmap_t){ };
+}
+
+// Add [off, end) past the last extent, merging with it if they touch.
+static inline bool extmap_add(extmap_t m[const static 1], const uint64_t off, uint64_t end) {
+	end = MIN(end, m->size);
+	if (off >= end)
+		return true;
+	if (m->n > 0 && m->ext[m->n - 1].end >= off) {
+		m->ext[m->n - 1].end = MAX(m->ext[m->n - 1].end, end);
+		return true;
+	}
+	if (m->n == m->cap) {
+		const size_t cap = m->cap ? m->cap * 2 : 64;
+		extent_t *const grown = realloc(m->ext, cap * sizeof(*grown));
+		if (grown == nullptr)
+			return false;
+		m->ext = grown;
+		m->cap = cap;
+	}
+	m->ext[m->n++] = (extent_t){ .off = off, .end = end };
+	return true;
+}
+
+// FIEMAP the whole of fd into m. Returns 1 when done, 0 if the filesystem can't, -1 on error.
+static inline int extmap_fiemap(extmap_t m[const static 1], const int fd) {
+	struct {
+			struct fiemap fm;
+			struct fiemap_extent fe[EXTMAP_FIEMAP_BATCH];
+		} req;
+	uint64_t start = 0;
+	while (start < m->size) {
+		memset(&req.fm, 0, sizeof(req.fm));
+		req.fm.fm_start = start;
+		req.fm.fm_length = m->size - start;
+		req.fm.fm_flags = FIEMAP_FLAG_SYNC;	// Delayed allocations have to be on disk to show.
+		req.fm.fm_extent_count = EXTMAP_FIEMAP_BATCH;
+		if (ioctl(fd, FS_IOC_FIEMAP, &req.fm) != 0)
+			return errno == ENOTTY || errno == EOPNOTSUPP || errno == EINVAL || errno == EBADR ? 0 : -1;
+		if (req.fm.fm_mapped_extents == 0)
+			break;
+
+		bool last = false;
+		for (uint32_t i = 0; i < req.fm.fm_mapped_extents; i++) {
+			const struct fiemap_extent *const fe = &req.fe[i];
+			if (!(fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) && !extmap_add(m, MAX(fe->fe_logical, start), fe->fe_logical + fe->fe_length))
+				return -1;
+			last |= fe->fe_flags & FIEMAP_EXTENT_LAST;
+			start = MAX(start, fe->fe_logical + fe->fe_length);
+		}
+		if (last)
+			break;
+	}
+	return 1;
+}
+
+// Load where the data of a file of size bytes is. seek answers SEEK_DATA/SEEK_HOLE for it; with
+// nullptr, that's FIEMAP on fd, then lseek(fd). Returns false on error, with errno set.
+static inline bool extmap_load(extmap_t m[const static 1], const int fd, const uint64_t size, off_t (*seek)(const void *ctx, off_t off, int whence), const void *const ctx) {
+	*m = (extmap_t){ .size = size };
+	if (seek == nullptr) {
+		const int r = extmap_fiemap(m, fd);
+		if (r != 0) {
+			probe(extmap, fd, m->n, 1);
+			return r > 0;
+		}
+		m->n = 0;
+	}
+
+	for (uint64_t off = 0; off < size; ) {
+		const off_t data = seek != nullptr ? seek(ctx, off, SEEK_DATA) : lseek(fd, off, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO)
+				break;
+			return false;
+		}
+		const off_t hole = seek != nullptr ? seek(ctx, data, SEEK_HOLE) : lseek(fd, data, SEEK_HOLE);
+		const uint64_t end = hole == -1 ? size : (uint64_t)hole;
+		if (!extmap_add(m, data, end)) {
+			errno = ENOMEM;
+			return false;
+		}
+		off = MAX(end, (uint64_t)data + 1);
+	}
+	probe(extmap, fd, m->n, 0);
+	return true;
+}
+
+// Index of the first extent that ends after off.
+static inline size_t extmap_find(const extmap_t m[const static 1], const uint64_t off) {
+	size_t lo = 0, hi = m->n;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (m->ext[mid].end <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Data bytes in [lo, hi).
+static inline uint64_t extmap_bytes(const extmap_t m[const static 1], const uint64_t lo, const uint64_t hi) {
+	uint64_t bytes = 0;
+	for (size_t i = extmap_find(m, lo); i < m->n && m->ext[i].off < hi; i++)
+		bytes += MIN(m->ext[i].end, hi) - MAX(m->ext[i].off, lo);
+	return bytes;
+}
+
+// lseek() for SEEK_DATA and SEEK_HOLE, from the map ctx.
+static inline off_t extmap_seek(const void *const ctx, const off_t off, const int whence) {
+	const extmap_t *const m = ctx;
+	if (off < 0 || (uint64_t)off >= m->size) {
+		errno = ENXIO;
+		return -1;
+	}
+	const size_t i = extmap_find(m, off);
+	if (whence == SEEK_DATA) {
+		if (i == m->n) {
+			errno = ENXIO;
+			return -1;
+		}
+		return MAX((uint64_t)off, m->ext[i].off);
+	}
+	return i == m->n || m->ext[i].off > (uint64_t)off ? off : (off_t)m->ext[i].end;
+}
+
+// Walk [lo, hi) of m1 and m2 together.
+static inline void extwalk_init(extwalk_t w[const static 1], const extmap_t m1[const static 1], const extmap_t m2[const static 1], const uint64_t lo, const uint64_t hi) {
+	*w = (extwalk_t){ .m = { m1, m2 }, .i = { extmap_find(m1, lo), extmap_find(m2, lo) }, .pos = lo, .hi = hi };
+}
+
+// The next stretch [*off, *end) where either map has data, the same all the way through: *kind
+// is EXT_IN_1, EXT_IN_2 or EXT_SHARED. Returns false when there's no more.
+static inline bool extwalk_next(extwalk_t w[const static 1], uint64_t off[const static 1], uint64_t end[const static 1], int kind[const static 1]) {
+	while (w->pos < w->hi) {
+		uint64_t next = w->hi;	// Where the first of the maps changes.
+		int in = 0;
+		for (int j = 0; j < 2; j++) {
+			const extmap_t *const m = w->m[j];
+			while (w->i[j] < m->n && m->ext[w->i[j]].end <= w->pos)
+				w->i[j]++;
+			if (w->i[j] == m->n)
+				continue;
+			const extent_t *const e = &m->ext[w->i[j]];
+			if (e->off <= w->pos) {
+				in |= 1 << j;
+				next = MIN(next, e->end);
+			}
+			else {
+				next = MIN(next, e->off);
+			}
+		}
+		const uint64_t at = w->pos;
+		w->pos = next;
+		if (in != 0) {
+			*off = at;
+			*end = next;
+			*kind = in;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The intersection of m1 and m2, into out.
+static inline bool extmap_intersect(extmap_t out[const static 1], const extmap_t m1[const static 1], const extmap_t m2[const static 1]) {
+	*out = (extmap_t){ .size = MIN(m1->size, m2->size) };
+	extwalk_t w;
+	extwalk_init(&w, m1, m2, 0, out->size);
+	uint64_t off, end;
+	int kind;
+	while (extwalk_next(&w, &off, &end, &kind)) {
+		if (kind == EXT_SHARED && !extmap_add(out, off, end))
+			return false;
+	}
+	return true;
+}
+
+#endif
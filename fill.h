@@ -0,0 +1,132 @@
+#ifndef __FILL_H_
+
+#define __FILL_H_
+
+// --fill: what a recovery tool wrote over the sectors it couldn't read, when that isn't nulls.
+// Flash dumps come back with 0xFF, some imagers write a marker like "BAD SECTOR" over and over.
+//
+// The fill is a byte or a short pattern, written from the start of every FILL_SECTOR sector
+// and cut off at its end. A sector that holds nothing but the fill is as unknown as a null one:
+// it merges, compares and scans like nulls. Anything else in it makes it data, fill bytes and
+// all, so real 0xFF bytes in a sector with data stay data. Holes are unknown as always.
+//
+//	--fill 0xff	the byte 0xFF; 0x with more digits is a pattern of bytes, in order
+//	--fill 255	a byte, in decimal
+//	--fill 'BAD SECTOR'	anything else is the pattern itself
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "nullvec.h"
+#include "opts.h"
+
+#define FILL_SECTOR	512
+
+typedef struct {
+		bool on;
+		uint8_t sector[FILL_SECTOR];	// A sector of fill.
+	} fill_t;
+
+static inline int fill_hex(const char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+		return (c | 0x20) - 'a' + 10;
+	return -1;
+}
+
+static inline bool fill_parse(fill_t f[const static 1], const char *const arg) {
+	uint8_t pat[FILL_SECTOR];
+	size_t len = 0;
+	const size_t arglen = strlen(arg);
+
+	if (arglen > 2 && arg[0] == '0' && (arg[1] | 0x20) == 'x') {
+		for (const char *p = arg + 2; arglen % 2 == 0 && arglen - 2 <= 2 * FILL_SECTOR && *p != '\0'; p += 2) {
+			const int hi = fill_hex(p[0]), lo = fill_hex(p[1]);
+			if (hi < 0 || lo < 0) {
+				len = 0;
+				break;
+			}
+			pat[len++] = hi << 4 | lo;
+		}
+	}
+	else if (arglen > 0 && arglen <= 3 && strspn(arg, "0123456789") == arglen && atoi(arg) <= 255) {
+		pat[len++] = atoi(arg);
+	}
+	else if (arglen <= FILL_SECTOR) {
+		memcpy(pat, arg, arglen);
+		len = arglen;
+	}
+	if (len == 0) {
+		fprintf(stderr, "Error: --fill wants a byte or a pattern of at most %i bytes: %s\n", FILL_SECTOR, arg);
+		return false;
+	}
+
+	for (size_t off = 0; off < FILL_SECTOR; off += len)
+		memcpy(f->sector + off, pat, MIN(len, FILL_SECTOR - off));
+	f->on = true;
+	return true;
+}
+
+static inline bool fill_take(void *const ctx, const size_t, const char *const value) {
+	return fill_parse(ctx, value);
+}
+
+// Take --fill out of argv, so that the tool's own parsing never sees it.
+static inline bool fill_strip(int argc[const static 1], char **const argv, fill_t f[const static 1]) {
+	static const opt_t opts[] = { { "--fill", OPT_VALUE } };
+	*f = (fill_t){ };
+	return opt_strip(argc, argv, 1, opts, fill_take, f);
+}
+
+// True if the sector at s, of a file of size bytes mapped at base, is all fill. s must be on a
+// sector boundary; a sector cut short by the end of the file only needs to match as far as it goes.
+static inline bool fill_sector(const fill_t f[const static 1], const uint8_t *const base, const size_t size, const size_t s) {
+	return f->on && nullvec_equal(base + s, f->sector, MIN(FILL_SECTOR, size - s));
+}
+
+// True if [off, off + n) holds nothing known: every sector it touches is null there, or all fill.
+// Looks at the whole of those sectors, so they must be mapped.
+static inline bool fill_isnull(const fill_t f[const static 1], const uint8_t *const base, const size_t size, const size_t off, const size_t n) {
+	if (nullvec_iszero(base + off, n))
+		return true;
+	if (!f->on)
+		return false;
+	for (size_t s = off & -(size_t)FILL_SECTOR; s < off + n; s += FILL_SECTOR) {
+		const size_t from = MAX(s, off), to = MIN(s + FILL_SECTOR, off + n);
+		if (!nullvec_iszero(base + from, to - from) && !fill_sector(f, base, size, s))
+			return false;
+	}
+	return true;
+}
+
+// Known, non-null bytes in [off, off + n): fill sectors count for nothing.
+static inline size_t fill_count_data(const fill_t f[const static 1], const uint8_t *const base, const size_t size, const size_t off, const size_t n) {
+	if (!f->on)
+		return nullvec_count_nonzero(base + off, n);
+	size_t count = 0;
+	for (size_t s = off & -(size_t)FILL_SECTOR; s < off + n; s += FILL_SECTOR) {
+		const size_t from = MAX(s, off), to = MIN(s + FILL_SECTOR, off + n);
+		if (!fill_sector(f, base, size, s))
+			count += nullvec_count_nonzero(base + from, to - from);
+	}
+	return count;
+}
+
+// Null out the fill sectors in the n bytes at buf, which were read from file offset off. buf
+// must end on a sector boundary or at the end of the file; a sector it only holds the end of
+// is left alone.
+static inline void fill_clear(const fill_t f[const static 1], uint8_t *const buf, const size_t n, const size_t off) {
+	if (!f->on)
+		return;
+	for (size_t b = (FILL_SECTOR - off % FILL_SECTOR) % FILL_SECTOR; b < n; b += FILL_SECTOR) {
+		if (fill_sector(f, buf, n, b))
+			memset(buf + b, 0, MIN(FILL_SECTOR, n - b));
+	}
+}
+
+#endif
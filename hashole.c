@@ -16,6 +16,8 @@
 #include <sys/param.h>
 
 #include "likely.h"
+#include "xcache.h"
+#include "shard.h"
 
 #define least(x,y) ( x < y ? x : y)
 #define greatest(x,y) ( x < y ? y : x)
@@ -25,6 +27,16 @@ int main(int argc, char **argv) {
 
 	// Will compare two files, determining if they are the same except in areas of NULL
 	// Does not tell you which file has the most null. Use `gzip -1 | wc -c` for that.
+	// --offset bytes, --length bytes: look for a hole in that range only, which must be
+	// block-aligned. --shard file: write what the range holds to file, for nullmerge.
+	shard_opts_t shard;
+	if (!shard_strip(&argc, argv, &shard))
+		return 2;
+	const bool opt_cache = argc == 3 && strcmp(argv[1], "-x") == 0;
+	if (opt_cache) {
+		argc--;
+		argv++;
+	}
 	if (argc < 2 || argc > 2) {
 		printf("Error: You must specify one input file.\n");
 		return 2;
@@ -37,6 +49,7 @@ int main(int argc, char **argv) {
 	// -r: show only ratio
 	// -4: show only 4096-byte block diff/same
 	// -n: don't count null blocks as indifferent
+	// -x: cache the result in an extended attribute, and answer from it while the file is unchanged
 	// -
 
 	int in1 = open(argv[1], O_NOATIME | O_DIRECT, O_RDONLY);
@@ -70,10 +83,47 @@ int main(int argc, char **argv) {
 		return 2;
 	}
 
+	if (shard.ranged) {
+		size_t lo, hi;
+		if (opt_cache || !shard_range(&shard, stat_buf.st_size, stat_buf.st_blksize, &lo, &hi)) {
+			if (opt_cache)
+				fprintf(stderr, "Error: --offset, --length and --shard don't mix with -x.\n");
+			close(in1);
+			return 2;
+		}
+		shard_rec_t rec = shard_new(SHARD_HASHOLE, lo, hi, stat_buf.st_size, stat_buf.st_size, 0);
+		const off_t hole = lo < hi ? lseek(in1, lo, SEEK_HOLE) : -1;
+		close(in1);
+		if (hole != -1 && (size_t)hole < hi && hole < stat_buf.st_size)
+			shard_first(&rec, hole);
+		if (shard.out != nullptr)
+			return shard_write(shard.out, &rec, nullptr, nullptr) ? 0 : 2;
+		return (rec.flags & SH_FIRST) ? 1 : 0;
+	}
+
+	// Anything hasnull put in the record, payload and all, is kept when it's rewritten.
+	xc_rec_t rec = { };
+	uint8_t payload[XC_PAYLOAD_MAX];
+	const bool cached = opt_cache && xc_load(in1, &stat_buf, &rec, payload, sizeof(payload));
+	if (cached && (rec.flags & XC_HOLE_KNOWN)) {
+		close(in1);
+		return (rec.flags & XC_HOLE) ? 1 : 0;
+	}
+
 	size_t hole_1 = lseek(in1, 0, SEEK_HOLE);
+	const bool hole = !(hole_1 == (size_t)-1 || hole_1 == stat_buf.st_size);
+
+	if (opt_cache) {
+		rec.flags = (rec.flags & ~XC_HOLE) | XC_HOLE_KNOWN | (hole ? XC_HOLE : 0);
+		if (hole && rec.granularity == 0)
+			rec.granularity = stat_buf.st_blksize;
+		if (hole && rec.granularity == (uint32_t)stat_buf.st_blksize)
+			rec.flags |= XC_NULL_KNOWN | XC_NULL;
+		xc_store(in1, &stat_buf, &rec, payload, rec.payload);
+	}
 
 	close(in1);
-	if (hole_1 == (size_t)-1 || hole_1 == stat_buf.st_size) {
+	if (!hole) {
 		// No hole.
 		return 0;
 	}
@@ -12,20 +12,26 @@
 #include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include <sys/param.h>
 #include <sys/mount.h>	// block size ioctl
 #include <sys/ioctl.h>
 
 #include "likely.h"
+#include "nullvec.h"
+#include "readahead.h"
+#include "throttle.h"
+#include "xcache.h"
+#include "shard.h"
+#include "fill.h"
 
 #define least(x,y) ( x < y ? x : y)
 #define greatest(x,y) ( x < y ? y : x)
 
-char zerobuf[8192] = {0};
-char *zero = zerobuf;
-
-size_t num_blk_4	= 0;	// Number of 4096-byte blocks with data -- blocks without holes or zero-matches.
+static fill_t fill;
+static throttle_t throttle;
 
 typedef struct {
 		int f_in;
@@ -33,77 +39,409 @@ typedef struct {
 		const int fd;
 	} f_in_info_t;
 
-int main(int argc, char **argv) {
+// Census: how much of the file is hole, null, or data. Walks only the data extents, so holes
+// cost a pair of lseeks each.
+#define CENSUS_BUCKETS	64	// Columns in the coverage histogram.
 
-	// Will compare two files, determining if they are the same except in areas of NULL
-	// Does not tell you which file has the most null. Use `gzip -1 | wc -c` for that.
-	if (argc < 2 || argc > 2) {
-		printf("Error: You must specify one input file.\n");
-		return -1;
-	}
+typedef struct {
+		size_t data;	// Bytes in data extents.
+		size_t hole;
+		size_t zero_pages;	// Bytes in data extents, in all-zero pages.
+		size_t zero_bytes;	// Zero bytes in data extents, counted one by one.
+		size_t nonzero;	// Non-zero bytes.
+		size_t bucket_data[CENSUS_BUCKETS];	// Non-null page bytes in each histogram column.
+	} census_t;
+
+static void census(census_t c[const static 1], const int fd, const uint8_t *const map, const size_t size, const int PAGE_SIZE) {
+	*c = (census_t){ };
+	const size_t bucket_size = MAX((size + CENSUS_BUCKETS - 1) / CENSUS_BUCKETS, 1);
 
-	// Args:
-	// -5: show only 512-byte block diff/same
-	// -d: show only diff
-	// -s: show only same
-	// -r: show only ratio
-	// -4: show only 4096-byte block diff/same
-	// -n: don't count null blocks as indifferent
-	// -b: show if there is a null block
-	// -f: show filename if there is a null block
-	// -
-	
-	bool opt_showfile = false;
-	bool opt_shownull = false;
-	int fidx = 1;
+	size_t f_off = 0;
+	size_t unmap_off = 0;
+	ra_ctl_t ra;
+	ra_init(&ra, 1, (const uint8_t *[]){ map }, (const size_t[]){ size }, (const int[]){ fd }, 0);
+	ra_set_throttle(&ra, &throttle);
+	ra_start(&ra);
+	while (f_off < size) {
+		const off_t data = lseek(fd, f_off, SEEK_DATA);
+		if (data == -1)
+			break;
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1)
+			hole = size;
 
-	for (int i = 1; i < argc; i++) {
-		if (strcmp(argv[i], "-f") == 0) {
-			opt_showfile = true;
-			if (fidx == i)
-				fidx++;
+		c->data += hole - data;
+
+		for (size_t off = data; off < (size_t)hole; ) {
+			const size_t blocksize = MIN((size_t)hole - off, PAGE_SIZE);
+			if (fill_isnull(&fill, map, size, off, blocksize)) {
+				c->zero_pages += blocksize;
+				c->zero_bytes += blocksize;
+			}
+			else {
+				const size_t nz = fill_count_data(&fill, map, size, off, blocksize);
+				c->nonzero += nz;
+				c->zero_bytes += blocksize - nz;
+
+				// A page may straddle two columns.
+				const size_t b = off / bucket_size;
+				const size_t in_b = MIN(blocksize, (b + 1) * bucket_size - off);
+				c->bucket_data[b] += in_b;
+				if (in_b < blocksize)
+					c->bucket_data[b + 1] += blocksize - in_b;
+			}
+			off += blocksize;
+			ra_advance(&ra, off);
+
+			// Drop what's behind us.
+			if (unlikely(off - unmap_off >= RA_UNMAP_STEP)) {
+				const size_t unmap_sz = (off - unmap_off) & -(size_t)PAGE_SIZE;
+				munmap((void *)(map + unmap_off), unmap_sz);
+				unmap_off += unmap_sz;
+			}
 		}
-		else if (strcmp(argv[i], "-b") == 0) {
-			opt_shownull = true;
-			if (fidx == i)
-				fidx++;
+		f_off = hole;
+	}
+	ra_destroy(&ra);
+	c->hole = size - c->data;
+
+	if (unmap_off < size)
+		munmap((void *)(map + unmap_off), size - unmap_off);
+}
+
+static void census_report(const char *const fpath, const census_t c[const static 1], const size_t size, const size_t allocated, const bool opt_showfile) {
+	const size_t bucket_size = MAX((size + CENSUS_BUCKETS - 1) / CENSUS_BUCKETS, 1);
+
+	if (opt_showfile)
+		printf("%s:\n", fpath);
+	printf("size:             %zu\n", size);
+	printf("allocated:        %zu\n", allocated);
+	printf("data extents:     %zu\n", c->data);
+	printf("holes:            %zu\n", c->hole);
+	printf("null pages:       %zu\n", c->zero_pages);
+	printf("null bytes:       %zu\n", c->zero_bytes);
+	printf("non-null bytes:   %zu\n", c->nonzero);
+	printf("non-null ratio:   %.4f\n", size ? (double)c->nonzero / size : 0.0);
+
+	// One character per column, by how much of it is non-null pages.
+	static const char shade[] = " .:-=+*#%@";
+	char hist[CENSUS_BUCKETS + 1] = { };
+	size_t cols = 0;
+	for (size_t b = 0; b < CENSUS_BUCKETS && b * bucket_size < size; b++) {
+		const size_t span = MIN(bucket_size, size - b * bucket_size);
+		size_t level = c->bucket_data[b] * (sizeof(shade) - 2) / span;
+		// Only a completely empty column is blank.
+		if (level == 0 && c->bucket_data[b] > 0)
+			level = 1;
+		hist[cols++] = shade[level];
+	}
+	printf("coverage:         [%s]\n", hist);
+}
+
+// Dig holes: punch every aligned all-null block out of the data extents, so that later runs skip
+// it as a hole instead of reading it. The extents are cut into PUNCH_CHUNK pieces that the
+// workers take in turn; each worker gathers its null blocks into runs and punches a run as it
+// ends.
+#define PUNCH_CHUNK	(16 << 20)
+
+typedef struct {
+		size_t off;
+		size_t len;
+	} punch_piece_t;
+
+typedef struct {
+		int fd;
+		size_t blksize;
+		const punch_piece_t *piece;
+		size_t npieces;
+		atomic_size_t next;	// Next piece to take.
+		atomic_size_t punched;	// Bytes punched.
+		atomic_size_t runs;
+		atomic_int err;	// First errno, if any; stops the workers.
+	} punch_t;
+
+static void punch_fail(punch_t p[const static 1], const int err) {
+	int none = 0;
+	atomic_compare_exchange_strong(&p->err, &none, err);
+}
+
+static bool punch_run(punch_t p[const static 1], const size_t off, const size_t len) {
+	if (fallocate(p->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) != 0) {
+		punch_fail(p, errno);
+		return false;
+	}
+	atomic_fetch_add(&p->punched, len);
+	atomic_fetch_add(&p->runs, 1);
+	return true;
+}
+
+static void *punch_worker(void *const arg) {
+	punch_t *const p = arg;
+	uint8_t *const buf = aligned_alloc(p->blksize, PUNCH_CHUNK);
+	if (buf == nullptr) {
+		punch_fail(p, ENOMEM);
+		return nullptr;
+	}
+
+	size_t i;
+	while ((i = atomic_fetch_add(&p->next, 1)) < p->npieces && atomic_load(&p->err) == 0) {
+		const punch_piece_t *const pc = &p->piece[i];
+		size_t got = 0;
+		while (got < pc->len) {
+			const ssize_t r = pread(p->fd, buf + got, pc->len - got, pc->off + got);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				punch_fail(p, errno);
+			if (r <= 0)
+				break;	// A short file just has fewer blocks to check.
+			got += r;
 		}
-		else if (strcmp(argv[i], "--") == 0) {
-			fidx = i + 1;
-			break;
+		throttle_io(&throttle, got);
+
+		size_t run_off = 0, run_len = 0;
+		for (size_t b = 0; b + p->blksize <= got; b += p->blksize) {
+			if (fill_isnull(&fill, buf, got, b, p->blksize)) {
+				if (run_len == 0)
+					run_off = pc->off + b;
+				run_len += p->blksize;
+				continue;
+			}
+			if (run_len > 0 && !punch_run(p, run_off, run_len))
+				break;
+			run_len = 0;
 		}
+		if (run_len > 0)
+			punch_run(p, run_off, run_len);
 	}
-	if (fidx >= argc) {
-		fprintf(stderr, "Error: file not detected on command line.\n");
-		return 1;
+
+	free(buf);
+	return nullptr;
+}
+
+// Returns 1 if anything was punched, 0 if there was nothing to punch, -1 on error. fd must be
+// open for writing.
+static int dig_holes(const char *const fpath, const int fd, const struct stat st[const static 1], const unsigned nworkers, const bool opt_showfile) {
+	const size_t blksize = st->st_blksize;
+	const size_t size = st->st_size;
+	punch_piece_t *piece = nullptr;
+	size_t npieces = 0, cap = 0;
+
+	// Data extents start on a block boundary; only whole blocks are punched, so a partial last
+	// block is left alone.
+	for (off_t data = lseek(fd, 0, SEEK_DATA); data != -1 && (size_t)data < size; ) {
+		const off_t hole = lseek(fd, data, SEEK_HOLE);
+		const size_t end = MIN((size_t)hole, size);
+		for (size_t off = data; off < end; off += PUNCH_CHUNK) {
+			if (npieces == cap) {
+				cap = cap ? cap * 2 : 256;
+				punch_piece_t *const more = realloc(piece, cap * sizeof(*more));
+				if (more == nullptr) {
+					fprintf(stderr, "Unable to allocate the extent list for %s.\n", fpath);
+					free(piece);
+					return -1;
+				}
+				piece = more;
+			}
+			piece[npieces++] = (punch_piece_t){ .off = off, .len = MIN(end - off, (size_t)PUNCH_CHUNK) };
+		}
+		data = lseek(fd, end, SEEK_DATA);
 	}
 
-	const char *fpath = argv[fidx];
-	int in1 = open(fpath, O_NOATIME, O_RDONLY);
-	if (in1 == -1) {
-		fprintf(stderr, "Unable to open %s", fpath);
-		perror(", ");
+	punch_t p = {
+			.fd = fd,
+			.blksize = blksize,
+			.piece = piece,
+			.npieces = npieces
+		};
+	atomic_init(&p.next, 0);
+	atomic_init(&p.punched, 0);
+	atomic_init(&p.runs, 0);
+	atomic_init(&p.err, 0);
+
+	const unsigned n = MAX(MIN(nworkers, npieces), 1);
+	pthread_t workers[n];
+	unsigned started = 0;
+	while (started < n && pthread_create(&workers[started], nullptr, punch_worker, &p) == 0)
+		started++;
+	if (started == 0)
+		punch_worker(&p);
+	for (unsigned w = 0; w < started; w++)
+		pthread_join(workers[w], nullptr);
+	free(piece);
+
+	const size_t punched = atomic_load(&p.punched);
+	struct stat after;
+	const size_t reclaimed = fstat(fd, &after) == 0 && after.st_blocks < st->st_blocks ? (st->st_blocks - after.st_blocks) * 512 : 0;
+
+	if (opt_showfile)
+		printf("%s:\n", fpath);
+	printf("punched:          %zu\n", punched);
+	printf("punched ranges:   %zu\n", atomic_load(&p.runs));
+	printf("reclaimed:        %zu\n", reclaimed);
+
+	const int err = atomic_load(&p.err);
+	if (err != 0) {
+		fprintf(stderr, "Error: unable to dig holes in %s: %s\n", fpath, strerror(err));
 		return -1;
 	}
+	return punched > 0 ? 1 : 0;
+}
 
-	struct stat stat_buf;
-	if (fstat(in1, &stat_buf) == -1) {
-		fprintf(stderr, "Error: Unable to stat %s\n", fpath);
-		close(in1);
-		return -1;
+// Search order for the null-block scan. Every order ends with a scan of the whole file, so the
+// answer is exact; the orders only change how soon a "yes" is found.
+typedef enum {
+		ORDER_SEQ,	// Front to back.
+		ORDER_TAIL,	// Back to front. Interrupted downloads are missing their end.
+		ORDER_STRIDE,	// One block from the middle of each chunk, then front to back.
+		ORDER_BOUNDARY,	// The first and last block of each chunk, then front to back.
+	} scan_order_t;
+
+#define PROBE_BATCH	256	// Probes whose reads are in flight at once.
+#define TAIL_WINDOW	(2 << 20)	// Backward scan: bytes read ahead of the cursor.
+
+static inline bool block_isnull(const uint8_t *const map, const size_t size, const size_t off, const int PAGE_SIZE) {
+	return fill_isnull(&fill, map, size, off, MIN(size - off, PAGE_SIZE));
+}
+
+// The probe offsets for an order, in the order they're checked.
+static size_t probe_offset(const scan_order_t order, const size_t idx, const size_t chunk, const int PAGE_SIZE) {
+	if (order == ORDER_STRIDE)
+		return idx * chunk + (chunk / 2 & -(size_t)PAGE_SIZE);
+	// ORDER_BOUNDARY: even probes are chunk starts, odd ones are chunk ends.
+	return (idx / 2) * chunk + ((idx & 1) ? chunk - PAGE_SIZE : 0);
+}
+
+// Probe the blocks picked by the order. The reads for a whole batch are started together with
+// readahead, then checked. Returns the offset of a null block, or -1.
+static size_t probe_scan(const int fd, const uint8_t *const map, const size_t size, const int PAGE_SIZE, const scan_order_t order, const size_t chunk) {
+	const size_t per_chunk = order == ORDER_BOUNDARY ? 2 : 1;
+	const size_t nprobes = (size + chunk - 1) / chunk * per_chunk;
+
+	madvise((void *)map, size, MADV_RANDOM);
+
+	size_t found = -1;
+	for (size_t batch = 0; batch < nprobes && found == (size_t)-1; batch += PROBE_BATCH) {
+		const size_t stop = MIN(nprobes, batch + PROBE_BATCH);
+		for (size_t i = batch; i < stop; i++) {
+			const size_t off = probe_offset(order, i, chunk, PAGE_SIZE);
+			if (off < size)
+				readahead(fd, off, PAGE_SIZE);
+		}
+		throttle_io(&throttle, (stop - batch) * PAGE_SIZE);
+		for (size_t i = batch; i < stop; i++) {
+			const size_t off = probe_offset(order, i, chunk, PAGE_SIZE);
+			if (off < size && block_isnull(map, size, off, PAGE_SIZE)) {
+				found = off;
+				break;
+			}
+		}
 	}
-	if (!S_ISREG(stat_buf.st_mode)) {
-		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", fpath);
-		close(in1);
+
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+	return found;
+}
+
+// Back-to-front scan of the whole file. Returns the offset of a null block, or -1.
+static size_t tail_scan(const int fd, const uint8_t *const map, const size_t size, const int PAGE_SIZE) {
+	madvise((void *)map, size, MADV_RANDOM);
+
+	// Start at the last, possibly short, block.
+	size_t off = (size - 1) & -(size_t)PAGE_SIZE;
+	size_t ra_off = off + PAGE_SIZE;	// Lowest offset we've asked to read.
+	while (true) {
+		// Keep at least half a window in flight below the cursor.
+		if (ra_off > 0 && off < ra_off + TAIL_WINDOW / 2) {
+			const size_t ra_end = ra_off;
+			ra_off = ra_end > TAIL_WINDOW ? ra_end - TAIL_WINDOW : 0;
+			readahead(fd, ra_off, ra_end - ra_off);
+			throttle_io(&throttle, ra_end - ra_off);
+		}
+
+		if (block_isnull(map, size, off, PAGE_SIZE))
+			return off;
+		if (off == 0)
+			return -1;
+		off -= PAGE_SIZE;
+	}
+}
+
+// Parallel null scan (-j): the file is cut into SCAN_CHUNK chunks that the workers take in turn.
+// Each maps just its chunk, reads a step ahead of itself, and looks for a null block. The first
+// one found is enough for the answer, so it sets found and every worker stops at its next step.
+#define SCAN_CHUNK	(64 << 20)
+#define SCAN_STEP	(4 << 20)
+
+typedef struct {
+		int fd;
+		size_t size;
+		int blksize;
+		atomic_size_t next;	// Next chunk to take.
+		atomic_bool found;
+		atomic_int err;
+	} scan_t;
+
+static void *scan_worker(void *const arg) {
+	scan_t *const s = arg;
+	size_t c;
+	while (!atomic_load(&s->found) && atomic_load(&s->err) == 0 && (c = atomic_fetch_add(&s->next, 1)) * SCAN_CHUNK < s->size) {
+		const size_t off = c * SCAN_CHUNK, len = MIN(s->size - off, (size_t)SCAN_CHUNK);
+		const uint8_t *const map = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, s->fd, off);
+		if (map == MAP_FAILED) {
+			atomic_store(&s->err, errno);
+			break;
+		}
+		madvise((void *)map, len, MADV_SEQUENTIAL);
+		madvise((void *)map, MIN(len, (size_t)SCAN_STEP), MADV_WILLNEED);
+		for (size_t step = 0; step < len && !atomic_load_explicit(&s->found, memory_order_relaxed); step += SCAN_STEP) {
+			const size_t end = MIN(len, step + SCAN_STEP);
+			if (end < len)
+				madvise((void *)(map + end), MIN(len - end, (size_t)SCAN_STEP), MADV_WILLNEED);
+			throttle_io(&throttle, end - step);
+			for (size_t b = step; b < end; b += s->blksize) {
+				// The chunk's mapping is its own file, as far as the fill's sectors go.
+				if (unlikely(fill_isnull(&fill, map, len, b, MIN(len - b, (size_t)s->blksize)))) {
+					probe(scan_found, off + b);
+					atomic_store(&s->found, true);
+					break;
+				}
+			}
+		}
+		munmap((void *)map, len);
+	}
+	return nullptr;
+}
+
+// Returns 1 if the all-data file has a null block, 0 if not, -1 on error.
+static int par_scan(const char *const fpath, const int fd, const size_t size, const int blksize, const unsigned nworkers) {
+	scan_t s = { .fd = fd, .size = size, .blksize = blksize };
+	atomic_init(&s.next, 0);
+	atomic_init(&s.found, false);
+	atomic_init(&s.err, 0);
+
+	const unsigned n = MAX(MIN(nworkers, (size + SCAN_CHUNK - 1) / SCAN_CHUNK), 1);
+	pthread_t workers[n];
+	unsigned started = 0;
+	while (started < n && pthread_create(&workers[started], nullptr, scan_worker, &s) == 0)
+		started++;
+	if (started == 0)
+		scan_worker(&s);
+	for (unsigned w = 0; w < started; w++)
+		pthread_join(workers[w], nullptr);
+
+	if (atomic_load(&s.found))
+		return 1;
+	const int err = atomic_load(&s.err);
+	if (err != 0) {
+		fprintf(stderr, "Error: unable to mmap %s: %s\n", fpath, strerror(err));
 		return -1;
 	}
-	const size_t in1_size = stat_buf.st_size;
-	f_in_info_t fin1 = {
-			.f_in = in1,
-			.size = in1_size,
-			.fd = in1
-		};
+	return 0;
+}
 
+// The null search proper: 1 and a report if fpath has a null block, 0 if not, -1 on error.
+// Closes in1. With more than one job, the front-to-back scan is par_scan().
+static int null_scan(const char *const fpath, const int in1, const f_in_info_t fin1, const struct stat stat_buf, const scan_order_t opt_order, size_t opt_chunk, const unsigned jobs, const bool opt_shownull, const bool opt_showfile) {
 	if (fin1.size == 0) {
 		// No null blocks.
 		close(in1);
@@ -118,20 +456,10 @@ int main(int argc, char **argv) {
 
 	size_t next_hole = lseek(fin1.fd, 0, SEEK_HOLE);
 
-	// If we have a hole, that will be a null block.
-	if (next_hole <= stat_buf.st_size) {
+	// If we have a hole, that will be a null block. (The end of the file counts as a hole.)
+	if (next_hole < stat_buf.st_size) {
 		close(in1);
-		if (opt_shownull) {
-			if (opt_showfile) {
-				printf("Null encountered: %s\n", fpath);
-			}
-			else {
-				printf("Null encountered\n");
-			}
-		}
-		else if (opt_showfile) {
-			printf("%s\n", fpath);
-		}
+		shard_report_null(fpath, opt_shownull, opt_showfile);
 
 		return 1;
 	}
@@ -165,19 +493,44 @@ int main(int argc, char **argv) {
 	const int PAGE_SIZE_bits = PAGE_SIZE - 1;
 	const size_t PAGE_SIZE_bits_not = -PAGE_SIZE;
 
-	if (unlikely(sizeof(zerobuf) < PAGE_SIZE)) {
-		zero = malloc(PAGE_SIZE);
-		if (zero == nullptr) {
-			fprintf(stderr, "Unable to allocate %i bytes for zero block.\n", PAGE_SIZE);
+	if (opt_order != ORDER_SEQ) {
+		// There are no holes past this point, so the whole file is data.
+		opt_chunk = MAX((opt_chunk + PAGE_SIZE_bits) & PAGE_SIZE_bits_not, PAGE_SIZE);
+
+		const size_t found = opt_order == ORDER_TAIL
+				? tail_scan(in1, in1map, fin1.size, PAGE_SIZE)
+				: probe_scan(in1, in1map, fin1.size, PAGE_SIZE, opt_order, opt_chunk);
+		if (found != (size_t)-1) {
+			munmap((void *)in1map, fin1.size);
 			close(in1);
+			shard_report_null(fpath, opt_shownull, opt_showfile);
+			return 1;
+		}
+		if (opt_order == ORDER_TAIL) {
+			// That covered every block.
 			munmap((void *)in1map, fin1.size);
-
-			return -1;
+			close(in1);
+			return 0;
 		}
+		// The probes found nothing; fill in with the full scan.
+	}
+
+	if (jobs > 1) {
+		munmap((void *)in1map, fin1.size);
+		const int ret = par_scan(fpath, in1, fin1.size, PAGE_SIZE, jobs);
+		close(in1);
+		if (ret == 1)
+			shard_report_null(fpath, opt_shownull, opt_showfile);
+		return ret;
 	}
 
 	size_t unmap_off = 0;	// both will have the same ranges mapped.
 
+	ra_ctl_t ra;
+	ra_init(&ra, 1, (const uint8_t *[]){ in1map }, (const size_t[]){ fin1.size }, (const int[]){ in1 }, f_off);
+	ra_set_throttle(&ra, &throttle);
+	ra_start(&ra);
+
 	while (f_off < fin1.size && f_off >= 0) {
 		if (unlikely(f_off == (size_t)-1)) {
 			// No more blocks, no more zero-blocks.
@@ -195,12 +548,8 @@ int main(int argc, char **argv) {
 			if (likely(munmap_size > 0)) {
 				munmap((void *)(in1map + unmap_off), munmap_size);
 				unmap_off = f_off;
-
-				if (unlikely_err(madvise((void *)(in1map + f_off), MIN(2 << 20, fin1.size - f_off), MADV_WILLNEED) != 0)) {
-					fprintf(stderr, "%i-hl: %p, %li; %li, %li; is ENOMEM? %i; ", errno, in1map, MIN(2 << 20, fin1.size - f_off), f_off, fin1.size, errno == ENOMEM);
-					perror("Unable to madvise-hole");
-				}
 			}
+			ra_advance(&ra, f_off);
 
 			// there's always a next hole.
 			next_hole = lseek(in1, f_off, SEEK_HOLE);
@@ -210,22 +559,13 @@ int main(int argc, char **argv) {
 		}
 
 		const int blocksize = MIN(fin1.size - f_off, PAGE_SIZE);
-		if (unlikely(memcmp(zero, in1map + f_off, blocksize) == 0)) {
+		if (unlikely(block_isnull(in1map, fin1.size, f_off, blocksize))) {
 			// Oh hey -- found a null block! Report true.
+			ra_destroy(&ra);
 			munmap((void *)(in1map + unmap_off), fin1.size - unmap_off);
 			close(in1);
 
-			if (opt_shownull) {
-				if (opt_showfile) {
-					printf("Null encountered: %s\n", fpath);
-				}
-				else {
-					printf("Null encountered\n");
-				}
-			}
-			else if (opt_showfile) {
-				printf("%s\n", fpath);
-			}
+			shard_report_null(fpath, opt_shownull, opt_showfile);
 
 			return 1;
 		}
@@ -234,25 +574,13 @@ int main(int argc, char **argv) {
 		lseek(in1, f_off, SEEK_SET);
 
 
-		if (likely(f_off < fin1.size)) {
-			if (unlikely((f_off & 0xFFFFFF) == 0)) {
-				munmap((void *)(in1map + unmap_off), f_off - unmap_off);
-				unmap_off = f_off;
-
-				if (unlikely_err(madvise((void *)(in1map + f_off), MIN(2 << 20, fin1.size - f_off), MADV_WILLNEED) != 0)) {
-					fprintf(stderr, "%i-1: %p, %li; %li, %li; is ENOMEM? %i; ", errno, in1map, MIN(2 << 20, fin1.size - f_off), f_off, fin1.size, errno == ENOMEM);
-					perror("Unable to madvise");
-				}
-			}
-			else if (unlikely((f_off & 0xEFFFFF) == 0)) {
-				if (unlikely_err(madvise((void *)(in1map + f_off), MIN(2 << 20, fin1.size - f_off), MADV_WILLNEED) != 0)) {
-					fprintf(stderr, "%i-2: %p, %li; %li, %li; ", errno, in1map, MIN(2 << 20, fin1.size - f_off), f_off, fin1.size);
-					perror("Unable to madvise2");
-				}
-			}
+		ra_advance(&ra, f_off);
+		if (unlikely(f_off - unmap_off >= RA_UNMAP_STEP && f_off < fin1.size)) {
+			munmap((void *)(in1map + unmap_off), f_off - unmap_off);
+			unmap_off = f_off;
 		}
 	}
-
+	ra_destroy(&ra);
 
 	if (unmap_off < fin1.size)
 		munmap((void *)(in1map + unmap_off), fin1.size - unmap_off);
@@ -261,3 +589,284 @@ int main(int argc, char **argv) {
 	close(in1);
 	return 0;
 }
+
+// --offset/--length: look for a hole or null block in [lo, hi) only, by the same rules as the
+// whole-file search. Returns 1 with its offset in found, 0 if there's none, -1 on error.
+static int range_scan(const int fd, const size_t size, const size_t lo, const size_t hi, const int PAGE_SIZE, size_t found[const static 1]) {
+	// A file with no data at all has no null blocks, as far as the whole-file search goes.
+	if (size == 0 || lseek(fd, 0, SEEK_DATA) == -1)
+		return 0;
+
+	static uint8_t buf[1 << 20];
+	size_t pos = lo;
+	while (pos < hi) {
+		const off_t data = lseek(fd, pos, SEEK_DATA);
+		if (data == -1 || (size_t)data > pos) {
+			// A hole, and the end of the file counts as one.
+			*found = pos;
+			return 1;
+		}
+		const size_t end = MIN((size_t)lseek(fd, pos, SEEK_HOLE), hi);
+		while (pos < end) {
+			const size_t want = MIN(end - pos, sizeof(buf));
+			const ssize_t got = pread(fd, buf, want, pos);
+			if (got <= 0) {
+				if (got < 0 && errno == EINTR)
+					continue;
+				return -1;
+			}
+			throttle_io(&throttle, got);
+			for (size_t b = 0; b < (size_t)got; b += PAGE_SIZE) {
+				if (fill_isnull(&fill, buf, got, b, MIN((size_t)got - b, (size_t)PAGE_SIZE))) {
+					*found = pos + b;
+					return 1;
+				}
+			}
+			pos += got;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+
+	// Checks a file for null blocks: holes, or blocks that are allocated but all zero.
+	// -c gives a census of how much of the file is null, for ranking candidates.
+	if (argc < 2) {
+		printf("Error: You must specify one input file.\n");
+		return -1;
+	}
+
+	// Args:
+	// -5: show only 512-byte block diff/same
+	// -d: show only diff
+	// -s: show only same
+	// -r: show only ratio
+	// -4: show only 4096-byte block diff/same
+	// -n: don't count null blocks as indifferent
+	// -b: show if there is a null block
+	// -f: show filename if there is a null block
+	// -c: census; report hole, null and data bytes, and a coverage histogram
+	// -o order: search order for null blocks: seq (default), tail, stride, boundary
+	// -C bytes: chunk size for the stride and boundary orders (default 1 MiB)
+	// -x: cache the result in an extended attribute, and answer from it while the file is unchanged
+	// -p: dig holes; punch out every aligned null block, and report the space reclaimed
+	// -j threads: workers for -p (default: one per CPU), and for the null search (default: one;
+	// 	for fast arrays that one thread can't keep busy). Not with -o tail.
+	// -
+	
+	bool opt_showfile = false;
+	bool opt_shownull = false;
+	bool opt_census = false;
+	bool opt_cache = false;
+	bool opt_punch = false;
+	unsigned opt_jobs = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	bool opt_jobs_set = false;
+	scan_order_t opt_order = ORDER_SEQ;
+	size_t opt_chunk = 1 << 20;
+	int fidx = 1;
+
+	// --offset bytes, --length bytes: search only that range, which must be block-aligned.
+	// --shard file: write what the range holds to file, for nullmerge, instead of answering.
+	// --fill byte|pattern: sectors that hold only this are null too. See fill.h. With -p, their
+	// 	blocks are punched out like null ones; -x is ignored, as the record doesn't say which
+	// 	fill it was taken with.
+	shard_opts_t shard;
+	// --max-bandwidth rate, --ioprio class, --psi pct: go easy on shared storage. See throttle.h.
+	if (!shard_strip(&argc, argv, &shard) || !fill_strip(&argc, argv, &fill) || !throttle_strip(&argc, argv, &throttle))
+		return -1;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-f") == 0) {
+			opt_showfile = true;
+			if (fidx == i)
+				fidx++;
+		}
+		else if (strcmp(argv[i], "-b") == 0) {
+			opt_shownull = true;
+			if (fidx == i)
+				fidx++;
+		}
+		else if (strcmp(argv[i], "-c") == 0) {
+			opt_census = true;
+			if (fidx == i)
+				fidx++;
+		}
+		else if (strcmp(argv[i], "-x") == 0) {
+			opt_cache = true;
+			if (fidx == i)
+				fidx++;
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			opt_punch = true;
+			if (fidx == i)
+				fidx++;
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			i++;
+			opt_jobs = MAX(strtoul(argv[i], nullptr, 0), 1);
+			opt_jobs_set = true;
+			if (fidx == i - 1)
+				fidx += 2;
+		}
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+			static const char *const orders[] = {
+					[ORDER_SEQ] = "seq", [ORDER_TAIL] = "tail", [ORDER_STRIDE] = "stride", [ORDER_BOUNDARY] = "boundary"
+				};
+			i++;
+			size_t o = 0;
+			while (o < sizeof(orders) / sizeof(*orders) && strcmp(argv[i], orders[o]) != 0)
+				o++;
+			if (o == sizeof(orders) / sizeof(*orders)) {
+				fprintf(stderr, "Error: unknown search order %s.\n", argv[i]);
+				return -1;
+			}
+			opt_order = o;
+			if (fidx == i - 1)
+				fidx += 2;
+		}
+		else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+			i++;
+			opt_chunk = strtoull(argv[i], nullptr, 0);
+			if (fidx == i - 1)
+				fidx += 2;
+		}
+		else if (strcmp(argv[i], "--") == 0) {
+			fidx = i + 1;
+			break;
+		}
+	}
+	if (fidx >= argc) {
+		fprintf(stderr, "Error: file not detected on command line.\n");
+		return 1;
+	}
+	if (!throttle_start(&throttle))
+		return -1;
+	if (fill.on)
+		opt_cache = false;
+
+	const char *fpath = argv[fidx];
+	int in1 = open(fpath, O_NOATIME | (opt_punch ? O_RDWR : O_RDONLY));
+	if (in1 == -1) {
+		fprintf(stderr, "Unable to open %s", fpath);
+		perror(", ");
+		return -1;
+	}
+
+	struct stat stat_buf;
+	if (fstat(in1, &stat_buf) == -1) {
+		fprintf(stderr, "Error: Unable to stat %s\n", fpath);
+		close(in1);
+		return -1;
+	}
+	if (!S_ISREG(stat_buf.st_mode)) {
+		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", fpath);
+		close(in1);
+		return -1;
+	}
+
+	if (shard.ranged) {
+		if (opt_census || opt_punch || opt_cache) {
+			fprintf(stderr, "Error: --offset, --length and --shard don't mix with -c, -p or -x.\n");
+			close(in1);
+			return -1;
+		}
+		size_t lo, hi, found;
+		if (!shard_range(&shard, stat_buf.st_size, stat_buf.st_blksize, &lo, &hi)) {
+			close(in1);
+			return -1;
+		}
+		shard_rec_t rec = shard_new(SHARD_HASNULL, lo, hi, stat_buf.st_size, stat_buf.st_size, 0);
+		rec.flags |= (opt_shownull ? SH_SHOW_NULL : 0) | (opt_showfile ? SH_SHOW_FILE : 0);
+		int ret = range_scan(in1, stat_buf.st_size, lo, hi, stat_buf.st_blksize, &found);
+		close(in1);
+		if (ret < 0) {
+			fprintf(stderr, "Error: unable to read %s\n", fpath);
+			return -1;
+		}
+		if (ret == 1)
+			shard_first(&rec, found);
+		if (shard.out != nullptr)
+			return shard_write(shard.out, &rec, nullptr, opt_showfile ? fpath : nullptr) ? 0 : -1;
+		if (ret == 1)
+			shard_report_null(fpath, opt_shownull, opt_showfile);
+		return ret;
+	}
+
+	if (opt_punch) {
+		const int ret = dig_holes(fpath, in1, &stat_buf, opt_jobs, opt_showfile);
+		close(in1);
+		return ret;
+	}
+
+	const size_t in1_size = stat_buf.st_size;
+	f_in_info_t fin1 = {
+			.f_in = in1,
+			.size = in1_size,
+			.fd = in1
+		};
+
+	// A valid record is only as good as the block size it was taken with.
+	xc_rec_t rec = { };
+	census_t payload = { };
+	const bool cached = opt_cache && xc_load(in1, &stat_buf, &rec, &payload, sizeof(payload)) && rec.granularity == (uint32_t)stat_buf.st_blksize;
+	if (opt_cache && !cached)
+		rec = (xc_rec_t){ };
+
+	if (opt_census) {
+		census_t c;
+		if (cached && (rec.flags & XC_PAYLOAD) && rec.payload == sizeof(c)) {
+			census_report(fpath, &payload, fin1.size, stat_buf.st_blocks * 512, opt_showfile);
+			close(in1);
+			return 0;
+		}
+
+		const uint8_t *map = nullptr;
+		if (fin1.size > 0) {
+			map = mmap(NULL, fin1.size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE | MAP_NONBLOCK, fin1.fd, 0);
+			if (map == MAP_FAILED) {
+				close(in1);
+				fprintf(stderr, "Error: unable to mmap %s, ", fpath);
+				perror("");
+				return -1;
+			}
+			madvise((void *)map, fin1.size, MADV_SEQUENTIAL);
+		}
+
+		census(&c, fin1.fd, map, fin1.size, stat_buf.st_blksize);
+		if (opt_cache) {
+			rec.flags = (rec.flags & ~(XC_HOLE | XC_NULL)) | XC_HOLE_KNOWN | XC_NULL_KNOWN;
+			if (c.hole > 0)
+				rec.flags |= XC_HOLE | XC_NULL;
+			if (c.zero_pages > 0)
+				rec.flags |= XC_NULL;
+			rec.granularity = stat_buf.st_blksize;
+			xc_store(in1, &stat_buf, &rec, &c, sizeof(c));
+		}
+		census_report(fpath, &c, fin1.size, stat_buf.st_blocks * 512, opt_showfile);
+		close(in1);
+		return 0;
+	}
+
+	if (cached && (rec.flags & XC_NULL_KNOWN)) {
+		close(in1);
+		if (!(rec.flags & XC_NULL))
+			return 0;
+		shard_report_null(fpath, opt_shownull, opt_showfile);
+		return 1;
+	}
+
+	// null_scan() closes in1, so the record is stored through a second descriptor.
+	const int keep = opt_cache ? dup(in1) : -1;
+	const int ret = null_scan(fpath, in1, fin1, stat_buf, opt_order, opt_chunk, opt_jobs_set && opt_order != ORDER_TAIL ? opt_jobs : 1, opt_shownull, opt_showfile);
+	if (keep != -1) {
+		if (ret == 0 || ret == 1) {
+			rec.flags = (rec.flags & ~XC_NULL) | XC_NULL_KNOWN | (ret == 1 ? XC_NULL : 0);
+			rec.granularity = stat_buf.st_blksize;
+			xc_store(keep, &stat_buf, &rec, &payload, rec.payload == sizeof(payload) ? sizeof(payload) : 0);
+		}
+		close(keep);
+	}
+	return ret;
+}
+
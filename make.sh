@@ -5,8 +5,16 @@ if [ "$1" = "-o" ]; then
 	opt=( "-O2" )
 fi
 
-gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -o nullcombine  nullcombine.c
-gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -o nulldiff  nulldiff.c
+gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -pthread -o nullcombine  nullcombine.c
+gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -pthread -o nulldiff  nulldiff.c
 gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -o hashole  hashole.c
-gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -o hasnull  hasnull.c
+gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -pthread -o hasnull  hasnull.c
+gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -pthread -o nullcluster  nullcluster.c
+gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -o nullmerge  nullmerge.c
 
+
+# nulld links the tools in, each with its main() renamed.
+for tool in nulldiff nullcombine hasnull hashole; do
+	gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -pthread -Dmain=${tool}_main -c -o nulld-$tool.o $tool.c
+done
+gcc "${opt[@]}" -std=c23 -ggdb3 -march=native -pthread -o nulld  nulld.c nulld-nulldiff.o nulld-nullcombine.o nulld-hasnull.o nulld-hashole.o
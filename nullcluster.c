@@ -0,0 +1,294 @@
+
+
+// for SEEK_HOLE, etc
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/param.h>
+
+#include "likely.h"
+#include "nullvec.h"
+#include "blockhash.h"
+
+// Groups many partial copies into sets that can be merged with each other.
+//
+// Each file is read once, into one fingerprint per block. The groups are then found from the
+// fingerprints alone, in memory. Two files are compatible unless some block has data in both
+// with different fingerprints.
+//
+// A block that is only partly null (some of its sectors are all zero) can't be judged from a
+// fingerprint: the zero sectors might be missing data. Neither can a block cut short by the end
+// of the file, as a longer copy may go on where this one stops. Those blocks match anything, so a
+// fingerprint conflict is a real conflict as far as whole null sectors go. nulldiff takes nulls
+// byte by byte, though: a sector that's only partly zero in one copy and whole in another
+// conflicts here, and files that differ only that way are split apart although nulldiff would
+// merge them. Run nulldiff on the groups to confirm them, and across groups to join those.
+
+#define FP_NULL		0	// Hole or all-zero block.
+#define FP_PARTIAL	1	// Mixed zero and data sectors, or cut short; compatible with anything.
+#define FP_SECTOR	512	// Granularity of the partial check.
+
+#define READ_SIZE	(4 << 20)	// Bytes per pread, rounded to whole blocks.
+
+static inline size_t read_chunk(const size_t blocksize) {
+	return MAX(READ_SIZE / blocksize, 1) * blocksize;
+}
+
+typedef struct {
+		const char *path;
+		uint64_t *fp;	// One per block.
+		size_t nblocks;
+		size_t ndata;	// Blocks with data, for ordering.
+		bool failed;
+	} cl_file_t;
+
+typedef struct {
+		cl_file_t *files;
+		size_t nfiles;
+		size_t blocksize;
+		atomic_size_t next;	// Next file to fingerprint.
+	} cl_job_t;
+
+// The fingerprint of the n bytes of a block of blocksize; n is less at the end of the file.
+static inline uint64_t fingerprint(const uint8_t *const data, const size_t n, const size_t blocksize) {
+	size_t zero_sectors = 0, sectors = 0;
+	for (size_t off = 0; off < n; off += FP_SECTOR, sectors++) {
+		if (nullvec_iszero(data + off, MIN(n - off, FP_SECTOR)))
+			zero_sectors++;
+	}
+	if (zero_sectors == sectors)
+		return FP_NULL;
+	if (zero_sectors > 0 || n < blocksize)
+		return FP_PARTIAL;
+
+	const uint64_t h = blockhash64(data, n, 0);
+	// Keep clear of the two reserved values.
+	return h > FP_PARTIAL ? h : h + 2;
+}
+
+// Read one file, hole-aware, into its fingerprint array.
+static bool fingerprint_file(cl_file_t f[const static 1], const size_t blocksize, uint8_t *const buf) {
+	const int fd = open(f->path, O_RDONLY | O_NOATIME);
+	if (fd == -1) {
+		fprintf(stderr, "Unable to open %s", f->path);
+		perror(", ");
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", f->path);
+		close(fd);
+		return false;
+	}
+	const size_t size = st.st_size;
+
+	f->nblocks = (size + blocksize - 1) / blocksize;
+	f->fp = calloc(MAX(f->nblocks, 1), sizeof(*f->fp));	// All FP_NULL.
+	if (f->fp == nullptr) {
+		fprintf(stderr, "Unable to allocate fingerprints for %s.\n", f->path);
+		close(fd);
+		return false;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	size_t off = 0;
+	while (off < size) {
+		const off_t data = lseek(fd, off, SEEK_DATA);
+		if (data == -1)
+			break;	// Only holes from here; those blocks stay null.
+		// Holes are skipped whole blocks at a time; the block holding the previous extent's
+		// end may already be done.
+		off = MAX(off, data / blocksize * blocksize);
+
+		off_t hole = lseek(fd, data, SEEK_HOLE);
+		if (hole == -1)
+			hole = size;
+
+		// Every block that overlaps this extent.
+		while (off < (size_t)hole) {
+			const size_t want = MIN(size - off, read_chunk(blocksize));
+			size_t got = 0;
+			while (got < want) {
+				const ssize_t r = pread(fd, buf + got, want - got, off + got);
+				if (r <= 0) {
+					if (r < 0 && errno == EINTR)
+						continue;
+					fprintf(stderr, "Error reading %s", f->path);
+					perror(", ");
+					close(fd);
+					return false;
+				}
+				got += r;
+			}
+
+			for (size_t b = 0; b < got; b += blocksize) {
+				const uint64_t fp = fingerprint(buf + b, MIN(got - b, blocksize), blocksize);
+				f->fp[(off + b) / blocksize] = fp;
+				if (fp != FP_NULL)
+					f->ndata++;
+			}
+			off += got;
+		}
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+	return true;
+}
+
+static void *fingerprint_worker(void *arg) {
+	cl_job_t *const job = arg;
+
+	uint8_t *const buf = malloc(read_chunk(job->blocksize));
+	if (buf == nullptr) {
+		fprintf(stderr, "Unable to allocate read buffer.\n");
+		return (void *)1;
+	}
+
+	size_t i;
+	while ((i = atomic_fetch_add(&job->next, 1)) < job->nfiles) {
+		if (!fingerprint_file(&job->files[i], job->blocksize, buf))
+			job->files[i].failed = true;
+	}
+
+	free(buf);
+	return nullptr;
+}
+
+static bool compatible(const cl_file_t a[const static 1], const cl_file_t b[const static 1]) {
+	const size_t n = MIN(a->nblocks, b->nblocks);
+	for (size_t i = 0; i < n; i++) {
+		const uint64_t fa = a->fp[i], fb = b->fp[i];
+		if (fa > FP_PARTIAL && fb > FP_PARTIAL && fa != fb)
+			return false;
+	}
+	return true;
+}
+
+// Most complete first, so each group starts from its best member.
+static int by_data_desc(const void *a, const void *b) {
+	const cl_file_t *const fa = *(cl_file_t *const *)a;
+	const cl_file_t *const fb = *(cl_file_t *const *)b;
+	return (fa->ndata < fb->ndata) - (fa->ndata > fb->ndata);
+}
+
+int main(int argc, char **argv) {
+
+	// -b bytes: fingerprint block size (default 256 KiB). Smaller blocks judge partial
+	// 	copies more closely, at more memory per file.
+	// -j threads: files fingerprinted at once (default: online CPUs)
+	//
+	// Output: one line per file, "<group>\t<path>". Every file in a group is compatible with
+	// every other.
+	size_t blocksize = 256 << 10;
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int ci;
+	while ((ci = getopt(argc, argv, "b:j:")) != -1) {
+		switch (ci) {
+			case 'b':
+				blocksize = strtoull(optarg, nullptr, 0);
+				break;
+			case 'j':
+				nthreads = strtol(optarg, nullptr, 0);
+				break;
+			default:
+				return -1;
+		}
+	}
+
+	if (blocksize < FP_SECTOR || blocksize % FP_SECTOR != 0) {
+		fprintf(stderr, "Error: block size must be a multiple of %i.\n", FP_SECTOR);
+		return -1;
+	}
+	if (argc - optind < 2) {
+		fprintf(stderr, "Error: You must specify at least two input files.\n");
+		return -1;
+	}
+
+	cl_job_t job = {
+			.nfiles = argc - optind,
+			.blocksize = blocksize,
+		};
+	job.files = calloc(job.nfiles, sizeof(*job.files));
+	if (job.files == nullptr) {
+		fprintf(stderr, "Unable to allocate file list.\n");
+		return -1;
+	}
+	for (size_t i = 0; i < job.nfiles; i++)
+		job.files[i].path = argv[optind + i];
+
+	nthreads = MAX(MIN(nthreads, (long)job.nfiles), 1);
+	pthread_t threads[nthreads];
+	for (long t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t], nullptr, fingerprint_worker, &job) != 0) {
+			// Whoever did start will take the rest.
+			nthreads = t;
+			break;
+		}
+	}
+	if (nthreads == 0)
+		fingerprint_worker(&job);
+	int ret = 0;
+	for (long t = 0; t < nthreads; t++) {
+		void *res;
+		pthread_join(threads[t], &res);
+		if (res != nullptr)
+			ret = -1;
+	}
+	for (size_t i = 0; i < job.nfiles; i++) {
+		if (job.files[i].failed)
+			ret = -1;
+	}
+	if (ret != 0)
+		return ret;
+
+	// Greedy grouping: each file joins the first group it's compatible with throughout.
+	cl_file_t *order[job.nfiles];
+	for (size_t i = 0; i < job.nfiles; i++)
+		order[i] = &job.files[i];
+	qsort(order, job.nfiles, sizeof(*order), by_data_desc);
+
+	size_t group[job.nfiles];
+	size_t ngroups = 0;
+	for (size_t i = 0; i < job.nfiles; i++) {
+		size_t g;
+		for (g = 0; g < ngroups; g++) {
+			bool ok = true;
+			for (size_t j = 0; j < i && ok; j++) {
+				if (group[j] == g)
+					ok = compatible(order[i], order[j]);
+			}
+			if (ok)
+				break;
+		}
+		group[i] = g;
+		if (g == ngroups)
+			ngroups++;
+	}
+
+	for (size_t g = 0; g < ngroups; g++) {
+		for (size_t i = 0; i < job.nfiles; i++) {
+			if (group[i] == g)
+				printf("%zu\t%s\n", g, order[i]->path);
+		}
+	}
+
+	for (size_t i = 0; i < job.nfiles; i++)
+		free(job.files[i].fp);
+	free(job.files);
+
+	return 0;
+}
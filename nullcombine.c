@@ -6,6 +6,30 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "likely.h"
+#include "probes.h"
+#include "nullvec.h"
+#include "qcow2.h"
+#include "shard.h"
+#include "sha256.h"
+#include "fill.h"
+#include "torrent.h"
 
 #define least(x,y) ( x < y ? x : y)
 #define greatest(x,y) ( x < y ? y : x)
@@ -15,48 +39,1642 @@
 // If it is that value, then we can write nulls without worrying about sparse-ness.
 #define BUF_SIZE	4096	// 2^13
 
-char zero[BUF_SIZE] = {0};
+static char zero[BUF_SIZE] = {0};
+static fill_t fill;
+
+// Coverage map: one bit per BUF_SIZE block of the merged output, set when the block is "filled".
+// A later run given the same map skips the filled blocks entirely, so only the missing blocks
+// of the new input are read.
+//
+// A block counts as filled only when none of its COV_SECTOR-sized sectors is entirely null: a
+// rescue tool may have left a single missing sector inside an otherwise complete block, and
+// that sector must be looked at again next time.
+#define COV_SECTOR	512
+#define COV_MAGIC	"NCOVMAP1"
+
+typedef struct {
+		char magic[8];
+		uint32_t blksize;
+		uint32_t reserved;
+		uint64_t size;		// Length of the image the map describes.
+	} cov_hdr_t;
+
+static inline bool cov_test(const uint8_t *const cov, const size_t blk) {
+	return cov[blk >> 3] & (1 << (blk & 7));
+}
+
+static inline void cov_set(uint8_t *const cov, const size_t blk) {
+	cov[blk >> 3] |= 1 << (blk & 7);
+}
+
+// True if no sector of the merged block is null. The merge takes whichever side is non-null,
+// so a merged sector is null only if it's null in both inputs.
+static bool cov_filled(const char *const buf1, const int len1, const char *const buf2, const int len2) {
+	const int len = greatest(len1, len2);
+	if (len < BUF_SIZE)
+		// Short blocks are only at end-of-file; keep looking at them.
+		return false;
+
+	for (int off = 0; off < len; off += COV_SECTOR) {
+		const bool null1 = off >= len1 || !memcmp(buf1 + off, zero, least(COV_SECTOR, len1 - off));
+		const bool null2 = off >= len2 || !memcmp(buf2 + off, zero, least(COV_SECTOR, len2 - off));
+		if (null1 && null2)
+			return false;
+	}
+	return true;
+}
+
+// Load a coverage map for an image of `size` bytes. Returns nullptr if the map is missing or
+// doesn't describe this image; the caller then merges everything.
+static uint8_t *cov_load(const char *const path, const size_t size, const size_t nbytes) {
+	FILE *f = fopen(path, "rb");
+	if (f == nullptr) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "Unable to open coverage map %s", path);
+			perror(", ");
+		}
+		return nullptr;
+	}
+
+	cov_hdr_t hdr;
+	uint8_t *cov = nullptr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, COV_MAGIC, sizeof(hdr.magic)) != 0
+			|| hdr.blksize != BUF_SIZE) {
+		fprintf(stderr, "Warning: %s is not a coverage map; merging everything.\n", path);
+		goto out;
+	}
+	if (hdr.size != size) {
+		fprintf(stderr, "Warning: coverage map %s is for a %lu-byte image, not %lu; merging everything.\n",
+				path, (unsigned long)hdr.size, size);
+		goto out;
+	}
+
+	cov = calloc(nbytes, 1);
+	if (cov == nullptr) {
+		fprintf(stderr, "Unable to allocate %lu bytes for coverage map.\n", nbytes);
+		goto out;
+	}
+	// The new map may be longer than the old one; the extra blocks are unfilled.
+	const size_t have = (size + BUF_SIZE - 1) / BUF_SIZE;
+	if (fread(cov, 1, (have + 7) / 8, f) != (have + 7) / 8) {
+		fprintf(stderr, "Warning: coverage map %s is truncated; merging everything.\n", path);
+		free(cov);
+		cov = nullptr;
+	}
+
+out:
+	fclose(f);
+	return cov;
+}
+
+// Write the map next to its final name and rename it over, so an interrupted run never leaves
+// a map that claims more than the image holds.
+static bool cov_store(const char *const path, const uint8_t *const cov, const size_t size) {
+	char tmppath[strlen(path) + sizeof(".tmp")];
+	sprintf(tmppath, "%s.tmp", path);
+
+	FILE *f = fopen(tmppath, "wb");
+	if (f == nullptr) {
+		fprintf(stderr, "Unable to create coverage map %s", tmppath);
+		perror(", ");
+		return false;
+	}
+
+	const cov_hdr_t hdr = { .magic = COV_MAGIC, .blksize = BUF_SIZE, .reserved = 0, .size = size };
+	const size_t nbytes = ((size + BUF_SIZE - 1) / BUF_SIZE + 7) / 8;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(cov, 1, nbytes, f) != nbytes || fclose(f) != 0) {
+		perror("Writing coverage map");
+		unlink(tmppath);
+		return false;
+	}
+	if (rename(tmppath, path) != 0) {
+		perror("Renaming coverage map");
+		unlink(tmppath);
+		return false;
+	}
+	return true;
+}
+
+// An in-memory set of byte ranges, kept sorted and coalesced.
+typedef struct {
+		struct {
+			size_t start, end;
+		} *v;
+		size_t n, cap;
+	} extset_t;
+
+// Index of the first range that ends at or after off.
+static size_t ext_find(const extset_t set[const static 1], const size_t off) {
+	size_t lo = 0, hi = set->n;
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+		if (set->v[mid].end < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static bool ext_add(extset_t set[const static 1], size_t start, size_t end) {
+	if (start >= end)
+		return true;
+
+	// Fast path: appending in order, as the first pass does.
+	if (set->n > 0 && set->v[set->n - 1].end == start) {
+		set->v[set->n - 1].end = end;
+		return true;
+	}
+
+	// Anything before this is untouched.
+	const size_t lo = ext_find(set, start);
+
+	// Swallow every range that touches [start, end).
+	size_t last = lo;
+	while (last < set->n && set->v[last].start <= end) {
+		start = least(start, set->v[last].start);
+		end = greatest(end, set->v[last].end);
+		last++;
+	}
+
+	if (last == lo) {
+		if (set->n == set->cap) {
+			const size_t cap = set->cap ? set->cap * 2 : 64;
+			typeof(set->v) v = realloc(set->v, cap * sizeof(*v));
+			if (v == nullptr)
+				return false;
+			set->v = v;
+			set->cap = cap;
+		}
+		memmove(set->v + lo + 1, set->v + lo, (set->n - lo) * sizeof(*set->v));
+		set->n++;
+	}
+	else if (last > lo + 1) {
+		memmove(set->v + lo + 1, set->v + last, (set->n - last) * sizeof(*set->v));
+		set->n -= last - lo - 1;
+	}
+	set->v[lo].start = start;
+	set->v[lo].end = end;
+	return true;
+}
+
+// --follow: after the first pass, keep merging whatever lands in the second input.
+//
+// Only blocks that were complete in the second input -- no null sector -- are recorded as done.
+// Anything else may still be in the middle of being written, so it's looked at again on the next
+// wake-up. Data rewritten inside a block that was already complete is not picked up.
+#define FOLLOW_CHUNK	(256 * BUF_SIZE)	// Bytes read per pread while following.
+#define FOLLOW_POLL_MS	1000	// Rescan at least this often, in case inotify misses a write (mmap).
+#define FOLLOW_SETTLE_MS	250	// Batch up bursts of writes into one rescan.
+
+// A qcow2 input, read through stdio like a raw one.
+typedef struct {
+		qcow2_t q;
+		off_t pos;
+	} qcow2_stream_t;
+
+static ssize_t qcow2_stream_read(void *cookie, char *buf, size_t n) {
+	qcow2_stream_t *const s = cookie;
+	const ssize_t got = qcow2_pread(&s->q, buf, n, s->pos);
+	if (got > 0)
+		s->pos += got;
+	return got;
+}
+
+static int qcow2_stream_seek(void *cookie, off64_t *off, int whence) {
+	qcow2_stream_t *const s = cookie;
+	const off_t base = whence == SEEK_SET ? 0 : whence == SEEK_CUR ? s->pos : (off_t)s->q.size;
+	if (base + *off < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	s->pos = *off = base + *off;
+	return 0;
+}
+
+static int qcow2_stream_close(void *cookie) {
+	qcow2_stream_t *const s = cookie;
+	const int fd = s->q.fd;
+	qcow2_close(&s->q);
+	free(s);
+	return close(fd);
+}
+
+// An input read through --fill: its fill sectors read as nulls, so everything downstream sees
+// them as it would a pre-converted image. Reads end on a sector boundary, so that no sector is
+// judged by half of it.
+typedef struct {
+		FILE *f;
+		off_t pos;
+	} fill_stream_t;
+
+static ssize_t fill_stream_read(void *cookie, char *buf, size_t n) {
+	fill_stream_t *const s = cookie;
+	const size_t end = (s->pos + n) & -(size_t)FILL_SECTOR;
+	if (end > (size_t)s->pos)
+		n = end - s->pos;
+	const size_t got = fread(buf, 1, n, s->f);
+	if (got == 0)
+		return ferror(s->f) ? -1 : 0;
+	fill_clear(&fill, (uint8_t *)buf, got, s->pos);
+	s->pos += got;
+	return got;
+}
+
+static int fill_stream_seek(void *cookie, off64_t *off, int whence) {
+	fill_stream_t *const s = cookie;
+	if (fseeko(s->f, *off, whence) != 0)
+		return -1;
+	s->pos = *off = ftello(s->f);
+	return 0;
+}
+
+static int fill_stream_close(void *cookie) {
+	fill_stream_t *const s = cookie;
+	const int ret = fclose(s->f);
+	free(s);
+	return ret;
+}
+
+static FILE *fill_stream(FILE *const in) {
+	fill_stream_t *const s = malloc(sizeof(*s));
+	if (s == nullptr) {
+		fclose(in);
+		return nullptr;
+	}
+	*s = (fill_stream_t){ .f = in, .pos = ftello(in) };
+	// The wrapper buffers; reads go straight into its buffer.
+	setvbuf(in, nullptr, _IONBF, 0);
+	FILE *const f = fopencookie(s, "rb", (cookie_io_functions_t){
+			.read = fill_stream_read,
+			.seek = fill_stream_seek,
+			.close = fill_stream_close,
+		});
+	if (f == nullptr)
+		fill_stream_close(s);
+	return f;
+}
+
+// Open an input, raw or qcow2. size is what it holds: the file size, or the virtual disk size.
+static FILE *open_input(const char *const path, size_t size[const static 1], bool qcow[const static 1]) {
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return nullptr;
+
+	*qcow = qcow2_probe(fd);
+	if (!*qcow) {
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return nullptr;
+		}
+		*size = st.st_size;
+		return fdopen(fd, "rb");
+	}
+
+	qcow2_stream_t *const s = calloc(1, sizeof(*s));
+	if (s == nullptr || !qcow2_open(&s->q, fd, path)) {
+		free(s);
+		close(fd);
+		return nullptr;
+	}
+	*size = s->q.size;
+	FILE *const f = fopencookie(s, "rb", (cookie_io_functions_t){
+			.read = qcow2_stream_read,
+			.seek = qcow2_stream_seek,
+			.close = qcow2_stream_close,
+		});
+	if (f == nullptr)
+		qcow2_stream_close(s);
+	return f;
+}
+
+// --sha256/--expect: the output goes through a stream that hashes what it holds as it's
+// written. Skipping ahead over a null span hashes zeros for it, without a buffer; nothing
+// may be written behind what's already hashed.
+typedef struct {
+		int fd;
+		FILE *next;	// Written through instead of fd, if set.
+		off_t pos;	// Stream position.
+		off_t hashed;	// The output up to here is hashed.
+		bool behind;	// Something was written behind hashed; the digest is meaningless.
+		sha256_t sha;
+	} hash_stream_t;
+
+static ssize_t hash_stream_write(void *cookie, const char *buf, size_t n) {
+	hash_stream_t *const s = cookie;
+	if (s->pos > s->hashed)
+		sha256_zeros(&s->sha, s->pos - s->hashed);
+	else if (s->pos < s->hashed)
+		s->behind = true;
+
+	size_t done = 0;
+	if (s->next != nullptr)
+		done = fwrite(buf, 1, n, s->next);
+	while (s->next == nullptr && done < n) {
+		const ssize_t w = write(s->fd, buf + done, n - done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			break;
+		done += w;
+	}
+	sha256_update(&s->sha, buf, done);
+	s->pos += done;
+	s->hashed = s->pos;
+	return done > 0 ? (ssize_t)done : -1;
+}
+
+static int hash_stream_seek(void *cookie, off64_t *off, int whence) {
+	hash_stream_t *const s = cookie;
+	if (whence == SEEK_END) {
+		errno = EINVAL;
+		return -1;
+	}
+	const off_t to = (whence == SEEK_SET ? 0 : s->pos) + *off;
+	if (s->next != nullptr) {
+		if (to < 0 || fseeko(s->next, to, SEEK_SET) != 0)
+			return -1;
+	}
+	else if (to < 0 || lseek(s->fd, to, SEEK_SET) == -1) {
+		if (to < s->pos || errno != ESPIPE)
+			return -1;
+		// A pipe: write the nulls out.
+		for (off_t left = to - s->pos; left > 0; ) {
+			const ssize_t w = write(s->fd, zero, least(left, BUF_SIZE));
+			if (w <= 0)
+				return -1;
+			left -= w;
+		}
+	}
+	s->pos = *off = to;
+	return 0;
+}
+
+// Block-device output: seeking over a null span would leave the disk's old data there, so the
+// output goes through a stream that zeroes those spans instead. Data is gathered into large
+// writes that start on a block boundary. Null spans of at least BDEV_HOLE_MIN are put
+// together and zeroed by the device in one request each with BLKZEROOUT, which the kernel turns
+// into WRITE ZEROES, and so an unmap, where the device supports it. (BLKDISCARD is no use: no
+// kernel since 4.12 says discarded blocks read back as zeros.) Shorter spans go out as zeros with
+// the data around them.
+#define BDEV_BUF	(8 << 20)
+#define BDEV_HOLE_MIN	(64 << 10)
+
+typedef struct {
+		int fd;
+		uint64_t size;	// Of the device.
+		unsigned sector;	// Its logical block size.
+		off_t pos;	// Stream position.
+		off_t buf_off;	// buf holds [buf_off, buf_off + len), not yet written.
+		size_t len;
+		size_t zeros;	// Nulls skipped over at the end of buf.
+		off_t hole_off, hole_end;	// A null span not yet zeroed.
+		uint8_t *buf;
+		int err;	// errno of the first failure; the stream goes on failing after it.
+		uint64_t written, zeroed;
+	} bdev_stream_t;
+
+static bool bdev_pwrite(bdev_stream_t s[const static 1], const uint8_t *const buf, const size_t n, const off_t off) {
+	for (size_t done = 0; done < n; ) {
+		const ssize_t w = pwrite(s->fd, buf + done, n - done, off + done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0) {
+			s->err = w < 0 ? errno : ENOSPC;
+			return false;
+		}
+		done += w;
+	}
+	return true;
+}
+
+static bool bdev_flush_data(bdev_stream_t s[const static 1]) {
+	if (s->len == 0)
+		return true;
+	probe(flush, s->buf_off, s->len);
+	if (!bdev_pwrite(s, s->buf, s->len, s->buf_off))
+		return false;
+	s->written += s->len;
+	s->buf_off += s->len;
+	s->len = 0;
+	return true;
+}
+
+// Zero [hole_off, hole_end): the device does the whole sectors, and the ragged ends are written.
+static bool bdev_flush_hole(bdev_stream_t s[const static 1]) {
+	const off_t off = s->hole_off, end = least(s->hole_end, (off_t)s->size);
+	s->hole_off = s->hole_end = 0;
+	if (off >= end)
+		return true;
+	const off_t from = least((off + s->sector - 1) / s->sector * s->sector, end);
+	const off_t to = greatest(end / s->sector * s->sector, from);
+	for (off_t b = off; b < from; b += BUF_SIZE) {
+		if (!bdev_pwrite(s, (const uint8_t *)zero, least(from - b, BUF_SIZE), b))
+			return false;
+	}
+	if (to > from) {
+		uint64_t range[2] = { from, to - from };
+		probe(zeroout, from, to - from);
+		if (ioctl(s->fd, BLKZEROOUT, range) != 0) {
+			s->err = errno;
+			return false;
+		}
+	}
+	for (off_t b = to; b < end; b += BUF_SIZE) {
+		if (!bdev_pwrite(s, (const uint8_t *)zero, least(end - b, BUF_SIZE), b))
+			return false;
+	}
+	s->zeroed += end - off;
+	return true;
+}
+
+// Add n bytes at the end of buf, nulls if data is nullptr.
+static bool bdev_put(bdev_stream_t s[const static 1], const char *const data, size_t n) {
+	for (size_t done = 0; done < n; ) {
+		const size_t take = least(n - done, BDEV_BUF - s->len);
+		if (data != nullptr)
+			memcpy(s->buf + s->len, data + done, take);
+		else
+			memset(s->buf + s->len, 0, take);
+		s->len += take;
+		done += take;
+		if (s->len == BDEV_BUF && !bdev_flush_data(s))
+			return false;
+	}
+	return true;
+}
+
+static ssize_t bdev_stream_write(void *cookie, const char *buf, size_t n) {
+	bdev_stream_t *const s = cookie;
+	if (s->err != 0) {
+		errno = s->err;
+		return -1;
+	}
+	if (s->hole_end > s->hole_off) {
+		// Start the data on a sector boundary, with the ragged end of the hole.
+		const off_t from = greatest(s->hole_off, s->pos / s->sector * s->sector);
+		s->hole_end = from;
+		if (!bdev_flush_hole(s))
+			return -1;
+		s->buf_off = from;
+		if (!bdev_put(s, nullptr, s->pos - from))
+			return -1;
+	}
+	else if (s->len == 0) {
+		s->buf_off = s->pos;
+	}
+	if (!bdev_put(s, buf, n))
+		return -1;
+	s->zeros = 0;
+	s->pos += n;
+	return n;
+}
+
+static int bdev_stream_seek(void *cookie, off64_t *off, int whence) {
+	bdev_stream_t *const s = cookie;
+	if (whence == SEEK_END || s->err != 0) {
+		errno = s->err != 0 ? s->err : EINVAL;
+		return -1;
+	}
+	const off_t to = (whence == SEEK_SET ? 0 : s->pos) + *off;
+	if (to < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (to < s->pos) {
+		// Going back: everything so far goes out first.
+		if (!bdev_flush_data(s) || !bdev_flush_hole(s))
+			return -1;
+	}
+	else if (s->hole_end > s->hole_off) {
+		s->hole_end = to;
+	}
+	else if (to > s->pos) {
+		// Nulls go into buf until, with the ones right before them, they add up to
+		// BDEV_HOLE_MIN. Then they're a hole of their own, from the first sector boundary in them.
+		const off_t start = s->pos - least(s->zeros, s->len);
+		if (s->len > 0 && to - start < BDEV_HOLE_MIN) {
+			if (!bdev_put(s, nullptr, to - s->pos))
+				return -1;
+			s->zeros += to - s->pos;
+		}
+		else {
+			const off_t from = s->len > 0 ? least((start + s->sector - 1) / s->sector * s->sector, to) : s->pos;
+			if (from > s->pos && !bdev_put(s, nullptr, from - s->pos))
+				return -1;
+			if (from < s->pos)
+				s->len -= s->pos - from;
+			if (!bdev_flush_data(s))
+				return -1;
+			s->zeros = 0;
+			s->hole_off = from;
+			s->hole_end = to;
+		}
+	}
+	s->pos = *off = to;
+	return 0;
+}
+
+// Set up s for the block device fd, which must hold size bytes.
+static bool bdev_open(bdev_stream_t s[const static 1], const int fd, const size_t size) {
+	*s = (bdev_stream_t){ .fd = fd, .sector = 512 };
+	int sector = 0;
+	if (ioctl(fd, BLKGETSIZE64, &s->size) != 0) {
+		perror("Error: Unable to get the size of the output device");
+		return false;
+	}
+	if (s->size < size) {
+		fprintf(stderr, "Error: The output device holds %lu bytes; the output is %zu.\n", (unsigned long)s->size, size);
+		return false;
+	}
+	if (ioctl(fd, BLKSSZGET, &sector) == 0 && sector > 0)
+		s->sector = sector;
+	s->buf = aligned_alloc(BUF_SIZE, BDEV_BUF);
+	if (s->buf == nullptr) {
+		fprintf(stderr, "Unable to allocate the output buffer.\n");
+		return false;
+	}
+	return true;
+}
+
+// End the output at size: the rest of the way there is null, and nothing past it is touched.
+// Everything goes out to the device.
+static bool bdev_finish(bdev_stream_t s[const static 1], const off_t size) {
+	if (s->err == 0 && s->pos < size) {
+		off64_t off = size - s->pos;
+		bdev_stream_seek(s, &off, SEEK_CUR);
+	}
+	if (s->hole_end > size)
+		s->hole_end = size;
+	const bool ok = s->err == 0 && bdev_flush_data(s) && bdev_flush_hole(s) && fsync(s->fd) == 0;
+	if (!ok && s->err != 0)
+		errno = s->err;
+	free(s->buf);
+	s->buf = nullptr;
+	return ok;
+}
+
+static volatile sig_atomic_t follow_stop = 0;
+
+static void follow_on_signal(int) {
+	follow_stop = 1;
+}
+
+typedef struct {
+		int in2;	// The growing input.
+		int out;	// The merged image.
+		int prefer_side;
+		uint8_t *cov;	// Coverage map of the output, or nullptr.
+		size_t cov_blocks;	// Blocks the map has room for.
+		extset_t done;	// Ranges of the second input that are merged and complete.
+	} follow_t;
+
+// Merge [off, off + len) of the growing input into the output. Returns false on a conflict or
+// I/O error, which ends following.
+static bool follow_merge(follow_t fl[const static 1], size_t off, const size_t len) {
+	static char in2buf[FOLLOW_CHUNK];
+	static char outbuf[FOLLOW_CHUNK];
+
+	const size_t end = off + len;
+	while (off < end) {
+		const size_t want = least(end - off, FOLLOW_CHUNK);
+		const ssize_t got2 = pread(fl->in2, in2buf, want, off);
+		if (got2 <= 0) {
+			if (got2 < 0) {
+				perror("Reading growing input");
+				return false;
+			}
+			// Truncated under us. Nothing more to do here.
+			return true;
+		}
+		ssize_t got_out = pread(fl->out, outbuf, got2, off);
+		if (got_out < 0) {
+			perror("Reading merged output");
+			return false;
+		}
+		// Past the output's end reads as null.
+		memset(outbuf + got_out, 0, got2 - got_out);
+		fill_clear(&fill, (uint8_t *)in2buf, got2, off);
+		fill_clear(&fill, (uint8_t *)outbuf, got_out, off);
+
+		for (size_t b = 0; b < (size_t)got2; b += BUF_SIZE) {
+			const int n = least((size_t)got2 - b, BUF_SIZE);
+			char *const o = outbuf + b;
+			const char *const i2 = in2buf + b;
+
+			if (!memcmp(i2, zero, n))
+				continue;
+
+			char merged[BUF_SIZE];
+			const size_t bad = nullvec_merge((uint8_t *)merged, (const uint8_t *)o, (const uint8_t *)i2, n, fl->prefer_side, nullptr);
+			if (bad < (size_t)n) {
+				probe(conflict, off + b + bad);
+				fprintf(stderr, "Error: Files mismatch\n");
+				fprintf(stderr, "Error: Files mismatch (at byte %li)\n", off + b + bad);
+				return false;
+			}
+
+			if (memcmp(merged, o, n) != 0) {
+				memcpy(o, merged, n);
+				probe(flush, off + b, n);
+				if (pwrite(fl->out, o, n, off + b) != n) {
+					perror("Writing merged output");
+					return false;
+				}
+			}
+
+			const size_t blk = (off + b) / BUF_SIZE;
+			if (fl->cov != nullptr && blk < fl->cov_blocks && cov_filled(o, n, "", 0))
+				cov_set(fl->cov, blk);
+			if (cov_filled("", 0, i2, n) && !ext_add(&fl->done, off + b, off + b + n)) {
+				fprintf(stderr, "Unable to allocate memory for the merged-extent set.\n");
+				return false;
+			}
+		}
+
+		off += got2;
+	}
+	return true;
+}
+
+// Walk the growing input's data extents, and merge the parts that aren't done yet.
+static bool follow_rescan(follow_t fl[const static 1]) {
+	struct stat st;
+	if (fstat(fl->in2, &st) != 0) {
+		perror("Stat of growing input");
+		return false;
+	}
+	const size_t size2 = st.st_size;
+
+	size_t off = 0;
+	while (off < size2) {
+		const off_t data = lseek(fl->in2, off, SEEK_DATA);
+		if (data == -1)
+			break;
+		off_t hole = lseek(fl->in2, data, SEEK_HOLE);
+		if (hole == -1)
+			hole = size2;
+
+		// Whole blocks, so a block is never half merged.
+		size_t start = data & ~(size_t)(BUF_SIZE - 1);
+		const size_t hole_up = ((size_t)hole + BUF_SIZE - 1) & ~(size_t)(BUF_SIZE - 1);
+		const size_t end = least(hole_up, size2);
+
+		while (start < end) {
+			// Merging adds to the done set, so look our place up each time around.
+			size_t di = ext_find(&fl->done, start);
+			if (di < fl->done.n && fl->done.v[di].end == start)
+				di++;
+			if (di < fl->done.n && fl->done.v[di].start <= start) {
+				start = fl->done.v[di].end;
+				continue;
+			}
+			const size_t gap_end = di < fl->done.n ? least(end, fl->done.v[di].start) : end;
+
+			if (!follow_merge(fl, start, gap_end - start))
+				return false;
+			start = gap_end;
+		}
+
+		off = hole;
+	}
+
+	// The output is as long as the longest input.
+	if (fstat(fl->out, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size < size2) {
+		if (ftruncate(fl->out, size2) != 0) {
+			perror("Extending merged output");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void msleep(const int ms) {
+	const struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+	nanosleep(&ts, nullptr);
+}
+
+// Follow the growing input until a signal, until it's deleted or renamed away, or until it has
+// been idle for idle_secs (0: forever). Returns false on error.
+static bool follow_loop(follow_t fl[const static 1], const char *const path2, const int idle_secs) {
+	const int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ifd == -1) {
+		perror("inotify_init1");
+		return false;
+	}
+	if (inotify_add_watch(ifd, path2, IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF) == -1) {
+		fprintf(stderr, "Unable to watch %s", path2);
+		perror(", ");
+		close(ifd);
+		return false;
+	}
+
+	struct sigaction sa = { .sa_handler = follow_on_signal };
+	sigaction(SIGINT, &sa, nullptr);
+	sigaction(SIGTERM, &sa, nullptr);
+
+	bool ok = true;
+	bool gone = false;
+	int idle_ms = 0;
+	// Anything written between the first pass and the watch being set up.
+	ok = follow_rescan(fl);
+
+	while (ok && !gone && !follow_stop) {
+		struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+		const int pr = poll(&pfd, 1, FOLLOW_POLL_MS);
+		if (pr < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			ok = false;
+			break;
+		}
+
+		if (pr > 0) {
+			idle_ms = 0;
+			msleep(FOLLOW_SETTLE_MS);
+
+			char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+			ssize_t len;
+			while ((len = read(ifd, evbuf, sizeof(evbuf))) > 0) {
+				for (char *p = evbuf; p < evbuf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+					if (((struct inotify_event *)p)->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+						gone = true;
+				}
+			}
+		}
+		else {
+			idle_ms += FOLLOW_POLL_MS;
+			if (idle_secs > 0 && idle_ms >= idle_secs * 1000)
+				break;
+		}
+
+		// The file is still open, so a last rescan after it goes away is still meaningful.
+		ok = follow_rescan(fl);
+	}
+
+	close(ifd);
+	return ok;
+}
+
+// Pipelined merge (-j): two readers, a pool of merge workers and a writer, joined by a ring of
+// PIPE_SLOTS chunk slots. Chunk c lives in slot c % PIPE_SLOTS. Each slot's seq word holds the
+// lap it's on (c / PIPE_SLOTS) and which stages are done with it. Every stage waits on seq
+// alone, so the ring needs no locks; futexes only put idle stages to sleep.
+//
+// The readers fill their side of a slot, a worker merges the two into the slot's output,
+// and the writer (the main thread) commits the chunks in offset order and frees their slots
+// for the next lap. The first conflict is therefore always the lowest one.
+#define PIPE_CHUNK	(256 * BUF_SIZE)
+#define PIPE_SLOTS	16
+
+#define SLOT_READ1	(1U << 0)
+#define SLOT_READ2	(1U << 1)
+#define SLOT_MERGED	(1U << 2)
+#define SLOT_ABORT	(1U << 3)	// Only there to change seq, so that sleepers see the abort.
+#define SLOT_LAP_SHIFT	4
+
+typedef struct {
+		_Atomic uint32_t seq;
+		char *buf[2];
+		size_t got[2];	// Bytes read into each side.
+		char *merged;
+		size_t len;	// Merged length: the longer side.
+		size_t conflict;	// Offset in the chunk of the first conflict, or SIZE_MAX.
+	} pipe_slot_t;
+
+typedef struct {
+		pipe_slot_t slot[PIPE_SLOTS];
+		FILE *in[2];
+		FILE *out;
+		size_t nchunks;
+		int prefer_side;
+		bool in_place;
+		const uint8_t *cov_old;	// Blocks it marks filled aren't read from the second input.
+		size_t size1;
+		uint8_t *cov;
+		extset_t *done;		// --follow's merged ranges, or nullptr.
+		atomic_size_t next_merge;
+		atomic_bool abort;
+	} pipe_t;
+
+static inline void pipe_sleep(_Atomic uint32_t *const word, const uint32_t seen) {
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, nullptr, nullptr, 0);
+}
+
+static inline void pipe_wake(_Atomic uint32_t *const word) {
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// Wait until chunk c's slot is on c's lap with all of the stage bits set. False on abort.
+static bool pipe_wait(pipe_t pl[const static 1], const size_t c, const uint32_t bits) {
+	pipe_slot_t *const s = &pl->slot[c % PIPE_SLOTS];
+	const uint32_t lap = c / PIPE_SLOTS;
+	for (;;) {
+		const uint32_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq >> SLOT_LAP_SHIFT == lap && (seq & bits) == bits)
+			return true;
+		if (atomic_load(&pl->abort))
+			return false;
+		pipe_sleep(&s->seq, seq);
+	}
+}
+
+static void pipe_abort(pipe_t pl[const static 1]) {
+	atomic_store(&pl->abort, true);
+	for (int i = 0; i < PIPE_SLOTS; i++) {
+		atomic_fetch_or(&pl->slot[i].seq, SLOT_ABORT);
+		pipe_wake(&pl->slot[i].seq);
+	}
+}
+
+static inline bool pipe_skip(const pipe_t pl[const static 1], const size_t blk) {
+	return pl->cov_old != nullptr && blk < pl->size1 / BUF_SIZE && cov_test(pl->cov_old, blk);
+}
+
+typedef struct {
+		pipe_t *pl;
+		int side;
+	} pipe_reader_arg_t;
+
+static void *pipe_reader(void *arg) {
+	pipe_t *const pl = ((pipe_reader_arg_t *)arg)->pl;
+	const int side = ((pipe_reader_arg_t *)arg)->side;
+	FILE *const f = pl->in[side];
+	bool seek = false;	// Skipped blocks; f is behind.
+
+	for (size_t c = 0; c < pl->nchunks; c++) {
+		if (!pipe_wait(pl, c, 0))
+			break;
+		pipe_slot_t *const s = &pl->slot[c % PIPE_SLOTS];
+		char *const buf = s->buf[side];
+
+		size_t got = 0;
+		if (side == 0 || pl->cov_old == nullptr) {
+			got = fread(buf, 1, PIPE_CHUNK, f);
+		}
+		else {
+			// Blocks already filled read as null, and merge as the first input's.
+			while (got < PIPE_CHUNK) {
+				if (pipe_skip(pl, (c * PIPE_CHUNK + got) / BUF_SIZE)) {
+					memset(buf + got, 0, BUF_SIZE);
+					got += BUF_SIZE;
+					seek = true;
+					continue;
+				}
+				if (seek && fseek(f, c * PIPE_CHUNK + got, SEEK_SET) != 0)
+					break;
+				seek = false;
+				const size_t n = fread(buf + got, 1, BUF_SIZE, f);
+				got += n;
+				if (n < BUF_SIZE)
+					break;
+			}
+		}
+		if (ferror(f)) {
+			fprintf(stderr, "Error reading input %i.\n", side + 1);
+			pipe_abort(pl);
+			break;
+		}
+
+		s->got[side] = got;
+		atomic_fetch_or_explicit(&s->seq, side == 0 ? SLOT_READ1 : SLOT_READ2, memory_order_release);
+		pipe_wake(&s->seq);
+	}
+	return nullptr;
+}
+
+// Bytes of the block at b that side read.
+static inline int pipe_side_len(const pipe_slot_t s[const static 1], const int side, const size_t b) {
+	return s->got[side] > b ? least(s->got[side] - b, BUF_SIZE) : 0;
+}
+
+// Merge one chunk with the usual rules: equal bytes and nulls merge, anything else is a conflict
+// unless a side is preferred.
+static void pipe_merge(const pipe_t pl[const static 1], pipe_slot_t s[const static 1], const size_t c) {
+	const char *const b1 = s->buf[0];
+	const char *const b2 = s->buf[1];
+	char *const o = s->merged;
+	s->len = greatest(s->got[0], s->got[1]);
+	s->conflict = SIZE_MAX;
+
+	// Whatever one side doesn't reach reads as null.
+	memset(s->buf[0] + s->got[0], 0, s->len - s->got[0]);
+	memset(s->buf[1] + s->got[1], 0, s->len - s->got[1]);
+
+	const size_t bad = nullvec_merge((uint8_t *)o, (const uint8_t *)b1, (const uint8_t *)b2, s->len, pl->prefer_side, nullptr);
+	if (bad < s->len) {
+		s->conflict = bad;
+		return;
+	}
+
+	for (size_t b = 0; b < s->len && pl->cov != nullptr; b += BUF_SIZE) {
+		// Chunks cover whole bytes of the map, so workers never share one.
+		const size_t blk = (c * PIPE_CHUNK + b) / BUF_SIZE;
+		if (pipe_skip(pl, blk) || cov_filled(b1 + b, pipe_side_len(s, 0, b), b2 + b, pipe_side_len(s, 1, b)))
+			cov_set(pl->cov, blk);
+	}
+}
+
+static void *pipe_worker(void *arg) {
+	pipe_t *const pl = arg;
+	size_t c;
+	while ((c = atomic_fetch_add(&pl->next_merge, 1)) < pl->nchunks) {
+		if (!pipe_wait(pl, c, SLOT_READ1 | SLOT_READ2))
+			break;
+		pipe_slot_t *const s = &pl->slot[c % PIPE_SLOTS];
+		pipe_merge(pl, s, c);
+		atomic_fetch_or_explicit(&s->seq, SLOT_MERGED, memory_order_release);
+		pipe_wake(&s->seq);
+	}
+	return nullptr;
+}
+
+// Commit chunk c. Null blocks are skipped, to keep the output sparse; in place, so are blocks
+// the first input already has.
+static bool pipe_write(pipe_t pl[const static 1], const pipe_slot_t s[const static 1], const size_t c) {
+	probe(flush, c * PIPE_CHUNK, s->len);
+	for (size_t b = 0; b < s->len; b += BUF_SIZE) {
+		const int n = least(s->len - b, BUF_SIZE);
+		const bool keep = pl->in_place ? !memcmp(s->merged + b, s->buf[0] + b, n) : !memcmp(s->merged + b, zero, n);
+		if (keep) {
+			if (fseek(pl->out, n, SEEK_CUR) != 0)
+				return false;
+		}
+		else if (fwrite(s->merged + b, n, 1, pl->out) != 1) {
+			return false;
+		}
+
+		if (pl->done == nullptr)
+			continue;
+		const size_t off = c * PIPE_CHUNK + b;
+		if ((pipe_skip(pl, off / BUF_SIZE) || cov_filled("", 0, s->buf[1] + b, pipe_side_len(s, 1, b)))
+				&& !ext_add(pl->done, off, off + n)) {
+			fprintf(stderr, "Unable to allocate memory for the merged-extent set.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+// Run the whole merge through the pipeline with nworkers merge threads. Returns false on a
+// conflict or error, which has been reported.
+static bool pipe_run(pipe_t pl[const static 1], const int nworkers) {
+	char *const mem = malloc((size_t)PIPE_SLOTS * 3 * PIPE_CHUNK);
+	if (mem == nullptr) {
+		fprintf(stderr, "Unable to allocate pipeline buffers.\n");
+		return false;
+	}
+	for (int i = 0; i < PIPE_SLOTS; i++) {
+		pipe_slot_t *const s = &pl->slot[i];
+		atomic_init(&s->seq, 0);
+		s->buf[0] = mem + (size_t)i * 3 * PIPE_CHUNK;
+		s->buf[1] = s->buf[0] + PIPE_CHUNK;
+		s->merged = s->buf[1] + PIPE_CHUNK;
+	}
+	atomic_init(&pl->next_merge, 0);
+	atomic_init(&pl->abort, false);
+
+	pipe_reader_arg_t rarg[2] = { { pl, 0 }, { pl, 1 } };
+	pthread_t readers[2], workers[nworkers];
+	int nreaders = 0, nstarted = 0;
+	for (; nreaders < 2; nreaders++) {
+		if (pthread_create(&readers[nreaders], nullptr, pipe_reader, &rarg[nreaders]) != 0)
+			break;
+	}
+	for (; nreaders == 2 && nstarted < nworkers; nstarted++) {
+		if (pthread_create(&workers[nstarted], nullptr, pipe_worker, pl) != 0)
+			break;
+	}
+
+	bool ok = nreaders == 2 && nstarted > 0;
+	if (!ok)
+		fprintf(stderr, "Unable to start pipeline threads.\n");
+	for (size_t c = 0; ok && c < pl->nchunks; c++) {
+		if (!pipe_wait(pl, c, SLOT_MERGED)) {
+			ok = false;
+			break;
+		}
+		pipe_slot_t *const s = &pl->slot[c % PIPE_SLOTS];
+		if (s->conflict != SIZE_MAX) {
+			probe(conflict, c * PIPE_CHUNK + s->conflict);
+			fprintf(stderr, "Error: Files mismatch\n");
+			fprintf(stderr, "Error: Files mismatch (at byte %zu)\n", c * PIPE_CHUNK + s->conflict);
+			ok = false;
+			break;
+		}
+		if (!pipe_write(pl, s, c)) {
+			perror("Writing merged output");
+			ok = false;
+			break;
+		}
+
+		// Free the slot for chunk c + PIPE_SLOTS.
+		atomic_store_explicit(&s->seq, (uint32_t)(c / PIPE_SLOTS + 1) << SLOT_LAP_SHIFT, memory_order_release);
+		pipe_wake(&s->seq);
+	}
+
+	if (!ok)
+		pipe_abort(pl);
+	for (int i = 0; i < nreaders; i++)
+		pthread_join(readers[i], nullptr);
+	for (int i = 0; i < nstarted; i++)
+		pthread_join(workers[i], nullptr);
+	free(mem);
+	return ok;
+}
+
+// Merge [lo, hi) of the inputs into the same range of out, for --offset/--length. The other
+// shards write into the same output, so it's never truncated, and the null spans are skipped
+// rather than written; nullmerge punches out everything no shard wrote. The spans that were
+// written go into ext. A conflict ends the range and goes into rec; false means an I/O error.
+static bool range_merge(FILE *const in1, FILE *const in2, FILE *const out, const size_t lo, const size_t hi, const int prefer_side, shard_rec_t rec[const static 1], shard_exts_t ext[const static 1]) {
+	if (fseek(in1, lo, SEEK_SET) != 0 || fseek(in2, lo, SEEK_SET) != 0 || fseek(out, lo, SEEK_SET) != 0) {
+		perror("Error: seeking to the range");
+		return false;
+	}
+
+	for (size_t off = lo; off < hi; off += BUF_SIZE) {
+		const size_t n = least(hi - off, BUF_SIZE);
+		char in1buf[BUF_SIZE];
+		char in2buf[BUF_SIZE];
+		// Past the end of the shorter input, it reads as null.
+		const size_t got1 = fread(in1buf, 1, n, in1);
+		const size_t got2 = fread(in2buf, 1, n, in2);
+		memset(in1buf + got1, 0, n - got1);
+		memset(in2buf + got2, 0, n - got2);
+
+		char merged[BUF_SIZE];
+		uint64_t nullmask[BUF_SIZE / NULLVEC_SIZE / 64 + 1];
+		const size_t bad = nullvec_merge((uint8_t *)merged, (uint8_t *)in1buf, (uint8_t *)in2buf, n, prefer_side, nullmask);
+		if (bad < n) {
+			probe(conflict, off + bad);
+			shard_first(rec, off + bad);
+			return true;
+		}
+
+		for (size_t span = 0; span < n; ) {
+			const bool null = nullmask[span / NULLVEC_SIZE / 64] & (1ULL << (span / NULLVEC_SIZE % 64));
+			size_t run = span;
+			while (run < n && null == !!(nullmask[run / NULLVEC_SIZE / 64] & (1ULL << (run / NULLVEC_SIZE % 64))))
+				run += NULLVEC_SIZE;
+			run = least(run, n);
+			if (null) {
+				if (fseek(out, run - span, SEEK_CUR) != 0)
+					return false;
+			}
+			else if (fwrite(merged + span, run - span, 1, out) != 1 || !shard_ext_add(ext, off + span, run - span)) {
+				return false;
+			}
+			span = run;
+		}
+	}
+	probe(flush, lo, hi - lo);
+	return fflush(out) == 0;
+}
+
+// --torrent: build the output from any number of partial downloads, piece by piece, out of only
+// the pieces that check out against the .torrent's hashes. For each piece, the inputs are tried
+// in order, skipping those that have nothing but holes there; failing all of them, the merge of
+// their non-null bytes is tried too, which also covers pieces that are really all nulls. Pieces
+// nothing checks out for stay holes, and are listed. Workers take pieces in turn and write them
+// where they go, so the output must be a regular file.
+#define TOR_MISSING	-1
+#define TOR_MERGED	-2
+
+typedef struct {
+		int fd;
+		size_t size;
+		bool qcow;
+		qcow2_t q;
+	} tor_in_t;
+
+typedef struct {
+		const torrent_t *t;
+		const tor_in_t *in;
+		int nin;
+		int out;
+		atomic_size_t next;	// Next piece to take.
+		int *from;	// Per piece: the input it came from, TOR_MERGED or TOR_MISSING.
+		atomic_bool failed;
+	} tor_job_t;
+
+// Read [off, off + n) of an input into buf; holes and what's past its end read as nulls. Returns
+// 0 without reading if it's all hole there, -1 on error.
+static int tor_read(const tor_in_t in[const static 1], uint8_t *const buf, const size_t off, const size_t n) {
+	if (off >= in->size)
+		return 0;
+	const off_t data = in->qcow ? qcow2_seek(&in->q, off, SEEK_DATA) : lseek(in->fd, off, SEEK_DATA);
+	if ((data == -1 && errno == ENXIO) || (data != -1 && (size_t)data >= off + n))
+		return 0;
+
+	const size_t want = MIN(n, in->size - off);
+	size_t got = 0;
+	if (in->qcow) {
+		const ssize_t r = qcow2_pread(&in->q, buf, want, off);
+		if (r < 0)
+			return -1;
+		got = r;
+	}
+	while (!in->qcow && got < want) {
+		const ssize_t r = pread(in->fd, buf + got, want - got, off + got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		got += r;
+	}
+	memset(buf + got, 0, n - got);
+	return 1;
+}
+
+// Write a verified piece, leaving its null blocks as holes.
+static bool tor_write(const int fd, const uint8_t *const buf, const size_t off, const size_t n) {
+	for (size_t b = 0; b < n; ) {
+		size_t run = b;
+		while (run < n && !nullvec_iszero(buf + run, MIN(BUF_SIZE, n - run)))
+			run += MIN(BUF_SIZE, n - run);
+		for (size_t done = b; done < run; ) {
+			const ssize_t w = pwrite(fd, buf + done, run - done, off + done);
+			if (w < 0 && errno == EINTR)
+				continue;
+			if (w <= 0)
+				return false;
+			done += w;
+		}
+		b = run + (run < n ? MIN(BUF_SIZE, n - run) : 0);
+	}
+	return true;
+}
+
+static void *tor_worker(void *arg) {
+	tor_job_t *const job = arg;
+	const torrent_t *const t = job->t;
+	uint8_t *const buf = malloc(t->piece_len);
+	uint8_t *const acc = malloc(t->piece_len);
+	uint8_t (*const leaves)[32] = malloc(MAX(t->piece_len / TORRENT_BLOCK, 1) * 32);
+	if (buf == nullptr || acc == nullptr || leaves == nullptr) {
+		fprintf(stderr, "Unable to allocate piece buffers.\n");
+		atomic_store(&job->failed, true);
+	}
+
+	for (size_t p; !atomic_load(&job->failed) && (p = atomic_fetch_add(&job->next, 1)) < t->npieces; ) {
+		const size_t off = p * t->piece_len, n = torrent_piece_size(t, p);
+		int from = TOR_MISSING;
+		bool mergeable = true;
+		memset(acc, 0, n);
+		for (int i = 0; i < job->nin && from == TOR_MISSING; i++) {
+			const int r = tor_read(&job->in[i], buf, off, n);
+			if (r < 0) {
+				perror("Error reading an input");
+				atomic_store(&job->failed, true);
+				break;
+			}
+			if (r == 0)
+				continue;
+			if (torrent_verify(t, p, buf, n, leaves))
+				from = i;
+			else if (mergeable)
+				mergeable = nullvec_merge(acc, acc, buf, n, 0, nullptr) == n;
+		}
+		if (from == TOR_MISSING && mergeable && torrent_verify(t, p, acc, n, leaves))
+			from = TOR_MERGED;
+		probe(piece, p, from);
+
+		job->from[p] = from;
+		if (from != TOR_MISSING && !tor_write(job->out, from == TOR_MERGED ? acc : buf, off, n)) {
+			perror("Error writing the output");
+			atomic_store(&job->failed, true);
+		}
+	}
+	free(buf);
+	free(acc);
+	free(leaves);
+	return nullptr;
+}
+
+// Returns 0 if every piece checked out, 3 if some are missing, 1 on error.
+static int torrent_combine(const char *const meta_path, const int nin, char *const paths[const static nin], const int out, int nworkers) {
+	struct stat out_stat;
+	if (fstat(out, &out_stat) != 0 || !S_ISREG(out_stat.st_mode)) {
+		fprintf(stderr, "Error: --torrent needs a regular file to write to.\n");
+		return 1;
+	}
+	torrent_t t;
+	if (!torrent_load(&t, meta_path))
+		return 1;
+
+	int ret = 1;
+	tor_in_t *const in = calloc(nin, sizeof(*in));
+	tor_job_t job = { .t = &t, .in = in, .nin = nin, .out = out, .from = calloc(t.npieces, sizeof(*job.from)) };
+	if (in == nullptr || job.from == nullptr) {
+		fprintf(stderr, "Unable to allocate %zu pieces' worth of bookkeeping.\n", t.npieces);
+		goto out;
+	}
+	for (int i = 0; i < nin; i++)
+		in[i].fd = -1;
+	for (int i = 0; i < nin; i++) {
+		struct stat st;
+		in[i].fd = open(paths[i], O_RDONLY | O_CLOEXEC);
+		if (in[i].fd == -1 || fstat(in[i].fd, &st) != 0) {
+			fprintf(stderr, "Error opening %s", paths[i]);
+			perror(", ");
+			goto out;
+		}
+		in[i].size = st.st_size;
+		in[i].qcow = qcow2_probe(in[i].fd);
+		if (in[i].qcow && !qcow2_open(&in[i].q, in[i].fd, paths[i]))
+			goto out;
+		if (in[i].qcow)
+			in[i].size = in[i].q.size;
+		posix_fadvise(in[i].fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	// Start from nothing: whatever isn't written stays a hole.
+	if (ftruncate(out, 0) != 0 || ftruncate(out, t.length) != 0) {
+		perror("Error: sizing the output");
+		goto out;
+	}
+
+	if (nworkers <= 0)
+		nworkers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+	nworkers = MIN((size_t)nworkers, t.npieces);
+	pthread_t *const tid = calloc(nworkers, sizeof(*tid));
+	int started = 0;
+	for (; tid != nullptr && started < nworkers; started++) {
+		if (pthread_create(&tid[started], nullptr, tor_worker, &job) != 0)
+			break;
+	}
+	if (started == 0)
+		tor_worker(&job);
+	for (int i = 0; i < started; i++)
+		pthread_join(tid[i], nullptr);
+	free(tid);
+	if (atomic_load(&job.failed))
+		goto out;
+
+	// Where the pieces came from, and which are missing, in runs.
+	size_t missing = 0, merged = 0;
+	size_t *const count = calloc(nin, sizeof(*count));
+	for (size_t p = 0; p < t.npieces; p++) {
+		if (job.from[p] == TOR_MISSING)
+			missing++;
+		else if (job.from[p] == TOR_MERGED)
+			merged++;
+		else if (count != nullptr)
+			count[job.from[p]]++;
+	}
+	for (int i = 0; i < nin && count != nullptr; i++)
+		fprintf(stderr, "%zu pieces from %s\n", count[i], paths[i]);
+	if (merged > 0)
+		fprintf(stderr, "%zu pieces from the inputs merged\n", merged);
+	free(count);
+
+	if (missing == 0) {
+		fprintf(stderr, "All %zu pieces verified.\n", t.npieces);
+		ret = 0;
+		goto out;
+	}
+	fprintf(stderr, "Missing %zu of %zu pieces:\n", missing, t.npieces);
+	for (size_t p = 0; p < t.npieces; p++) {
+		if (job.from[p] != TOR_MISSING)
+			continue;
+		size_t last = p;
+		while (last + 1 < t.npieces && job.from[last + 1] == TOR_MISSING)
+			last++;
+		fprintf(stderr, "\tpieces %zu-%zu, bytes %zu-%zu\n", p, last, (size_t)(p * t.piece_len), (size_t)(last * t.piece_len + torrent_piece_size(&t, last)));
+		p = last;
+	}
+	ret = 3;
+
+out:
+	for (int i = 0; in != nullptr && i < nin; i++) {
+		if (in[i].qcow)
+			qcow2_close(&in[i].q);
+		if (in[i].fd != -1)
+			close(in[i].fd);
+	}
+	free(in);
+	free(job.from);
+	torrent_free(&t);
+	return ret;
+}
 
 int main(int argc, char **argv) {
 	int prefer_side = 0; // -1 if prefer first file; -2 if prefer second
-	int argused = 0;
+	const char *cov_path = nullptr;
+	bool in_place = false;
+	bool follow = false;
+	int follow_idle = 0;
+	int nworkers = 0;
+	bool hash = false;
+	const char *expect = nullptr;
+	const char *torrent_path = nullptr;
 	FILE *in1;
 	FILE *in2;
+	FILE *out = stdout;
+
+	// -1: prefer the first file on mismatch
+	// -2: prefer the second file on mismatch
+	// -m map: keep a coverage map of the output. If it exists and describes the first input,
+	// 	blocks it marks as filled are not read from the second input.
+	// -i: merge the second file into the first, in place, instead of writing to stdout. With -m,
+	// 	only the blocks that are still missing are read or written.
+	// --follow[=secs]: the second file is still being written. After the first pass, keep merging
+	// 	what lands in it until interrupted, until it goes away, or until it has been idle for secs.
+	// -j workers: read, merge and write in a pipeline, with this many merge threads.
+	// --offset bytes, --length bytes: merge only that range, which must be block-aligned, into
+	// 	the same range of the output. Every shard writes into the same file, so open it with
+	// 	`1<>out` rather than `>out`; nullmerge -o sets its length at the end.
+	// --shard file: with --offset/--length, write what the range held to file, for nullmerge.
+	// --sha256: hash the output as it's written, holes as zeros, and print the digest.
+	// --expect hex: hash the output, and exit with 2 if its SHA-256 isn't hex.
+	// --fill byte|pattern: sectors of the inputs that hold only this are unknown, like nulls,
+	// 	and come out as holes. See fill.h.
+	// --torrent meta input...: build the output from the pieces of any number of inputs that
+	// 	check out against the .torrent file meta, with -j workers; list the missing ones and
+	// 	exit with 3 if there are any. The output must be a regular file.
+	//
+	// The output may be a block device, as large as the output at least: the null spans are zeroed
+	// on it rather than skipped, and what's past the end of the output is left alone.
+	shard_opts_t shard;
+	if (!shard_strip(&argc, argv, &shard) || !fill_strip(&argc, argv, &fill))
+		return 1;
+	static const struct option longopts[] = {
+			{ "follow", optional_argument, nullptr, 'F' },
+			{ "sha256", no_argument, nullptr, 'S' },
+			{ "expect", required_argument, nullptr, 'E' },
+			{ "torrent", required_argument, nullptr, 'T' },
+			{ }
+		};
+	int ci;
+	while ((ci = getopt_long(argc, argv, "12m:ij:", longopts, nullptr)) != -1) {
+		switch (ci) {
+			case '1':
+				prefer_side = -1;
+				break;
+			case '2':
+				prefer_side = 1;
+				break;
+			case 'm':
+				cov_path = optarg;
+				break;
+			case 'i':
+				in_place = true;
+				break;
+			case 'j':
+				nworkers = least(greatest(atoi(optarg), 0), PIPE_SLOTS);
+				break;
+			case 'F':
+				follow = true;
+				if (optarg != nullptr)
+					follow_idle = atoi(optarg);
+				break;
+			case 'S':
+				hash = true;
+				break;
+			case 'E':
+				hash = true;
+				expect = optarg;
+				if (strlen(expect) != 64 || strspn(expect, "0123456789abcdefABCDEF") != 64) {
+					fprintf(stderr, "Error: --expect wants a SHA-256 in hex.\n");
+					return 1;
+				}
+				break;
+			case 'T':
+				torrent_path = optarg;
+				break;
+			default:
+				return 1;
+		}
+	}
 
-	if (argc > 1 && argv[1][0] == '-') {
-		if (argv[1][1] == '1' && argv[1][2] == '\0') {
-			argused++;
-			prefer_side = -1;
+	if (torrent_path != nullptr) {
+		if (prefer_side != 0 || cov_path != nullptr || in_place || follow || hash || shard.ranged || fill.on) {
+			fprintf(stderr, "Error: --torrent takes only -j; the hashes decide what goes in.\n");
+			return 1;
 		}
-		else if (argv[1][1] == '2' && argv[1][2] == '\0') {
-			argused++;
-			prefer_side = 1;
+		if (argc - optind < 1) {
+			fprintf(stderr, "Error: You must specify at least one input file.\n");
+			return 1;
 		}
+		return torrent_combine(torrent_path, argc - optind, argv + optind, fileno(out), nworkers);
 	}
 
-	if (argc < 3 + argused || argc > 3 + argused) {
+	if (argc - optind != 2) {
 		fprintf(stderr, "Error: You must specify two input files.\n");
 		return 1;
 	}
+	const char *const path1 = argv[optind];
+	const char *const path2 = argv[optind + 1];
 
-	in1 = fopen(argv[1 + argused], "rb");
-	in2 = fopen(argv[2 + argused], "rb");
+	// Either input may be a qcow2 image; it's read as the disk it holds.
+	size_t size1, size2;
+	bool qcow1, qcow2;
+	in1 = open_input(path1, &size1, &qcow1);
+	in2 = open_input(path2, &size2, &qcow2);
 
 	if (NULL == in1 || ferror(in1)) {
-		fprintf(stderr, "Error opening %s\n", argv[1]);
+		fprintf(stderr, "Error opening %s\n", path1);
 		return 1;
 	}
 	if (NULL == in2 || ferror(in2)) {
-		fprintf(stderr, "Error opening %s\n", argv[2]);
+		fprintf(stderr, "Error opening %s\n", path2);
+		return 1;
+	}
+	// --follow reads the growing input by its descriptor, which the fill stream hides.
+	const int in2_fd = fileno(in2);
+	if (fill.on) {
+		in1 = fill_stream(in1);
+		in2 = fill_stream(in2);
+		if (in1 == nullptr || in2 == nullptr) {
+			fprintf(stderr, "Unable to set up --fill.\n");
+			return 1;
+		}
+	}
+	if (in_place && qcow1) {
+		fprintf(stderr, "Error: -i can't write into a qcow2 image.\n");
+		return 1;
+	}
+	if (follow && qcow2) {
+		fprintf(stderr, "Error: --follow can't watch a qcow2 image.\n");
+		return 1;
+	}
+	const size_t out_size = greatest(size1, size2);
+
+	if (hash && (in_place || follow || shard.ranged)) {
+		fprintf(stderr, "Error: --sha256 and --expect need the whole output written in one go; not with -i, --follow or a range.\n");
 		return 1;
 	}
+
+	if (shard.ranged) {
+		if (in_place || follow || cov_path != nullptr || nworkers > 0) {
+			fprintf(stderr, "Error: --offset, --length and --shard don't mix with -i, -m, -j or --follow.\n");
+			return 1;
+		}
+		struct stat out_stat;
+		if (fstat(fileno(out), &out_stat) != 0 || !S_ISREG(out_stat.st_mode)) {
+			fprintf(stderr, "Error: a range needs a regular file to write to.\n");
+			return 1;
+		}
+		size_t lo, hi;
+		if (!shard_range(&shard, out_size, BUF_SIZE, &lo, &hi))
+			return 1;
+
+		shard_rec_t rec = shard_new(SHARD_NULLCOMBINE, lo, hi, out_size, size1, size2);
+		shard_exts_t ext = { };
+		int ret = 0;
+		if (!range_merge(in1, in2, out, lo, hi, prefer_side, &rec, &ext)) {
+			perror("Error: writing the range");
+			ret = 1;
+		}
+		else if (shard.out != nullptr) {
+			ret = shard_write(shard.out, &rec, &ext, nullptr) ? 0 : 1;
+		}
+		else if (rec.flags & SH_FIRST) {
+			fprintf(stderr, "Error: Files mismatch\n");
+			fprintf(stderr, "Error: Files mismatch (at byte %lu)\n", (unsigned long)rec.first);
+			ret = 1;
+		}
+		free(ext.ext);
+		fclose(in1);
+		fclose(in2);
+		return ret;
+	}
+
+	if (in_place) {
+		out = fopen(path1, "r+b");
+		if (out == nullptr) {
+			fprintf(stderr, "Error opening %s for writing", path1);
+			perror(", ");
+			return 1;
+		}
+	}
+
+	if (follow) {
+		struct stat out_stat;
+		if (fstat(fileno(out), &out_stat) != 0 || !S_ISREG(out_stat.st_mode)) {
+			fprintf(stderr, "Error: --follow needs a regular file to write to.\n");
+			return 1;
+		}
+	}
+	follow_t fl = { .in2 = in2_fd, .out = fileno(out), .prefer_side = prefer_side };
+	if (follow && !in_place) {
+		// Merging later data needs to read back what's already in the output, and a shell
+		// redirect opens it write-only. Reopen it read-write.
+		char fdpath[sizeof("/proc/self/fd/") + 12];
+		sprintf(fdpath, "/proc/self/fd/%i", fileno(out));
+		fl.out = open(fdpath, O_RDWR | O_CLOEXEC);
+		if (fl.out == -1) {
+			perror("Error: --follow needs to read the output back");
+			return 1;
+		}
+	}
+
+	// A block device has its null spans zeroed, not skipped over.
+	bdev_stream_t bd = { .fd = -1 };
+	FILE *bdev_out = nullptr;
+	struct stat out_stat;
+	if (!in_place && fstat(fileno(out), &out_stat) == 0 && S_ISBLK(out_stat.st_mode)) {
+		if (!bdev_open(&bd, fileno(out), out_size))
+			return 1;
+		bdev_out = fopencookie(&bd, "wb", (cookie_io_functions_t){
+				.write = bdev_stream_write,
+				.seek = bdev_stream_seek,
+			});
+		if (bdev_out == nullptr) {
+			perror("Error: unable to set up the output device");
+			return 1;
+		}
+		setvbuf(bdev_out, nullptr, _IONBF, 0);	// bd has a buffer of its own.
+		out = bdev_out;
+	}
+
+	const int out_fd = bdev_out != nullptr ? bd.fd : fileno(out);
+	hash_stream_t hs = { .fd = out_fd, .next = bdev_out };
+	if (hash) {
+		sha256_init(&hs.sha);
+		out = fopencookie(&hs, "wb", (cookie_io_functions_t){
+				.write = hash_stream_write,
+				.seek = hash_stream_seek,
+			});
+		if (out == nullptr) {
+			perror("Error: unable to set up hashing");
+			return 1;
+		}
+	}
+
+	// The map loaded from a previous run, if it's still valid, and the one we're building.
+	const size_t cov_bytes = ((out_size + BUF_SIZE - 1) / BUF_SIZE + 7) / 8;
+	const uint8_t *cov_old = nullptr;
+	uint8_t *cov = nullptr;
+	if (cov_path != nullptr) {
+		cov_old = cov_load(cov_path, size1, cov_bytes);
+		cov = calloc(cov_bytes, 1);
+		if (cov == nullptr) {
+			fprintf(stderr, "Unable to allocate %lu bytes for coverage map.\n", cov_bytes);
+			return 1;
+		}
+	}
+
 	// Read each, compare
 	
+	if (nworkers > 0) {
+		pipe_t pl = {
+				.in = { in1, in2 },
+				.out = out,
+				.nchunks = (out_size + PIPE_CHUNK - 1) / PIPE_CHUNK,
+				.prefer_side = prefer_side,
+				.in_place = in_place,
+				.cov_old = cov_old,
+				.size1 = size1,
+				.cov = cov,
+				.done = follow ? &fl.done : nullptr,
+			};
+		if (!pipe_run(&pl, nworkers)) {
+			fclose(in1);
+			fclose(in2);
+			return 1;
+		}
+	}
+
 	int curblock = 0;
-	while (!feof(in1) || !feof(in2)) {
+	size_t blk = 0;	// Index of the block being merged, for the coverage map.
+	while (nworkers == 0 && (!feof(in1) || !feof(in2))) {
 		char in1buf[BUF_SIZE];
 		char in2buf[BUF_SIZE];
 
+		if (cov_old != nullptr && cov_test(cov_old, blk)) {
+			// Already filled by an earlier merge. Carry the whole run of filled blocks over
+			// without reading the second input.
+			size_t run = blk;
+			do {
+				cov_set(cov, run);
+				run++;
+			} while (run < size1 / BUF_SIZE && cov_test(cov_old, run));
+
+			if (in_place) {
+				fseek(out, run * BUF_SIZE, SEEK_SET);
+				fseek(in1, run * BUF_SIZE, SEEK_SET);
+			}
+			else {
+				for (; blk < run; blk++) {
+					const int inleft1 = fread(in1buf, 1, BUF_SIZE, in1);
+					fwrite(in1buf, inleft1, 1, out);
+				}
+			}
+			fseek(in2, run * BUF_SIZE, SEEK_SET);
+			// Filled already, so nothing in the second input can change it.
+			if (follow)
+				ext_add(&fl.done, blk * BUF_SIZE, run * BUF_SIZE);
+			blk = run;
+			curblock = run;
+			continue;
+		}
+
 		int inleft1 = fread(in1buf, 1, BUF_SIZE, in1);
 		int inleft2 = fread(in2buf, 1, BUF_SIZE, in2);
 		curblock++;
@@ -66,13 +1684,27 @@ int main(int argc, char **argv) {
 			if(feof(in1) && feof(in2))
 				break;
 
+			if (in_place) {
+				// The rest of the first file is unchanged. Keep what the old map knew of it, and
+				// what this run found before here.
+				for (size_t b = blk; cov_old != nullptr && b < cov_bytes * 8; b++) {
+					if (cov_test(cov_old, b))
+						cov_set(cov, b);
+				}
+				break;
+			}
+
 			do {
+				if (cov != nullptr && cov_filled(in1buf, inleft1, "", 0))
+					cov_set(cov, blk);
+				blk++;
+
 				// handle sparse blocks
 				if (!memcmp(in1buf, zero, inleft1)) {
-					fseek(stdout, BUF_SIZE, SEEK_CUR);
+					fseek(out, BUF_SIZE, SEEK_CUR);
 				}
 				else {
-					fwrite(in1buf, inleft1, 1, stdout);
+					fwrite(in1buf, inleft1, 1, out);
 				}
 			} while ((inleft1 = fread(in1buf, 1, BUF_SIZE, in1)) > 0);
 			continue;
@@ -82,179 +1714,170 @@ int main(int argc, char **argv) {
 				break;
 
 			do {
+				if (cov != nullptr && cov_filled("", 0, in2buf, inleft2))
+					cov_set(cov, blk);
+				if (follow && cov_filled("", 0, in2buf, inleft2))
+					ext_add(&fl.done, blk * BUF_SIZE, (blk + 1) * BUF_SIZE);
+				blk++;
+
 				// handle sparse blocks
 				if (!memcmp(in2buf, zero, inleft2)) {
-					fseek(stdout, BUF_SIZE, SEEK_CUR);
+					fseek(out, BUF_SIZE, SEEK_CUR);
 				}
 				else {
-					fwrite(in2buf, inleft2, 1, stdout);
+					fwrite(in2buf, inleft2, 1, out);
 				}
 			} while ((inleft2 = fread(in2buf, 1, BUF_SIZE, in2)) > 0);
 			continue;
 		}
 
+		if (cov != nullptr && cov_filled(in1buf, inleft1, in2buf, inleft2))
+			cov_set(cov, blk);
+		if (follow && cov_filled("", 0, in2buf, inleft2))
+			ext_add(&fl.done, blk * BUF_SIZE, (blk + 1) * BUF_SIZE);
+		blk++;
+
 		// Base case -- blocks are the same
-		else if (inleft1 == inleft2) {
+		if (inleft1 == inleft2) {
 			if (!memcmp(in1buf, in2buf, inleft1)) {
 				//fprintf(stderr, "curblock: %i; block is the same.\n", curblock);
 
 				if (memcmp(in1buf, zero, inleft1)) {
 					// Blocks are the same, so just write one of them.
-					fwrite(in1buf, inleft1, 1, stdout);
+					fwrite(in1buf, inleft1, 1, out);
 				}
 				else {
 					// sparse block
 					//fprintf(stderr, "Seeking for sparse in output -- same-buffers\n");
-					fseek(stdout, inleft1, SEEK_CUR);
+					fseek(out, inleft1, SEEK_CUR);
 				}
 
 				continue;
 			}
 		}
-		// Else, check parts of the block.
-
-		// The full buffer didn't check out. The first step is to halve the block size.
-		int blocksize = BUF_SIZE;
-		int checked = 0;
-		//fprintf(stderr, "curblock: %i; blocksize: %i\n", curblock, blocksize);
-		// blocksize == 0 when we've exhausted a file.
-		while (checked < inleft1 && checked < inleft2) {
-			blocksize >>= 1;
-
-			// If blocksize is zero, we resized it there because inleftX is none.
-			if (blocksize == 0)
-				break;
-
-			// As long as we have buffer for it, use the larger comparison functions.
-			if (blocksize > inleft1 - checked || blocksize > inleft2 - checked) {
-				// Not enough data; shrink the block size..
-				// Notice: this may shrink the block size < 16. This is permissible in the
-				// end-of-file case; it'll go down to the small-comparison.
-				continue;
-			}
-			//fprintf(stderr, "curblock: %i; blocksize: %i\n", curblock, blocksize);
-
-			// Bufavailable could be zero if we've finished one file.
-			if (blocksize >= 16) {
-				if (! memcmp(in1buf + checked, in2buf + checked, blocksize)) {
-					// The two blocks are the same
-					if (!memcmp(in1buf + checked, zero, blocksize)) {
-						// zero block. Handle sparseness properly..
-						fseek(stdout, blocksize, SEEK_CUR);
-						//fprintf(stderr, "fseek bec. in1buf and same\n");
-					}
-					else {
-						//fprintf(stderr, "fwrite same-block\n");
-						fwrite(in1buf + checked, blocksize, 1, stdout);
-					}
-					checked += blocksize;
-					goto recalc_blocksize;
-				}
-
-				// If either block is full-zero, then halve block size again.
-				// This, to write as granular sparse bits as possible.
-				// It may be that block1 is half-sparse and block2 full-sparse, and so sparse those portions,
-				// rather than writing a full block1 which is half-sparse and half-data.
-				if (!memcmp(in1buf + checked, zero, blocksize) || !memcmp(in2buf + checked, zero, blocksize))
-					continue;
-
-				if (blocksize == 16) {
-					// If we still have a full sparse block, write the other.
-					if (! memcmp(in1buf + checked, zero, blocksize)) {
-						fwrite(in2buf + checked, blocksize, 1, stdout);
-						checked += blocksize;
-						goto recalc_blocksize;
-					}
-					if (! memcmp(in2buf + checked, zero, blocksize)) {
-						fwrite(in1buf + checked, blocksize, 1, stdout);
-						checked += blocksize;
-						goto recalc_blocksize;
-					}
-				}
-
-				// We didn't goto, ...
-				// File mismatch detected in blocks. Shrink block size and try again.
-
-				continue;
-			}
-
-			// Not full-sparse, then compare byte-for-byte.
-			// Stop worrying about sparse, we don't sparse at the 8-byte level.
-
-			//fprintf(stderr, "curblock: %i; Checking small at index %i, blocksize %i\n", curblock, checked, blocksize);
-			// Stop when we've exhausted either file. We'll finish up outside the loop.
-			// It's a given that blocksize <= the amount of data that we have left for both files.
-			for (int i = 0; i < blocksize; i++) {
-				if (in1buf[checked + i] == in2buf[checked + i] || 0 == in2buf[checked + i]) {
-					fwrite(in1buf + checked + i, 1, 1, stdout);
-					continue;
-				}
-				else if (in1buf[checked + i] == 0) {
-					//fprintf(stderr, "fwrite small bec. in1buf 0.\n");
-					fwrite(in2buf + checked + i, 1, 1, stdout);
-					continue;
-				}
-
-				// We have a file mis-match. If we prefer one over the other, use it.
-				if (prefer_side != 0) {
-					//fprintf(stderr, "%li+%i: (%i+%i) %i -- %i\n", ftell(in1), checked, blocksize, i, in1buf[checked + i], in2buf[checked + i]);
-					if (prefer_side == -1) {
-						fwrite(in1buf + checked + i, 1, 1, stdout);
-						continue;
-					}
-					else if (prefer_side == 1) {
-						fwrite(in2buf + checked + i, 1, 1, stdout);
-						continue;
-					}
-				}
-				// If we don't prefer one file over the other, this isn't permissible.
-				fprintf(stderr, "Error: Files mismatch\n");
-				fprintf(stderr, "Error: Files mismatch (at byte %i)\n", curblock * BUF_SIZE + i);
-				fclose(in1);
-				fclose(in2);
-				return 1;
-			}
-			checked += blocksize;
-
-recalc_blocksize:
-			if (checked == BUF_SIZE)
-				continue;
-
-			// find the next block size.
-			while ( blocksize <= least(inleft1, inleft2) - checked && blocksize <= BUF_SIZE) {
-				// We just completed a full block. Bump the blocksize back up.
-				blocksize <<= 1;
-			}
-		} // while we haven't checked whole files..
+		// Else, merge the block in one pass and write its non-null spans.
+		const int checked = least(inleft1, inleft2);
+		char merged[BUF_SIZE];
+		uint64_t nullmask[BUF_SIZE / NULLVEC_SIZE / 64 + 1];
+		const size_t bad = nullvec_merge((uint8_t *)merged, (uint8_t *)in1buf, (uint8_t *)in2buf, checked, prefer_side, nullmask);
+		if (bad < (size_t)checked) {
+			// If we don't prefer one file over the other, this isn't permissible.
+			probe(conflict, (blk - 1) * BUF_SIZE + bad);
+			fprintf(stderr, "Error: Files mismatch\n");
+			fprintf(stderr, "Error: Files mismatch (at byte %zu)\n", (blk - 1) * BUF_SIZE + bad);
+			fclose(in1);
+			fclose(in2);
+			return 1;
+		}
+		for (int span = 0; span < checked; ) {
+			const bool null = nullmask[span / NULLVEC_SIZE / 64] & (1ULL << (span / NULLVEC_SIZE % 64));
+			int run = span;
+			while (run < checked && null == !!(nullmask[run / NULLVEC_SIZE / 64] & (1ULL << (run / NULLVEC_SIZE % 64))))
+				run += NULLVEC_SIZE;
+			run = least(run, checked);
+			if (null)
+				fseek(out, run - span, SEEK_CUR);	// Sparse.
+			else
+				fwrite(merged + span, run - span, 1, out);
+			span = run;
+		}
 
-		// Now that we've left the comparison loop, is one file complete?
+		// Now that the shared part is merged, is one file longer?
 		if (inleft1 != inleft2) {
 			if (inleft1 - checked == 0) {
 				//fprintf(stderr, "End of file 1; printing the remains of file2...\n");
 				// write the remainder from in2
-				fwrite(in2buf + checked, inleft2 - checked, 1, stdout);
-				checked = inleft2;
+				fwrite(in2buf + checked, inleft2 - checked, 1, out);
 			}
 			else if (inleft2 - checked == 0) {
 				// write the remainder from in1
 				//fprintf(stderr, "End of file 2; printing the remains of file1...\n");
-				fwrite(in1buf + checked, inleft1 - checked, 1, stdout);
-				checked = inleft1;
+				fwrite(in1buf + checked, inleft1 - checked, 1, out);
 			}
 		}
 	} // while not eof some file
 
 	// We may have had nulls at the end. Set the length equal to the biggest file.
-	int filepos = ftell(in1) > ftell(in2) ? ftell(in1) : ftell(in2);
+	// In place, we may have stopped early, and the pipeline doesn't leave the inputs at their
+	// ends, so go by the input sizes rather than where we got to.
+	const off_t filepos = in_place || nworkers > 0 ? (off_t)out_size : greatest(ftell(in1), ftell(in2));
+	probe(flush_end, filepos);
+	fflush(out);
+	bool out_ok = true;
+	if (bdev_out != nullptr) {
+		out_ok = fflush(bdev_out) == 0 && bdev_finish(&bd, filepos);
+		if (!out_ok)
+			perror("Writing merged output");
+		else
+			fprintf(stderr, "Wrote %lu bytes of data to the device and zeroed %lu.\n", (unsigned long)bd.written, (unsigned long)bd.zeroed);
+	}
 	struct stat thingstat;
-	if (fstat(fileno(stdout), &thingstat) == 0 && S_ISREG(thingstat.st_mode)) {
-		const int truncres = ftruncate(fileno(stdout), filepos);
+	if (fstat(out_fd, &thingstat) == 0 && S_ISREG(thingstat.st_mode)) {
+		const int truncres = ftruncate(out_fd, filepos);
 		if (truncres < 0) {
 			perror("Truncating file to final length");
 		}
 	}
 
+	int ret = out_ok ? 0 : 1;
+	if (hash) {
+		// Whatever nulls the output ends with were never written.
+		if (hs.hashed < filepos)
+			sha256_zeros(&hs.sha, filepos - hs.hashed);
+		uint8_t digest[32];
+		char hex[65];
+		sha256_final(&hs.sha, digest);
+		for (int i = 0; i < 32; i++)
+			sprintf(hex + 2 * i, "%02x", digest[i]);
+
+		if (hs.behind) {
+			fprintf(stderr, "Error: the output wasn't written in order, so it has no SHA-256.\n");
+			ret = 1;
+		}
+		else if (expect != nullptr && strcasecmp(hex, expect) != 0) {
+			fprintf(stderr, "Error: the output's SHA-256 is %s, not %s.\n", hex, expect);
+			ret = 2;
+		}
+		else if (expect == nullptr) {
+			fprintf(stderr, "%s\n", hex);
+		}
+	}
+	if (follow) {
+		fl.cov = cov;
+		fl.cov_blocks = cov_bytes * 8;
+		if (!follow_loop(&fl, path2, follow_idle))
+			ret = 1;
+		free(fl.done.v);
+		if (!in_place)
+			close(fl.out);
+	}
+
+	size_t final_size = out_size;
+	if (follow && cov != nullptr) {
+		// The output may have grown while following. Blocks past the old end stay unfilled.
+		struct stat out_stat;
+		if (fstat(fileno(out), &out_stat) == 0 && (size_t)out_stat.st_size > out_size) {
+			const size_t nbytes = ((out_stat.st_size + BUF_SIZE - 1) / BUF_SIZE + 7) / 8;
+			uint8_t *const grown = realloc(cov, nbytes);
+			if (grown != nullptr) {
+				memset(grown + cov_bytes, 0, nbytes - cov_bytes);
+				cov = grown;
+				final_size = out_stat.st_size;
+			}
+		}
+	}
+
+	if (cov != nullptr && !cov_store(cov_path, cov, final_size))
+		ret = 1;
+
+	if (in_place && fclose(out) != 0) {
+		perror("Writing merged output");
+		ret = 1;
+	}
+	free((void *)cov_old);
+	free(cov);
+
 	fclose(in1);
 	fclose(in2);
-	return 0;
+	return ret;
 }
@@ -0,0 +1,782 @@
+
+
+// for SEEK_HOLE, etc
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/fsuid.h>
+
+#include <sys/param.h>
+
+#include "likely.h"
+
+// nulld: runs the tools as jobs for clients on a Unix socket.
+//
+// Each request is one line of tab-separated fields:
+//
+// 	<id>	<job>	<args...>
+//
+// where job is compare (nulldiff), combine (nullcombine), hasnull, hashole or census
+// (hasnull -c), and args are the tool's own. combine takes the output path first, since the
+// merged image is what nullcombine writes to stdout. Every line of a job's output comes back
+// tagged with its id, and the job ends with its return code:
+//
+// 	<id>	out	<line>
+// 	<id>	err	<line>
+// 	<id>	exit	<code>
+//
+// or "<id>	error	<why>" if it couldn't be run. Jobs on one connection may finish in any
+// order.
+//
+// The tools are linked in (see make.sh) and each job runs in a child forked from the daemon, so
+// there's no exec, dynamic linking or library start-up per job. They keep their own state
+// in globals, so they can't share one process. The daemon limits how many jobs run at once in
+// all, and how many touch each device: jobs whose files sit on a device that is already busy
+// wait, while jobs for other devices go ahead.
+//
+// The socket is only open to the daemon's own user. A daemon run as root takes clients of any
+// user, from SO_PEERCRED, and runs each job as the user that asked for it, with that user's
+// groups, so a job can only open the files its client could have opened. Relative paths are
+// taken from the working directory the client had when it connected, not the daemon's.
+
+int nulldiff_main(int argc, char **argv);
+int nullcombine_main(int argc, char **argv);
+int hasnull_main(int argc, char **argv);
+int hashole_main(int argc, char **argv);
+
+typedef struct {
+		const char *name;
+		int (*main)(int argc, char **argv);
+		const char *prog;	// argv[0] for the tool.
+		const char *preset;	// Argument put before the client's, or nullptr.
+		bool output;	// The first argument is where stdout goes.
+	} tool_t;
+
+static const tool_t tools[] = {
+		{ .name = "compare", .main = nulldiff_main, .prog = "nulldiff" },
+		{ .name = "combine", .main = nullcombine_main, .prog = "nullcombine", .output = true },
+		{ .name = "hasnull", .main = hasnull_main, .prog = "hasnull" },
+		{ .name = "hashole", .main = hashole_main, .prog = "hashole" },
+		{ .name = "census", .main = hasnull_main, .prog = "hasnull", .preset = "-c" },
+	};
+
+#define MAX_ARGS	64
+#define MAX_DEVS	8	// Devices one job can hold.
+#define LINE_MAX_LEN	4096
+#define CLIENT_OUT_MAX	(4 << 20)	// Output queued for a client that isn't reading, before it's dropped.
+
+typedef struct {
+		int fd;
+		uid_t uid;	// Of the peer.
+		gid_t gid;
+		gid_t *groups;	// Its user's groups, for a daemon run as root.
+		int ngroups;
+		int cwd;	// Its working directory, O_PATH.
+		char in[LINE_MAX_LEN];	// Partial request line.
+		size_t inlen;
+		char *out;	// Lines not sent yet.
+		size_t outlen;
+		size_t outcap;
+		bool dropped;	// Its queue overflowed, or sending failed: to be closed.
+	} client_t;
+
+typedef struct {
+		int fd;	// -1 at end-of-file.
+		char buf[LINE_MAX_LEN];
+		size_t len;
+	} outpipe_t;
+
+typedef struct job {
+		struct job *next;
+		client_t *client;	// nullptr once the client has gone.
+		uid_t uid;	// Whom it runs as.
+		gid_t gid;
+		char id[64];
+		const tool_t *tool;
+		char *args;	// Storage for argv.
+		char *argv[MAX_ARGS + 2];
+		int argc;
+		const char *output;
+		dev_t dev[MAX_DEVS];
+		int ndev;
+		pid_t pid;	// 0 while queued.
+		outpipe_t out, err;
+		int status;
+		bool reaped;
+	} job_t;
+
+typedef struct {
+		dev_t dev;
+		int running;
+		int limit;
+	} dev_slot_t;
+
+static struct {
+		int listen_fd;
+		int signal_fd;
+		int max_jobs;
+		int per_rotational;
+		int per_other;
+		int running;
+		job_t *jobs;	// Queued and running, in arrival order.
+		client_t **clients;
+		size_t nclients;
+		dev_slot_t *devs;
+		size_t ndevs;
+		gid_t *groups;	// The daemon's own, to go back to after client_stat().
+		int ngroups;
+	} d = { .listen_fd = -1, .signal_fd = -1, .per_rotational = 1, .per_other = 4 };
+
+// Send what's queued for c, as far as its socket takes it. Returns false if it has gone.
+static bool client_flush(client_t c[const static 1]) {
+	size_t sent = 0;
+	while (sent < c->outlen) {
+		const ssize_t r = send(c->fd, c->out + sent, c->outlen - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			break;
+		if (r <= 0) {
+			c->dropped = true;
+			return false;
+		}
+		sent += r;
+	}
+	memmove(c->out, c->out + sent, c->outlen - sent);
+	c->outlen -= sent;
+	return true;
+}
+
+// Queue a line for c. The socket never blocks the daemon: a client that stops reading has up to
+// CLIENT_OUT_MAX queued for it, and is then dropped.
+static void send_line(client_t *const c, const char *const id, const char *const tag, const char *const text, const size_t len) {
+	if (c == nullptr || c->dropped)
+		return;
+	char line[sizeof(((job_t *)0)->id) + 16 + LINE_MAX_LEN];
+	const size_t n = MIN(snprintf(line, sizeof(line), "%s\t%s\t%.*s\n", id, tag, (int)len, text), (int)sizeof(line) - 1);
+	if (c->outlen + n > CLIENT_OUT_MAX) {
+		c->dropped = true;
+		return;
+	}
+	if (c->outlen + n > c->outcap) {
+		const size_t cap = MIN(MAX(c->outcap * 2, c->outlen + n + LINE_MAX_LEN), (size_t)CLIENT_OUT_MAX);
+		char *const out = realloc(c->out, cap);
+		if (out == nullptr) {
+			c->dropped = true;
+			return;
+		}
+		c->out = out;
+		c->outcap = cap;
+	}
+	memcpy(c->out + c->outlen, line, n);
+	c->outlen += n;
+	client_flush(c);
+}
+
+// How many jobs may use dev at once: fewer on a spinning disk, where they'd only seek.
+static int dev_limit(const dev_t dev) {
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+	FILE *f = fopen(path, "r");
+	if (f == nullptr) {
+		// A partition; the queue belongs to the whole disk.
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+		f = fopen(path, "r");
+	}
+	if (f == nullptr)
+		return d.per_other;	// Not a block device: tmpfs, network.
+	const int rotational = fgetc(f) == '1';
+	fclose(f);
+	return rotational ? d.per_rotational : d.per_other;
+}
+
+static dev_slot_t *dev_slot(const dev_t dev) {
+	for (size_t i = 0; i < d.ndevs; i++) {
+		if (d.devs[i].dev == dev)
+			return &d.devs[i];
+	}
+	dev_slot_t *const devs = realloc(d.devs, (d.ndevs + 1) * sizeof(*devs));
+	if (devs == nullptr)
+		return nullptr;
+	d.devs = devs;
+	devs[d.ndevs] = (dev_slot_t){ .dev = dev, .running = 0, .limit = dev_limit(dev) };
+	return &devs[d.ndevs++];
+}
+
+// The groups the client's user has, as login would give them; just its gid if it has no
+// passwd entry.
+static bool client_groups(client_t c[const static 1]) {
+	const struct passwd *const pw = getpwuid(c->uid);
+	for (int n = 16; ; ) {
+		gid_t *const groups = realloc(c->groups, n * sizeof(*groups));
+		if (groups == nullptr)
+			return false;
+		c->groups = groups;
+		if (pw == nullptr) {
+			groups[0] = c->gid;
+			c->ngroups = 1;
+			return true;
+		}
+		int got = n;
+		if (getgrouplist(pw->pw_name, c->gid, groups, &got) != -1) {
+			c->ngroups = got;
+			return true;
+		}
+		n = MAX(got, n * 2);
+	}
+}
+
+// stat() path from the client's working directory, with the client's permissions, so that how a
+// job is scheduled tells it nothing about files it couldn't stat itself.
+static bool client_stat(const client_t c[const static 1], const char *const path, struct stat st[const static 1]) {
+	if (geteuid() != 0 || c->uid == 0)
+		return fstatat(c->cwd, path, st, 0) == 0;
+
+	bool ok = setgroups(c->ngroups, c->groups) == 0;
+	setfsgid(c->gid);
+	setfsuid(c->uid);
+	ok = ok && setfsuid(-1) == (int)c->uid && setfsgid(-1) == (int)c->gid && fstatat(c->cwd, path, st, 0) == 0;
+	setfsuid(geteuid());
+	setfsgid(getegid());
+	setgroups(d.ngroups, d.groups);
+	return ok;
+}
+
+static void job_free(job_t *const j) {
+	free(j->args);
+	free(j);
+}
+
+// Parse a request line into a queued job. Returns nullptr, with the error sent, if it's bad.
+static job_t *job_parse(client_t *const c, char *const line) {
+	job_t *const j = calloc(1, sizeof(*j));
+	if (j == nullptr)
+		return nullptr;
+	j->client = c;
+	j->uid = c->uid;
+	j->gid = c->gid;
+	j->out.fd = j->err.fd = -1;
+	j->args = strdup(line);
+	if (j->args == nullptr) {
+		free(j);
+		return nullptr;
+	}
+
+	char *save = nullptr;
+	const char *const id = strtok_r(j->args, "\t", &save);
+	const char *const name = strtok_r(nullptr, "\t", &save);
+	snprintf(j->id, sizeof(j->id), "%s", id != nullptr ? id : "-");
+	for (size_t i = 0; name != nullptr && i < sizeof(tools) / sizeof(*tools); i++) {
+		if (strcmp(name, tools[i].name) == 0)
+			j->tool = &tools[i];
+	}
+	if (j->tool == nullptr) {
+		send_line(c, j->id, "error", "unknown job", strlen("unknown job"));
+		job_free(j);
+		return nullptr;
+	}
+
+	j->argv[j->argc++] = (char *)j->tool->prog;
+	if (j->tool->preset != nullptr)
+		j->argv[j->argc++] = (char *)j->tool->preset;
+	if (j->tool->output) {
+		j->output = strtok_r(nullptr, "\t", &save);
+		if (j->output == nullptr) {
+			send_line(c, j->id, "error", "no output path", strlen("no output path"));
+			job_free(j);
+			return nullptr;
+		}
+	}
+	char *arg;
+	while ((arg = strtok_r(nullptr, "\t", &save)) != nullptr) {
+		if (j->argc == MAX_ARGS) {
+			send_line(c, j->id, "error", "too many arguments", strlen("too many arguments"));
+			job_free(j);
+			return nullptr;
+		}
+		j->argv[j->argc++] = arg;
+
+		// Any argument that names a file puts the job on that file's device.
+		struct stat st;
+		if (arg[0] != '-' && client_stat(c, arg, &st) && S_ISREG(st.st_mode) && j->ndev < MAX_DEVS) {
+			bool seen = false;
+			for (int i = 0; i < j->ndev; i++)
+				seen |= j->dev[i] == st.st_dev;
+			if (!seen)
+				j->dev[j->ndev++] = st.st_dev;
+		}
+	}
+	j->argv[j->argc] = nullptr;
+	return j;
+}
+
+static bool job_can_start(const job_t j[const static 1]) {
+	for (int i = 0; i < j->ndev; i++) {
+		const dev_slot_t *const s = dev_slot(j->dev[i]);
+		if (s != nullptr && s->running >= s->limit)
+			return false;
+	}
+	return true;
+}
+
+[[noreturn]] static void job_child(const job_t j[const static 1], const int out, const int err) {
+	close(d.listen_fd);
+	close(d.signal_fd);
+	for (size_t i = 0; i < d.nclients; i++) {
+		close(d.clients[i]->fd);
+		if (d.clients[i] != j->client)
+			close(d.clients[i]->cwd);
+	}
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, nullptr);
+	signal(SIGPIPE, SIG_DFL);
+
+	// Become the client's user before touching any of its files, and go where it is. A queued
+	// job always has its client.
+	const client_t *const c = j->client;
+	if (geteuid() == 0 && j->uid != 0
+			&& (setgroups(c->ngroups, c->groups) != 0 || setgid(j->gid) != 0 || setuid(j->uid) != 0)) {
+		dprintf(err, "Unable to run as uid %u: %s\n", (unsigned)j->uid, strerror(errno));
+		_exit(1);
+	}
+	if (fchdir(c->cwd) != 0) {
+		dprintf(err, "Unable to change to the client's directory: %s\n", strerror(errno));
+		_exit(1);
+	}
+	close(c->cwd);
+
+	const int devnull = open("/dev/null", O_RDONLY);
+	dup2(devnull, STDIN_FILENO);
+	if (j->output != nullptr) {
+		// Ranged and in-place merges write into what's there (nullcombine's `1<>out`): other shards
+		// share the output.
+		bool keep = false;
+		for (int i = 1; i < j->argc; i++) {
+			static const char *const opts[] = { "--offset", "--length", "--shard" };
+			for (size_t o = 0; o < sizeof(opts) / sizeof(*opts); o++) {
+				const size_t len = strlen(opts[o]);
+				keep |= strncmp(j->argv[i], opts[o], len) == 0 && (j->argv[i][len] == '\0' || j->argv[i][len] == '=');
+			}
+			keep |= strcmp(j->argv[i], "-i") == 0;
+		}
+		const int fd = open(j->output, O_WRONLY | O_CREAT | (keep ? 0 : O_TRUNC), 0666);
+		if (fd == -1) {
+			dprintf(err, "Unable to open %s: %s\n", j->output, strerror(errno));
+			_exit(1);
+		}
+		dup2(fd, STDOUT_FILENO);
+	}
+	else {
+		dup2(out, STDOUT_FILENO);
+	}
+	dup2(err, STDERR_FILENO);
+
+	optind = 0;	// Fully reset getopt for the tool.
+	exit(j->tool->main(j->argc, (char **)j->argv));
+}
+
+static bool job_start(job_t j[const static 1]) {
+	int out[2], err[2];
+	if (pipe2(out, O_CLOEXEC) != 0)
+		return false;
+	if (pipe2(err, O_CLOEXEC) != 0) {
+		close(out[0]);
+		close(out[1]);
+		return false;
+	}
+
+	fflush(nullptr);
+	j->pid = fork();
+	if (j->pid == 0)
+		job_child(j, out[1], err[1]);
+	close(out[1]);
+	close(err[1]);
+	if (j->pid == -1) {
+		j->pid = 0;
+		close(out[0]);
+		close(err[0]);
+		return false;
+	}
+
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+	fcntl(err[0], F_SETFL, O_NONBLOCK);
+	j->out.fd = out[0];
+	j->err.fd = err[0];
+	d.running++;
+	for (int i = 0; i < j->ndev; i++) {
+		dev_slot_t *const s = dev_slot(j->dev[i]);
+		if (s != nullptr)
+			s->running++;
+	}
+	return true;
+}
+
+// Start whatever queued jobs now fit, oldest first.
+static void schedule(void) {
+	for (job_t *j = d.jobs; j != nullptr && d.running < d.max_jobs; j = j->next) {
+		if (j->pid != 0 || !job_can_start(j))
+			continue;
+		if (!job_start(j)) {
+			// Leave it queued; a finishing job will bring us back here.
+			perror("Unable to start job");
+			break;
+		}
+	}
+}
+
+// Forward complete lines from p. At end-of-file, forward the rest too.
+static void pipe_drain(job_t j[const static 1], outpipe_t p[const static 1], const char *const tag) {
+	for (;;) {
+		const ssize_t r = read(p->fd, p->buf + p->len, sizeof(p->buf) - p->len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EAGAIN)
+			return;
+
+		if (r > 0)
+			p->len += r;
+		size_t start = 0;
+		for (size_t i = 0; i < p->len; i++) {
+			if (p->buf[i] == '\n') {
+				send_line(j->client, j->id, tag, p->buf + start, i - start);
+				start = i + 1;
+			}
+		}
+		if (start == 0 && (p->len == sizeof(p->buf) || (r <= 0 && p->len > 0))) {
+			// A line too long for the buffer, or the last one without its newline.
+			send_line(j->client, j->id, tag, p->buf, p->len);
+			start = p->len;
+		}
+		memmove(p->buf, p->buf + start, p->len - start);
+		p->len -= start;
+
+		if (r <= 0) {
+			close(p->fd);
+			p->fd = -1;
+			return;
+		}
+	}
+}
+
+// A job is done once it has exited and both of its pipes are drained.
+static void job_reap(void) {
+	job_t **pj = &d.jobs;
+	while (*pj != nullptr) {
+		job_t *const j = *pj;
+		if (!j->reaped || j->out.fd != -1 || j->err.fd != -1) {
+			pj = &j->next;
+			continue;
+		}
+
+		char code[16];
+		if (WIFEXITED(j->status)) {
+			// The tools return small negative codes; give them back as they were meant.
+			snprintf(code, sizeof(code), "%i", (signed char)WEXITSTATUS(j->status));
+			send_line(j->client, j->id, "exit", code, strlen(code));
+		}
+		else {
+			snprintf(code, sizeof(code), "%i", WTERMSIG(j->status));
+			send_line(j->client, j->id, "signal", code, strlen(code));
+		}
+
+		d.running--;
+		for (int i = 0; i < j->ndev; i++) {
+			dev_slot_t *const s = dev_slot(j->dev[i]);
+			if (s != nullptr)
+				s->running--;
+		}
+		*pj = j->next;
+		job_free(j);
+	}
+}
+
+// Returns true if asked to stop.
+static bool on_signal(void) {
+	bool stop = false;
+	struct signalfd_siginfo si;
+	while (read(d.signal_fd, &si, sizeof(si)) == sizeof(si))
+		stop |= si.ssi_signo != SIGCHLD;
+
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (job_t *j = d.jobs; j != nullptr; j = j->next) {
+			if (j->pid == pid) {
+				j->status = status;
+				j->reaped = true;
+			}
+		}
+	}
+	return stop;
+}
+
+static void client_close(const size_t ci) {
+	client_t *const c = d.clients[ci];
+
+	// Queued jobs are dropped; running ones are stopped, and reaped as usual.
+	job_t **pj = &d.jobs;
+	while (*pj != nullptr) {
+		job_t *const j = *pj;
+		if (j->client != c) {
+			pj = &j->next;
+			continue;
+		}
+		j->client = nullptr;
+		if (j->pid == 0) {
+			*pj = j->next;
+			job_free(j);
+			continue;
+		}
+		kill(j->pid, SIGTERM);
+		pj = &j->next;
+	}
+
+	close(c->fd);
+	close(c->cwd);
+	free(c->out);
+	free(c->groups);
+	free(c);
+	d.clients[ci] = d.clients[--d.nclients];
+}
+
+// Read requests. Returns false when the client has gone.
+static bool client_read(client_t c[const static 1]) {
+	const ssize_t r = recv(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen, MSG_DONTWAIT);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return true;
+	if (r <= 0)
+		return false;
+	c->inlen += r;
+
+	size_t start = 0;
+	for (size_t i = 0; i < c->inlen; i++) {
+		if (c->in[i] != '\n')
+			continue;
+		c->in[i] = '\0';
+		job_t *const j = job_parse(c, c->in + start);
+		if (j != nullptr) {
+			job_t **pj = &d.jobs;
+			while (*pj != nullptr)
+				pj = &(*pj)->next;
+			*pj = j;
+		}
+		start = i + 1;
+	}
+	if (start == 0 && c->inlen == sizeof(c->in)) {
+		send_line(c, "-", "error", "request too long", strlen("request too long"));
+		return false;
+	}
+	memmove(c->in, c->in + start, c->inlen - start);
+	c->inlen -= start;
+	return true;
+}
+
+static int listen_on(const char *const path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error: socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("Error: Unable to create socket");
+		return -1;
+	}
+	// Take over a stale socket, but not a live one.
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error: a daemon is already listening on %s.\n", path);
+		close(fd);
+		return -1;
+	}
+	unlink(path);
+	// Created 0600: only our own user, and root, may connect.
+	const mode_t mask = umask(0177);
+	const int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (bound != 0 || listen(fd, 64) != 0) {
+		fprintf(stderr, "Error: Unable to listen on %s", path);
+		perror(", ");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char **argv) {
+
+	// nulld [-j jobs] [-r jobs] [-f jobs] socket
+	// -j: jobs running at once, in all (default: online CPUs)
+	// -r: jobs at once per rotational disk (default 1)
+	// -f: jobs at once per other device: flash, tmpfs, network (default 4)
+	d.max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int ci;
+	while ((ci = getopt(argc, argv, "j:r:f:")) != -1) {
+		switch (ci) {
+			case 'j':
+				d.max_jobs = atoi(optarg);
+				break;
+			case 'r':
+				d.per_rotational = atoi(optarg);
+				break;
+			case 'f':
+				d.per_other = atoi(optarg);
+				break;
+			default:
+				return 1;
+		}
+	}
+	if (argc - optind != 1) {
+		fprintf(stderr, "Error: You must specify the socket to listen on.\n");
+		return 1;
+	}
+	d.max_jobs = MAX(d.max_jobs, 1);
+	d.per_rotational = MAX(d.per_rotational, 1);
+	d.per_other = MAX(d.per_other, 1);
+	const char *const path = argv[optind];
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, nullptr);
+	d.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (geteuid() == 0) {
+		d.ngroups = getgroups(0, nullptr);
+		d.groups = malloc(MAX(d.ngroups, 1) * sizeof(*d.groups));
+		if (d.ngroups < 0 || d.groups == nullptr || getgroups(d.ngroups, d.groups) != d.ngroups) {
+			perror("Error: Unable to get the daemon's groups");
+			return 1;
+		}
+	}
+
+	d.listen_fd = listen_on(path);
+	if (d.listen_fd == -1 || d.signal_fd == -1)
+		return 1;
+
+	bool stop = false;
+	while (!stop) {
+		size_t njobs = 0;
+		for (job_t *j = d.jobs; j != nullptr; j = j->next)
+			njobs++;
+		struct pollfd pfd[2 + d.nclients + 2 * njobs];
+		job_t *pjob[2 * njobs + 1];
+		size_t n = 0;
+		pfd[n++] = (struct pollfd){ .fd = d.signal_fd, .events = POLLIN };
+		pfd[n++] = (struct pollfd){ .fd = d.listen_fd, .events = POLLIN };
+		for (size_t i = 0; i < d.nclients; i++)
+			pfd[n++] = (struct pollfd){ .fd = d.clients[i]->fd, .events = POLLIN | (d.clients[i]->outlen > 0 ? POLLOUT : 0) };
+		const size_t jobs_at = n;
+		for (job_t *j = d.jobs; j != nullptr; j = j->next) {
+			if (j->out.fd != -1) {
+				pjob[n - jobs_at] = j;
+				pfd[n++] = (struct pollfd){ .fd = j->out.fd, .events = POLLIN };
+			}
+			if (j->err.fd != -1) {
+				pjob[n - jobs_at] = j;
+				pfd[n++] = (struct pollfd){ .fd = j->err.fd, .events = POLLIN };
+			}
+		}
+
+		if (poll(pfd, n, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		// Job output first, so it's all sent before the job's exit line.
+		for (size_t i = jobs_at; i < n; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			job_t *const j = pjob[i - jobs_at];
+			pipe_drain(j, pfd[i].fd == j->out.fd ? &j->out : &j->err, pfd[i].fd == j->out.fd ? "out" : "err");
+		}
+
+		if (pfd[0].revents & POLLIN)
+			stop = on_signal();
+
+		// Clients in reverse, since closing one moves the last into its place.
+		for (size_t i = d.nclients; i-- > 0; ) {
+			const short ev = pfd[2 + i].revents;
+			if ((ev & POLLOUT) && !client_flush(d.clients[i]))
+				client_close(i);
+			else if ((ev & ~POLLOUT) != 0 && !client_read(d.clients[i]))
+				client_close(i);
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			const int fd = accept4(d.listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			// Who it is. Unless we're root, and can run its jobs as it, it has to be us.
+			struct ucred cred;
+			socklen_t credlen = sizeof(cred);
+			const bool allowed = fd != -1 && getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == 0
+					&& (geteuid() == 0 || cred.uid == geteuid());
+			client_t *const c = !allowed ? nullptr : calloc(1, sizeof(*c));
+			char cwd[64];
+			if (c != nullptr) {
+				*c = (client_t){ .fd = fd, .uid = cred.uid, .gid = cred.gid };
+				snprintf(cwd, sizeof(cwd), "/proc/%d/cwd", (int)cred.pid);
+				c->cwd = open(cwd, O_PATH | O_DIRECTORY | O_CLOEXEC);
+			}
+			client_t **const clients = c == nullptr || c->cwd == -1 || (geteuid() == 0 && !client_groups(c)) ? nullptr
+					: realloc(d.clients, (d.nclients + 1) * sizeof(*clients));
+			if (clients != nullptr) {
+				d.clients = clients;
+				d.clients[d.nclients++] = c;
+			}
+			else {
+				if (c != nullptr) {
+					if (c->cwd != -1)
+						close(c->cwd);
+					free(c->groups);
+				}
+				free(c);
+				if (fd != -1)
+					close(fd);
+			}
+		}
+
+		job_reap();
+		schedule();
+
+		// Clients whose output overflowed go now, and so do their jobs.
+		for (size_t i = d.nclients; i-- > 0; ) {
+			if (d.clients[i]->dropped)
+				client_close(i);
+		}
+	}
+
+	// Stop the running jobs and wait for them.
+	for (job_t *j = d.jobs; j != nullptr; j = j->next) {
+		if (j->pid != 0)
+			kill(j->pid, SIGTERM);
+	}
+	while (wait(nullptr) > 0)
+		;
+	unlink(path);
+	return 0;
+}
@@ -11,123 +11,966 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include <sys/param.h>
 
 #include "likely.h"
+#include "probes.h"
+#include "nullvec.h"
+#include "blockhash.h"
+#include "readahead.h"
+#include "throttle.h"
+#include "qcow2.h"
+#include "shard.h"
+#include "fill.h"
+#include "extent.h"
 
 #define least(x,y) ( x < y ? x : y)
 #define greatest(x,y) ( x < y ? y : x)
 
-const uint8_t *zero = NULL;
-
-enum {
-		RET_SUBSET_1	= 0b0000001,
-		RET_SUBSET_2	= 0b0000010,
-		RET_GREATEST_1	= 0b0000100,
-		RET_GREATEST_2	= 0b0001000,
-	} retcode;
+static fill_t fill;
+static throttle_t throttle;
 
 typedef struct {
 		FILE *const restrict f_in;
 		const size_t size;
 		const int fd;
+		const qcow2_t *qcow;	// Set when the input is a qcow2 image; size is then the virtual size.
 	} f_in_info_t;
 
-static inline size_t find_next_data(const f_in_info_t fin[const restrict static 1], size_t next_hole[const restrict static 1], size_t f_off) {
-	if (unlikely(*next_hole > f_off))
-		return f_off;
+// lseek() for SEEK_DATA and SEEK_HOLE. qcow2 inputs answer from their cluster map.
+static inline off_t fin_seek(const f_in_info_t fin[const restrict static 1], const off_t off, const int whence) {
+	if (fin->qcow != nullptr)
+		return qcow2_seek(fin->qcow, off, whence);
+	return lseek(fin->fd, off, whence);
+}
 
-	// We're at a hole. Find the next data.
-	const size_t next_data = lseek(fin->fd, f_off, SEEK_DATA);
-	if (unlikely(next_data == (size_t)-1)) { // && errno == ENXIO) {
-		// There's no more data, and caller need to detect past end-of-file
-		return -1;
+static off_t fin_seek_qcow2(const void *ctx, const off_t off, const int whence) {
+	return qcow2_seek(ctx, off, whence);
+}
+
+static inline const uint8_t *fin_mmap(const f_in_info_t fin[const restrict static 1]) {
+	if (fin->qcow != nullptr)
+		return qcow2_mmap(fin->qcow);
+	return mmap(NULL, fin->size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE | MAP_NONBLOCK, fin->fd, 0);
+}
+
+// Delta output (--delta file): what in2 knows that in1 doesn't, as a sparse file as long as the
+// longer input. Each page in which in2 adds something holds that page of in1 with in2's data
+// filled into its nulls, so that it can go over in1 whole; every other page is a hole. tar -S
+// and rsync --sparse carry it at the size of its data, and --apply writes it into in1.
+//
+// The delta is written as the comparison goes, and removed again if the inputs conflict.
+#define DELTA_CHUNK	(1 << 20)	// --apply reads this much at a time.
+
+typedef struct {
+		int fd;	// -1: no delta.
+		const char *path;
+		uint8_t *buf;	// A page.
+		size_t written;	// Bytes of pages written.
+		size_t added;	// Bytes in2 adds.
+		bool failed;
+	} delta_t;
+
+static delta_t delta = { .fd = -1 };
+
+// Write [b, b + n) of the delta: in2 there, fill sectors nulled, over in1 if shared (else in1 is
+// a hole there). n is at most a page.
+static void delta_put(const f_in_info_t fin[const restrict static 2], const uint8_t *const map[const restrict static 2], const size_t b, const size_t n, const bool shared, const size_t added) {
+	if (delta.failed)
+		return;
+	uint8_t *const out = delta.buf;
+	memcpy(out, map[1] + b, n);
+	for (size_t s = b & -(size_t)FILL_SECTOR; fill.on && s < b + n; s += FILL_SECTOR) {
+		if (fill_sector(&fill, map[1], fin[1].size, s))
+			memset(out + (MAX(s, b) - b), 0, MIN(s + FILL_SECTOR, b + n) - MAX(s, b));
 	}
+	if (shared)
+		nullvec_merge(out, map[0] + b, out, n, 1, nullptr);
+	if (pwrite(delta.fd, out, n, b) != (ssize_t)n) {
+		fprintf(stderr, "Error: Unable to write the delta to %s", delta.path);
+		perror(", ");
+		delta.failed = true;
+		return;
+	}
+	delta.written += n;
+	delta.added += added;
+}
 
-	if (next_data > f_off)
-		f_off = next_data;
+// Dedupe (--dedupe): once the inputs are found to agree, have the kernel share in2's blocks that
+// are byte for byte in1's, with FIDEDUPERANGE. The comparison only picks the ranges: the kernel
+// compares them again under its locks, so whatever changed in between is refused, not lost. Only
+// whole filesystem blocks are asked for.
+#define DEDUPE_MAX	(16 << 20)	// Per request; btrfs and XFS take no more than that at once anyway.
 
-	// Ok, now find the next hole. This will always be positive, unless error.
-	*next_hole = lseek(fin->fd, f_off, SEEK_HOLE);
+typedef struct {
+		bool on;
+		bool failed;	// Out of memory for the list; nothing is deduped.
+		extmap_t same;	// Where the inputs hold the same bytes, in shared extents.
+	} dedupe_t;
+
+static dedupe_t dedupe;
+
+// Submit dedupe.same, in1 as the source and in2 as the destination.
+static void dedupe_submit(const f_in_info_t fin[const restrict static 2], const char *const path[const restrict static 2]) {
+	// The destination has to be open for writing, unless it's ours.
+	const int fd = open(path[1], O_RDWR | O_CLOEXEC);
+	const int dest = fd != -1 ? fd : fin[1].fd;
+	struct stat st;
+	const size_t blk = fstat(dest, &st) == 0 && st.st_blksize > 0 ? (size_t)st.st_blksize : 4096;
+	struct {
+			struct file_dedupe_range r;
+			struct file_dedupe_range_info info;
+		} req;
+
+	size_t deduped = 0, refused = 0;
+	for (size_t e = 0; e < dedupe.same.n; e++) {
+		const size_t end = dedupe.same.ext[e].end / blk * blk;
+		for (size_t off = (dedupe.same.ext[e].off + blk - 1) / blk * blk; off < end; ) {
+			const size_t len = MIN(DEDUPE_MAX, end - off);
+			memset(&req, 0, sizeof(req));
+			req.r.src_offset = off;
+			req.r.src_length = len;
+			req.r.dest_count = 1;
+			req.info.dest_fd = dest;
+			req.info.dest_offset = off;
+			if (ioctl(fin[0].fd, FIDEDUPERANGE, &req.r) != 0 || req.info.status < 0) {
+				if (req.info.status < 0)
+					errno = -req.info.status;
+				fprintf(stderr, "Error: Unable to dedupe %s against %s at byte %zu", path[1], path[0], off);
+				perror(", ");
+				refused += extmap_bytes(&dedupe.same, off, dedupe.same.size);
+				goto done;
+			}
+			probe(dedupe, off, len, req.info.bytes_deduped);
+			throttle_io(&throttle, 2 * len);
+			if (req.info.status == FILE_DEDUPE_RANGE_DIFFERS || req.info.bytes_deduped == 0) {
+				refused += len;
+				off += len;
+				continue;
+			}
+			deduped += req.info.bytes_deduped;
+			off += req.info.bytes_deduped;
+		}
+	}
+done:
+	fprintf(stderr, "Deduped %zu bytes of %s against %s; the kernel refused %zu.\n", deduped, path[1], path[0], refused);
+	if (fd != -1)
+		close(fd);
+}
 
-	return f_off;
+// range_compare()'s readahead, and how far behind the scan the maps are already unmapped.
+typedef struct {
+		ra_ctl_t ra;
+		size_t unmapped;
+	} scan_t;
+
+// The scan is at b, on a page boundary or where it started: move the readahead along, and unmap
+// what's behind in steps of RA_UNMAP_STEP. Nothing to do without a scan.
+static inline void scan_at(scan_t *const restrict scan, const f_in_info_t fin[const restrict static 2], const uint8_t *const map[const restrict static 2], const size_t b) {
+	if (scan == nullptr)
+		return;
+	ra_advance(&scan->ra, b);
+	if (likely(b - scan->unmapped < RA_UNMAP_STEP))
+		return;
+	const size_t to = b & -(size_t)sysconf(_SC_PAGESIZE);
+	probe(unmap, scan->unmapped, to - scan->unmapped);
+	for (int i = 0; i < 2; i++) {
+		if (scan->unmapped < fin[i].size)
+			munmap((void *)map[i] + scan->unmapped, MIN(to, fin[i].size) - scan->unmapped);
+	}
+	scan->unmapped = to;
 }
 
-static inline void mumap(const uint8_t *const restrict addr1_base, const uint8_t *const restrict addr2_base, const size_t mmap_offset, size_t unmap_offset[const restrict static 1]) {
-	__auto_type const page_data = ({
-				static struct {
-						size_t PAGE_SIZE_bits;
-						int PAGE_SIZE;
-					} init = (constexpr typeof(init)){ .PAGE_SIZE_bits = 0, .PAGE_SIZE = 0};
-				if (unlikely(init.PAGE_SIZE == 0)) {
-					init.PAGE_SIZE = sysconf(_SC_PAGESIZE);
-					init.PAGE_SIZE_bits = init.PAGE_SIZE - 1;
+// Compare [b, end) of the inputs, a stretch that's kind (EXT_IN_1, EXT_IN_2 or EXT_SHARED) all
+// the way through and on one side of the end of the shorter input, into rec. Shared stretches
+// are compared; one only an input has data in is read only as far as the answer needs: up to
+// its first known byte for the subset bits, all of it for -g (and in2's for --delta), and past
+// the end of the shorter input not at all without either. Returns false at a conflict. scan, if
+// not nullptr, is kept up with page by page, so a long stretch doesn't outrun it.
+static bool compare_span(const f_in_info_t fin[const restrict static 2], const uint8_t *const map[const restrict static 2], size_t b, const size_t end, const int kind, shard_rec_t rec[const restrict static 1], scan_t *const restrict scan) {
+	const int PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	const size_t common = MIN(fin[0].size, fin[1].size);
+	const bool counting = rec->flags & SH_GREATEST;
+
+	if (kind != EXT_SHARED) {
+		const int only = kind == EXT_IN_1 ? 0 : 1;
+		const uint32_t not_subset = only == 0 ? SH_NOT_SUBSET_1 : SH_NOT_SUBSET_2;
+		const bool to_delta = only == 1 && delta.fd != -1;	// All of it is wanted then.
+		if (!counting && !to_delta && (b >= common || (rec->flags & not_subset)))
+			return true;	// Nothing here can change the answer.
+		for (; b < end; b += MIN(PAGE_SIZE - b % PAGE_SIZE, end - b)) {
+			const size_t n = MIN(PAGE_SIZE - b % PAGE_SIZE, end - b);
+			scan_at(scan, fin, map, b);
+			throttle_io(&throttle, n);
+			if (!counting && !to_delta) {
+				if (!fill_isnull(&fill, map[only], fin[only].size, b, n)) {
+					rec->flags |= not_subset;
+					return true;
 				}
-				(const typeof(&init)) &init;
-			});
+				continue;
+			}
+			const size_t nz = fill_count_data(&fill, map[only], fin[only].size, b, n);
+			if (counting)
+				rec->data[only] += nz;
+			if (nz > 0 && b < common)
+				rec->flags |= not_subset;
+			if (nz > 0 && to_delta)
+				delta_put(fin, map, b, n, false, nz);
+		}
+		return true;
+	}
 
-	if (likely(mmap_offset - *unmap_offset > page_data->PAGE_SIZE)) {
-		const size_t unmap_sz = (mmap_offset - *unmap_offset) & ~page_data->PAGE_SIZE_bits;
-		munmap((void *)addr1_base + *unmap_offset, unmap_sz);
-		munmap((void *)addr2_base + *unmap_offset, unmap_sz);
-		*unmap_offset += unmap_sz;
+	rec->flags |= SH_SHARED;
+	for (; b < end; ) {
+		const size_t n = MIN(PAGE_SIZE - b % PAGE_SIZE, end - b);
+		const uint8_t *const a = map[0] + b, *const c = map[1] + b;
+		scan_at(scan, fin, map, b);
+		throttle_io(&throttle, 2 * n);
+		if (memcmp(a, c, n) == 0) {
+			// Neither knows anything here the other doesn't.
+			if (dedupe.on && !dedupe.failed && !extmap_add(&dedupe.same, b, b + n))
+				dedupe.failed = true;
+		}
+		else if (fill_isnull(&fill, map[1], fin[1].size, b, n)) {
+			const size_t nz = fill_count_data(&fill, map[0], fin[0].size, b, n);
+			rec->data[0] += nz;
+			if (nz > 0)
+				rec->flags |= SH_NOT_SUBSET_1;
+		}
+		else if (fill_isnull(&fill, map[0], fin[0].size, b, n)) {
+			const size_t nz = fill_count_data(&fill, map[1], fin[1].size, b, n);
+			rec->data[1] += nz;
+			rec->flags |= SH_NOT_SUBSET_2;
+			if (delta.fd != -1)
+				delta_put(fin, map, b, n, true, nz);
+		}
+		else {
+			const size_t adds = rec->data[1];
+			size_t sector = -1;
+			bool fill_a = false, fill_c = false;	// Whether that sector is fill, on each side.
+			for (size_t i = 0; i < n; i++) {
+				if (a[i] == c[i])
+					continue;
+				if (((b + i) & -(size_t)FILL_SECTOR) != sector) {
+					sector = (b + i) & -(size_t)FILL_SECTOR;
+					fill_a = fill_sector(&fill, map[0], fin[0].size, sector);
+					fill_c = fill_sector(&fill, map[1], fin[1].size, sector);
+				}
+				const bool known_a = a[i] != 0 && !fill_a, known_c = c[i] != 0 && !fill_c;
+				if (known_a && known_c) {
+					probe(conflict, b + i, 0);
+					shard_first(rec, b + i);
+					return false;
+				}
+				if (!known_a && !known_c)
+					continue;
+				rec->data[known_a ? 0 : 1]++;
+				rec->flags |= known_a ? SH_NOT_SUBSET_1 : SH_NOT_SUBSET_2;
+			}
+			if (delta.fd != -1 && rec->data[1] > adds)
+				delta_put(fin, map, b, n, true, rec->data[1] - adds);
+		}
+		b += n;
 	}
+	return true;
 }
 
-// Compare a block against null. Returns the amount of non-null in *fsz.
-// Returns true if completely null, else false if not completely null.
-static inline bool compnull(const size_t n, const uint8_t data[const restrict static n], size_t fsz[const restrict 1], const bool stop_on_mismatch) {
-	const int PAGE_SIZE = ({
-				static int pgsize = 0;
-				if (unlikely(pgsize == 0))
-					pgsize = sysconf(_SC_PAGESIZE);
-				pgsize;
-				});
-	const int PAGE_SIZE_bits = PAGE_SIZE - 1;
-	const size_t PAGE_SIZE_bits_not = (size_t)0 - PAGE_SIZE;
-
-	size_t fsz_calc = 0;
-	bool isnull = true;
-
-	size_t cmpoff = 0;
-	while (cmpoff < n) {
-		const int compsz = MIN(n - cmpoff, PAGE_SIZE);
-		if (memcmp(data + cmpoff, zero, compsz) != 0) {
-			if (fsz != nullptr)
-				fsz_calc += compsz;
-			if (isnull)
-				isnull = false;
-			if (stop_on_mismatch)
+// Compare [lo, hi) of the inputs into rec, going over their extent maps ext; both is where they
+// share data. Holes in both cost nothing, and no lseek() is made. Stops at the first conflict.
+//
+// Readahead follows the scan: over all the data with -g, else over just the shared data (and
+// in2's, for --delta), as that's all that gets read in full. Pages behind the scan are unmapped
+// as it goes; the caller still munmaps the whole of both maps afterwards. The throttle is paid
+// page by page in compare_span(), not by the readahead.
+static void range_compare(const f_in_info_t fin[const restrict static 2], const uint8_t *const map[const restrict static 2], const extmap_t ext[const restrict static 2], const extmap_t both[const restrict static 1], const size_t lo, const size_t hi, shard_rec_t rec[const restrict static 1]) {
+	const size_t common = MIN(fin[0].size, fin[1].size);
+
+	scan_t scan = { .unmapped = lo & -(size_t)sysconf(_SC_PAGESIZE) };
+	ra_ctl_t *const ra = &scan.ra;
+	ra_init(ra, 2, map, (const size_t[]){ fin[0].size, fin[1].size }, (const int[]){ fin[0].fd, fin[1].fd }, lo);
+	for (int i = 0; i < 2; i++)
+		ra_set_seek(ra, i, extmap_seek, (rec->flags & SH_GREATEST) || (i == 1 && delta.fd != -1) ? &ext[i] : both);
+	ra_start(ra);
+
+	extwalk_t w;
+	extwalk_init(&w, &ext[0], &ext[1], lo, hi);
+	uint64_t off, end;
+	int kind;
+	while (extwalk_next(&w, &off, &end, &kind)) {
+		probe(extent, off, end, kind);
+		// The end of the shorter input splits a stretch that crosses it.
+		const size_t split = off < common ? MIN(end, common) : end;
+		if (!compare_span(fin, map, off, split, kind, rec, &scan) || (split < end && !compare_span(fin, map, split, end, kind, rec, &scan)))
+			break;
+	}
+	ra_destroy(ra);
+}
+
+// Sampling pre-pass (--sample): before the sequential scan, look at a spread of blocks in the
+// data both inputs share -- the first and last block of every shared extent, and nsamples evenly
+// spaced through all of it -- so that an incompatible pair is turned down without reading up to
+// its first conflict. The reads of a batch are started together and are in flight at once.
+#define SAMPLE_DEFAULT	1024
+#define SAMPLE_BATCH	256
+
+// Returns the offset of a conflict, or -1 if none of the samples has one (or on ENOMEM, when
+// the full scan will just have to find it).
+static size_t sample_scan(const f_in_info_t fin[const restrict static 2], const uint8_t *const map[const restrict static 2], const extmap_t both[const restrict static 1], const size_t nsamples, const int PAGE_SIZE) {
+	const size_t shared = extmap_bytes(both, 0, both->size);
+	const size_t nprobes = 2 * both->n + (shared > 0 ? nsamples : 0);
+	extent_t *const at = malloc(MAX(nprobes, 1) * sizeof(*at));	// The blocks to look at.
+	if (at == nullptr)
+		return -1;
+	size_t n = 0;
+	for (size_t e = 0; e < both->n; e++) {
+		const extent_t *const x = &both->ext[e];
+		at[n++] = (extent_t){ .off = x->off, .end = MIN((x->off | (PAGE_SIZE - 1)) + 1, x->end) };
+		const size_t last = (x->end - 1) & -(size_t)PAGE_SIZE;
+		if (last > x->off)
+			at[n++] = (extent_t){ .off = last, .end = x->end };
+	}
+	// The evenly spaced ones, each in the middle of its share of the shared data.
+	size_t e = 0, before = 0;	// Shared bytes in the extents before e.
+	for (size_t k = 0; k < nsamples && shared > 0; k++) {
+		const size_t mid = (size_t)((2 * k + 1) * (double)shared / (2 * nsamples));
+		while (before + (both->ext[e].end - both->ext[e].off) <= mid) {
+			before += both->ext[e].end - both->ext[e].off;
+			e++;
+		}
+		const size_t off = MAX((both->ext[e].off + mid - before) & -(size_t)PAGE_SIZE, both->ext[e].off);
+		at[n++] = (extent_t){ .off = off, .end = MIN((off | (PAGE_SIZE - 1)) + 1, both->ext[e].end) };
+	}
+
+	// The full scan goes over the samples again, and notes them for the delta and dedupe then.
+	const int delta_fd = delta.fd;
+	const bool dedupe_on = dedupe.on;
+	delta.fd = -1;
+	dedupe.on = false;
+	size_t found = -1;
+	for (size_t batch = 0; batch < n && found == (size_t)-1; batch += SAMPLE_BATCH) {
+		const size_t stop = MIN(n, batch + SAMPLE_BATCH);
+		for (size_t i = batch; i < stop; i++) {
+			const size_t page = at[i].off & -(size_t)PAGE_SIZE;
+			madvise((void *)(map[0] + page), at[i].end - page, MADV_WILLNEED);
+			madvise((void *)(map[1] + page), at[i].end - page, MADV_WILLNEED);
+		}
+		for (size_t i = batch; i < stop; i++) {
+			shard_rec_t rec = { };
+			if (!compare_span(fin, map, at[i].off, at[i].end, EXT_SHARED, &rec, nullptr)) {
+				found = rec.first;
 				break;
+			}
 		}
+	}
+	delta.fd = delta_fd;
+	dedupe.on = dedupe_on;
+	free(at);
+	return found;
+}
+
+// Remote comparison: `nulldiff --remote "ssh host nulldiff --serve img" local`.
+//
+// The serving side walks its image once and sends a record per RM_BLOCK block: a run count for
+// blocks that are holes or all null, or a 128-bit hash for blocks with data. The local side
+// walks its own image in step with the records. Only blocks that both sides have data in, and
+// whose hashes differ, can hold a conflict; those, and blocks only the served image has data in
+// that run past the end of the shorter image, are fetched afterwards, with up to RM_INFLIGHT
+// requests ahead of the replies so that a slow link isn't a round trip per block, and compared
+// byte for byte. Each fetched block comes back behind its length, which has to be what
+// the block's size says. Anything that speaks the protocol on a pipe will do as the link.
+//
+// The answer is a local comparison's, with the served image as in1 and the local one as in2;
+// -g isn't supported.
+#define RM_MAGIC	"NDRMT002"
+#define RM_BLOCK	(1 << 20)
+#define RM_QUIT	UINT64_MAX	// Fetch request that ends the session.
+#define RM_INFLIGHT	8	// Fetch requests sent and not yet answered.
+
+enum {
+		RM_NULL = 0,	// u32 count: that many hole or null blocks.
+		RM_DATA = 1,	// 16-byte hash of one block.
+	};
+
+typedef struct {
+		char magic[8];
+		uint32_t blocksize;
+		uint32_t reserved;
+	} rm_hello_t;
+
+typedef struct {
+		char magic[8];
+		uint64_t size;
+	} rm_reply_t;
+
+typedef struct {
+		uint64_t h[2];
+	} rm_hash_t;
+
+// pread() all of n bytes, or what there is before end-of-file. Holes read as null.
+static ssize_t fin_pread(const f_in_info_t fin[const restrict static 1], uint8_t *const buf, const size_t n, const off_t off) {
+	if (fin->qcow != nullptr)
+		return qcow2_pread(fin->qcow, buf, n, off);
+	size_t got = 0;
+	while (got < n) {
+		const ssize_t r = pread(fin->fd, buf + got, n - got, off + got);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		got += r;
+	}
+	return got;
+}
+
+typedef struct {
+		const f_in_info_t *fin;
+		size_t data, hole;	// The data extent at or after the last block looked at.
+		uint8_t *buf;
+	} rm_walk_t;
+
+// Look at the block at off. Returns false if it's null, else true and its hash. -1 on error.
+static int rm_block(rm_walk_t w[const restrict static 1], const size_t off, rm_hash_t hash[const restrict static 1]) {
+	const size_t end = MIN(off + RM_BLOCK, w->fin->size);
+	if (off >= w->fin->size)
+		return false;
+	if (w->hole <= off) {
+		const off_t data = fin_seek(w->fin, off, SEEK_DATA);
+		w->data = data == -1 ? w->fin->size : (size_t)data;
+		const off_t hole = data == -1 ? -1 : fin_seek(w->fin, data, SEEK_HOLE);
+		w->hole = hole == -1 ? w->fin->size : (size_t)hole;
+	}
+	if (w->data >= end)
+		return false;	// All hole.
+
+	const ssize_t got = fin_pread(w->fin, w->buf, end - off, off);
+	if (got < 0)
+		return -1;
+	throttle_io(&throttle, got);
+	fill_clear(&fill, w->buf, got, off);
+	if (nullvec_iszero(w->buf, got))
+		return false;
+	hash->h[0] = blockhash64(w->buf, got, 0);
+	hash->h[1] = blockhash64(w->buf, got, 0x9E3779B97F4A7C15ULL);
+	return true;
+}
 
-		cmpoff += compsz;
+static bool rm_open(const char *const path, FILE *f[const restrict static 1], qcow2_t q[const restrict static 1], f_in_info_t fin[const restrict static 1]) {
+	*f = fopen(path, "rb");
+	if (*f == nullptr) {
+		fprintf(stderr, "Unable to open %s", path);
+		perror(", ");
+		return false;
+	}
+	struct stat st;
+	if (fstat(fileno(*f), &st) == -1 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", path);
+		fclose(*f);
+		return false;
+	}
+	const bool is_qcow = qcow2_probe(fileno(*f));
+	if (is_qcow && !qcow2_open(q, fileno(*f), path)) {
+		fclose(*f);
+		return false;
+	}
+	// f_in_info_t's members are const; build it whole.
+	memcpy(fin, &(f_in_info_t){
+			.f_in = *f,
+			.size = is_qcow ? q->size : (size_t)st.st_size,
+			.fd = fileno(*f),
+			.qcow = is_qcow ? q : nullptr
+		}, sizeof(*fin));
+	posix_fadvise(fin->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return true;
+}
+
+// --serve: answer one remote comparison on stdin/stdout.
+static int rm_serve(const char *const path) {
+	FILE *f;
+	static qcow2_t q;
+	f_in_info_t fin;
+
+	rm_hello_t hello;
+	if (fread(&hello, sizeof(hello), 1, stdin) != 1 || memcmp(hello.magic, RM_MAGIC, sizeof(hello.magic)) != 0
+			|| hello.blocksize != RM_BLOCK) {
+		fprintf(stderr, "Error: The other side doesn't speak this protocol.\n");
+		return -3;
+	}
+	if (!rm_open(path, &f, &q, &fin))
+		return -3;
+
+	rm_reply_t reply = { .magic = RM_MAGIC, .size = fin.size };
+	fwrite(&reply, sizeof(reply), 1, stdout);
+
+	rm_walk_t w = { .fin = &fin, .buf = malloc(RM_BLOCK) };
+	if (w.buf == nullptr) {
+		fprintf(stderr, "Unable to allocate block buffer.\n");
+		return -4;
+	}
+
+	uint32_t nulls = 0;
+	for (size_t off = 0; off < fin.size; off += RM_BLOCK) {
+		rm_hash_t hash;
+		const int r = rm_block(&w, off, &hash);
+		if (r < 0) {
+			perror("Error reading image");
+			return -4;
+		}
+		if (r == 0 && nulls < UINT32_MAX) {
+			nulls++;
+			continue;
+		}
+		if (nulls > 0) {
+			fputc(RM_NULL, stdout);
+			fwrite(&nulls, sizeof(nulls), 1, stdout);
+			nulls = 0;
+		}
+		if (r == 0) {
+			nulls = 1;
+			continue;
+		}
+		fputc(RM_DATA, stdout);
+		fwrite(&hash, sizeof(hash), 1, stdout);
+	}
+	if (nulls > 0) {
+		fputc(RM_NULL, stdout);
+		fwrite(&nulls, sizeof(nulls), 1, stdout);
+	}
+	if (fflush(stdout) != 0)
+		return -4;
+	posix_fadvise(fin.fd, 0, 0, POSIX_FADV_RANDOM);
+
+	// Now the blocks the other side wants a closer look at.
+	uint64_t blk;
+	while (fread(&blk, sizeof(blk), 1, stdin) == 1 && blk != RM_QUIT) {
+		const size_t off = blk * RM_BLOCK;
+		const ssize_t got = off < fin.size ? fin_pread(&fin, w.buf, MIN(RM_BLOCK, fin.size - off), off) : 0;
+		if (got < 0) {
+			perror("Error reading image");
+			return -4;
+		}
+		throttle_io(&throttle, got);
+		fill_clear(&fill, w.buf, got, off);
+		const uint64_t len = got;
+		fwrite(&len, sizeof(len), 1, stdout);
+		fwrite(w.buf, 1, got, stdout);
+		if (fflush(stdout) != 0)
+			return -4;
+	}
+
+	free(w.buf);
+	fclose(f);
+	return 0;
+}
+
+// Start cmd with a pipe to each of its stdin and stdout.
+static pid_t rm_spawn(const char *const cmd, FILE *tx[const restrict static 1], FILE *rx[const restrict static 1]) {
+	int to[2], from[2];
+	if (pipe2(to, O_CLOEXEC) != 0)
+		return -1;
+	if (pipe2(from, O_CLOEXEC) != 0) {
+		close(to[0]);
+		close(to[1]);
+		return -1;
+	}
+
+	const pid_t pid = fork();
+	if (pid == 0) {
+		dup2(to[0], STDIN_FILENO);
+		dup2(from[1], STDOUT_FILENO);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)nullptr);
+		_exit(127);
+	}
+	close(to[0]);
+	close(from[1]);
+	if (pid == -1) {
+		close(to[1]);
+		close(from[0]);
+		return -1;
+	}
+	*tx = fdopen(to[1], "wb");
+	*rx = fdopen(from[0], "rb");
+	if (*tx == nullptr || *rx == nullptr) {
+		// Closing our ends makes the child see end-of-file and quit.
+		*tx == nullptr ? close(to[1]) : fclose(*tx);
+		*rx == nullptr ? close(from[0]) : fclose(*rx);
+		waitpid(pid, nullptr, 0);
+		return -1;
+	}
+	return pid;
+}
+
+// --remote: compare the local image against the one served by cmd.
+static int rm_compare(const char *const cmd, const char *const path) {
+	FILE *f;
+	static qcow2_t q;
+	f_in_info_t fin;
+	if (!rm_open(path, &f, &q, &fin))
+		return -3;
+
+	int ret = 0;
+	size_t *cand = nullptr;	// Blocks to fetch, in order.
+	size_t ncand = 0, cap = 0;
+	shard_rec_t rec = { };	// What's found: a conflict, shared data, the subset bits.
+	rm_walk_t w = { .fin = &fin, .buf = malloc(RM_BLOCK) };
+	uint8_t *const rbuf = malloc(RM_BLOCK);
+
+	FILE *tx = nullptr, *rx = nullptr;
+	const pid_t pid = rm_spawn(cmd, &tx, &rx);
+	if (pid == -1) {
+		perror("Error: Unable to start the remote side");
+		ret = -4;
+		goto out;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (w.buf == nullptr || rbuf == nullptr) {
+		fprintf(stderr, "Unable to allocate block buffers.\n");
+		ret = -4;
+		goto out;
+	}
+
+	const rm_hello_t hello = { .magic = RM_MAGIC, .blocksize = RM_BLOCK };
+	rm_reply_t reply;
+	if (fwrite(&hello, sizeof(hello), 1, tx) != 1 || fflush(tx) != 0
+			|| fread(&reply, sizeof(reply), 1, rx) != 1 || memcmp(reply.magic, RM_MAGIC, sizeof(reply.magic)) != 0) {
+		fprintf(stderr, "Error: No answer from the remote side.\n");
+		ret = -3;
+		goto out;
+	}
+	const size_t rsize = reply.size;
+	if (fin.size == 0 || rsize == 0) {
+		fprintf(stderr, "Error: I can't work with zero-length file %s.\n", fin.size == 0 ? path : "on the remote side");
+		ret = -3;
+		goto out;
+	}
+
+	// Walk both images together.
+	const size_t common = MIN(fin.size, rsize);
+	const size_t rblocks = (rsize + RM_BLOCK - 1) / RM_BLOCK;
+	size_t blk = 0;
+	while (blk < rblocks) {
+		const int kind = fgetc(rx);
+		uint32_t count = 1;
+		rm_hash_t rhash;
+		if ((kind == RM_NULL && fread(&count, sizeof(count), 1, rx) != 1)
+				|| (kind == RM_DATA && fread(&rhash, sizeof(rhash), 1, rx) != 1)
+				|| (kind != RM_NULL && kind != RM_DATA) || count > rblocks - blk) {
+			fprintf(stderr, "Error: The remote side stopped making sense at block %zu.\n", blk);
+			ret = -3;
+			goto out;
+		}
+
+		for (const size_t stop = blk + count; blk < stop; blk++) {
+			const size_t off = blk * RM_BLOCK;
+			rm_hash_t hash;
+			const int r = rm_block(&w, off, &hash);
+			if (r < 0) {
+				perror("Error reading image");
+				ret = -4;
+				goto out;
+			}
+			if (r == 0 && kind == RM_NULL)
+				continue;
+			if (kind == RM_NULL) {
+				// Only we have data here; it counts up to the end of the shorter image.
+				if (off < common && !nullvec_iszero(w.buf, common - off < RM_BLOCK ? common - off : RM_BLOCK))
+					rec.flags |= SH_NOT_SUBSET_2;
+				continue;
+			}
+			if (r == 0) {
+				// Only the other side has data here. Whether any of it is before the end of
+				// the shorter image takes a look, if the block runs past that.
+				if (off >= common)
+					continue;
+				if (MIN(off + RM_BLOCK, rsize) <= common) {
+					rec.flags |= SH_NOT_SUBSET_1;
+					continue;
+				}
+			}
+			else {
+				rec.flags |= SH_SHARED;
+				if (!memcmp(&hash, &rhash, sizeof(hash)))
+					continue;
+			}
+
+			if (ncand == cap) {
+				cap = cap ? cap * 2 : 64;
+				size_t *const grown = realloc(cand, cap * sizeof(*cand));
+				if (grown == nullptr) {
+					fprintf(stderr, "Unable to allocate block list.\n");
+					ret = -4;
+					goto out;
+				}
+				cand = grown;
+			}
+			cand[ncand++] = blk;
+		}
+	}
+
+	// Pin down the blocks that differ. Nulls on either side are fine; anything else isn't. The
+	// replies come in the order asked for.
+	size_t asked = 0;
+	for (size_t i = 0; i < ncand && (rec.flags & SH_SHARED) && !(rec.flags & SH_FIRST) && ret == 0; i++) {
+		bool sent = true;
+		for (; asked < ncand && asked < i + RM_INFLIGHT && sent; asked++)
+			sent = fwrite(&(const uint64_t){ cand[asked] }, sizeof(uint64_t), 1, tx) == 1;
+		const size_t off = cand[i] * RM_BLOCK;
+		const size_t n = MIN(RM_BLOCK, MIN(fin.size, rsize) - off);
+		const size_t want = MIN(RM_BLOCK, rsize - off);
+		uint64_t len;
+		const ssize_t got = fin_pread(&fin, w.buf, MIN(RM_BLOCK, fin.size - off), off);
+		if (!sent || fflush(tx) != 0 || fread(&len, sizeof(len), 1, rx) != 1
+				|| (len == want && fread(rbuf, 1, want, rx) != want) || got < 0) {
+			fprintf(stderr, "Error: Unable to fetch block %zu.\n", cand[i]);
+			ret = -3;
+			break;
+		}
+		if (len != want) {
+			fprintf(stderr, "Error: The remote side sent %lu bytes of block %zu, not %zu.\n", (unsigned long)len, cand[i], want);
+			ret = -3;
+			break;
+		}
+		throttle_io(&throttle, got);
+		fill_clear(&fill, w.buf, got, off);
+		for (size_t b = 0; b < n; b++) {
+			if (w.buf[b] == rbuf[b])
+				continue;
+			if (w.buf[b] != 0 && rbuf[b] != 0) {
+				probe(conflict, off + b, 0);
+				shard_first(&rec, off + b);
+				break;
+			}
+			rec.flags |= w.buf[b] != 0 ? SH_NOT_SUBSET_2 : SH_NOT_SUBSET_1;
+		}
+	}
+
+out:
+	if (pid != -1) {
+		const uint64_t quit = RM_QUIT;
+		fwrite(&quit, sizeof(quit), 1, tx);
+		fclose(tx);
+		fclose(rx);
+		int status;
+		waitpid(pid, &status, 0);
+		// Stopping at a conflict may leave it writing replies nobody reads.
+		if (ret == 0 && !(rec.flags & SH_FIRST) && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+			fprintf(stderr, "Error: The remote side failed.\n");
+			ret = -3;
+		}
+	}
+	if (ret == 0)
+		ret = shard_report_diff(&rec);
+	free(cand);
+	free(w.buf);
+	free(rbuf);
+	if (fin.qcow != nullptr)
+		qcow2_close(&q);
+	fclose(f);
+	return ret;
+}
+
+// --apply delta image: write a --delta into the in1 it was made against. Each page of the delta
+// is merged into what the image holds there now, so an image that has gained data since takes
+// it too, as long as nothing conflicts. At a conflict it stops; what was written by then fit.
+// With --fill, fill sectors are nulls on both sides, and come out null in the pages written.
+static int delta_apply(const char *const dpath, const char *const path) {
+	const int PAGE_SIZE = sysconf(_SC_PAGESIZE);
+	const int dfd = open(dpath, O_RDONLY | O_CLOEXEC);
+	const int fd = open(path, O_RDWR | O_CLOEXEC);
+	struct stat dst, st;
+	int ret = -3;
+	extmap_t ext = { };
+	uint8_t *const dbuf = malloc(DELTA_CHUNK), *const buf = malloc(DELTA_CHUNK);
+	if (dfd == -1 || fd == -1) {
+		fprintf(stderr, "Unable to open %s", dfd == -1 ? dpath : path);
+		perror(", ");
+		goto out;
+	}
+	if (fstat(dfd, &dst) == -1 || fstat(fd, &st) == -1 || !S_ISREG(dst.st_mode) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s, %s)\n", dpath, path);
+		goto out;
+	}
+	if (qcow2_probe(fd)) {
+		fprintf(stderr, "Error: I can't write into qcow2 image %s.\n", path);
+		goto out;
+	}
+	if (dbuf == nullptr || buf == nullptr) {
+		fprintf(stderr, "Unable to allocate block buffers.\n");
+		ret = -4;
+		goto out;
+	}
+	if (!extmap_load(&ext, dfd, dst.st_size, nullptr, nullptr)) {
+		fprintf(stderr, "Error: Unable to find the data in %s", dpath);
+		perror(", ");
+		ret = -4;
+		goto out;
 	}
 
-	if (fsz != nullptr)
-		fsz[0] = fsz_calc;
+	size_t written = 0;
+	ret = 0;
+	for (size_t e = 0; e < ext.n && ret == 0; e++) {
+		for (size_t off = ext.ext[e].off & -(size_t)PAGE_SIZE; off < ext.ext[e].end && ret == 0; off += DELTA_CHUNK) {
+			const size_t n = MIN(DELTA_CHUNK, ext.ext[e].end - off);
+			const ssize_t got = pread(dfd, dbuf, n, off);
+			const ssize_t have = pread(fd, buf, n, off);
+			if (got != (ssize_t)n || have < 0) {
+				perror("Error reading the delta or the image");
+				ret = -4;
+				break;
+			}
+			memset(buf + have, 0, n - have);
+			throttle_io(&throttle, n + have);
+			fill_clear(&fill, dbuf, n, off);
+			fill_clear(&fill, buf, n, off);
+
+			// Runs of pages the delta has anything in. The filesystem may have handed out more
+			// than those; what it filled in is null, and stays out of the image.
+			for (size_t p = 0; p < n; ) {
+				size_t q = p;
+				while (q < n && !nullvec_iszero(dbuf + q, MIN(PAGE_SIZE, n - q)))
+					q += MIN(PAGE_SIZE, n - q);
+				if (q == p) {
+					p += MIN(PAGE_SIZE, n - p);
+					continue;
+				}
+				const size_t at = nullvec_merge(buf + p, buf + p, dbuf + p, q - p, 0, nullptr);
+				if (at < q - p) {
+					probe(conflict, off + p + at, 0);
+					fprintf(stderr, "Error: %s doesn't fit %s: they differ at byte %zu.\n", dpath, path, off + p + at);
+					ret = -1;
+					break;
+				}
+				if (pwrite(fd, buf + p, q - p, off + p) != (ssize_t)(q - p)) {
+					fprintf(stderr, "Error: Unable to write to %s", path);
+					perror(", ");
+					ret = -4;
+					break;
+				}
+				written += q - p;
+				p = q;
+			}
+		}
+	}
+	if (ret == 0 && st.st_size < dst.st_size && ftruncate(fd, dst.st_size) != 0) {
+		fprintf(stderr, "Error: Unable to extend %s", path);
+		perror(", ");
+		ret = -4;
+	}
+	if (ret == 0 && fsync(fd) != 0) {
+		perror("Error: fsync");
+		ret = -4;
+	}
+	if (ret == 0)
+		fprintf(stderr, "Applied %zu bytes of %s to %s.\n", written, dpath, path);
+
+out:
+	extmap_free(&ext);
+	free(dbuf);
+	free(buf);
+	if (dfd != -1)
+		close(dfd);
+	if (fd != -1)
+		close(fd);
+	return ret;
+}
 
-	return isnull;
+// nulldiff's own long options; see main().
+typedef struct {
+		size_t sample;
+		bool lowest;
+	} diff_opts_t;
+
+static const opt_t diff_optv[] = {
+		{ "--sample", OPT_OPTIONAL },
+		{ "--lowest", OPT_FLAG },
+		{ "--delta", OPT_VALUE },
+		{ "--dedupe", OPT_FLAG },
+	};
+
+static bool diff_take(void *const ctx, const size_t which, const char *const value) {
+	diff_opts_t *const o = ctx;
+	switch (which) {
+		case 0:
+			if (value == nullptr) {
+				o->sample = SAMPLE_DEFAULT;
+				return true;
+			}
+			return shard_number("--sample", value, &o->sample);
+		case 1:
+			o->lowest = true;
+			return true;
+		case 2:
+			delta.path = value;
+			return true;
+		default:
+			dedupe.on = true;
+			return true;
+	}
 }
 
 int main(int argc, char **argv) {
 
 	// Will compare two files, determining if they are the same except in areas of NULL
-	// Does not tell you which file has the most null. Use `gzip -1 | wc -c` for that.
-	if (argc < 3 || argc > 3) {
-		printf("Error: You must specify two input files.\n");
-		return 1;
-	}
+	// Does not tell you which file has the most null. Use `hasnull -c` for that.
+	//
+	// --serve image: serve image to a --remote comparison on stdin/stdout.
+	// --remote cmd image: compare image against the one served by the shell command cmd,
+	// 	usually `ssh host nulldiff --serve image`. Returns 0, -1, -2 or -3 as below.
+	//
+	// --offset bytes, --length bytes: compare only that range, which must be page-aligned.
+	// --shard file: write what the range holds to file, for nullmerge, instead of answering.
+	// --fill byte|pattern: sectors that hold only this are unknown, like nulls. See fill.h. For
+	// 	--remote, each side takes its own; give the serving side its --fill in cmd.
+	// --max-bandwidth rate, --ioprio class, --psi pct: go easy on shared storage. See throttle.h.
+	// --apply delta image: write a --delta into the image it was made against. Returns 0, -1 if
+	// 	it doesn't fit, -3 or -4.
+	shard_opts_t shard;
+	if (!shard_strip(&argc, argv, &shard) || !fill_strip(&argc, argv, &fill) || !throttle_strip(&argc, argv, &throttle))
+		return -3;
 
-	static struct {
-			bool show_greatest;	// The largest file is ...
-			bool subset;	// -1: fin1; -2: fin2; 0: same; -3: both files have unique data compared to the other
-		} settings = (constexpr typeof(settings)){.show_greatest = false, .subset = false};
+	// --sample[=n]: first look at a spread of blocks, n of them evenly spaced (default 1024) and
+	// 	the ends of every shared extent, and answer at once if one of them conflicts.
+	// --lowest: with --sample, report a sampled conflict at once, then go on to find the first one.
+	// --delta file: also write what in2 adds to in1 to file, sparse, for --apply. Removed again
+	// 	if the inputs conflict.
+	// --dedupe: if the inputs agree, have the kernel share in2's blocks that hold the same as
+	// 	in1's (FIDEDUPERANGE; btrfs, XFS). in2 is best writable.
+	diff_opts_t opts = { };
+	if (!opt_strip(&argc, argv, sizeof(diff_optv) / sizeof(*diff_optv), diff_optv, diff_take, &opts))
+		return -3;
+	if (opts.lowest && opts.sample == 0)
+		opts.sample = SAMPLE_DEFAULT;
+	if (opts.sample > 0 && (shard.ranged || (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--remote") == 0)))) {
+		fprintf(stderr, "Error: --sample is for whole local files; not with --offset, --length, --shard, --serve or --remote.\n");
+		return -3;
+	}
+	if (delta.path != nullptr && (shard.out != nullptr || (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--remote") == 0 || strcmp(argv[1], "--apply") == 0)))) {
+		fprintf(stderr, "Error: --delta is for comparing local files; not with --shard, --serve, --remote or --apply.\n");
+		return -3;
+	}
+	if (dedupe.on && (shard.out != nullptr || (argc > 1 && (strcmp(argv[1], "--serve") == 0 || strcmp(argv[1], "--remote") == 0 || strcmp(argv[1], "--apply") == 0)))) {
+		fprintf(stderr, "Error: --dedupe is for comparing local files; not with --shard, --serve, --remote or --apply.\n");
+		return -3;
+	}
+	if ((argc == 4 && (strcmp(argv[1], "--apply") == 0 || strcmp(argv[1], "--remote") == 0)) || (argc == 3 && strcmp(argv[1], "--serve") == 0)) {
+		if (!throttle_start(&throttle))
+			return -3;
+		if (strcmp(argv[1], "--apply") == 0)
+			return delta_apply(argv[2], argv[3]);
+		if (strcmp(argv[1], "--serve") == 0)
+			return rm_serve(argv[2]);
+		return rm_compare(argv[2], argv[3]);
+	}
 
-	
 	// -g: Return the greatest size file
-	// -s: Return whether one is a subset of the other; may return both
+	// -s: Return whether one is a subset of the other; may return both. The subset bits are
+	// 	always set, so this is only kept for old scripts.
 	// return type: 7 bit return-code, or -2 on error or -1 on unreconcileable difference.
 	// 0b 0 1 1 1 1 1 1 1
 	// 		| | | | | | `- Set if in1 is a subset of in2. It may be that neither is a proper subset.
@@ -144,591 +987,234 @@ int main(int argc, char **argv) {
 	// 		-2 indicates that the files have data, but share no blocks.
 	// 		-3 indicates a file type/access/other error, such as zero-length or completely sparse.
 	// 		-4 indicates a system error, such as unable to mmap.
-	char ci;
-	while (ci = getopt(argc, argv, "gs")) {
-		if (ci == -1)
-			break;
-		switch(ci) {
+	bool show_greatest = false;
+	int ci;
+	while ((ci = getopt(argc, argv, "gs")) != -1) {
+		switch (ci) {
 			case 'g':
-				settings.show_greatest = true;
+				show_greatest = true;
 				break;
 			case 's':
-				settings.subset = true;
-
-			default:
-				__builtin_unreachable();
 				break;
+			default:
+				return 1;
 		}
 	}
 
-	FILE *in1 = fopen(argv[1], "rb");
+	if (argc - optind != 2) {
+		printf("Error: You must specify two input files.\n");
+		return 1;
+	}
+	if (!throttle_start(&throttle))
+		return -3;
+	const char *const path1 = argv[optind];
+	const char *const path2 = argv[optind + 1];
+
+	FILE *in1 = fopen(path1, "rb");
 	if (in1 == nullptr) {
-		fprintf(stderr, "Unable to open %s", argv[1]);
+		fprintf(stderr, "Unable to open %s", path1);
 		perror(", ");
 		return -3;
 	}
-	FILE *in2 = fopen(argv[2], "rb");
+	FILE *in2 = fopen(path2, "rb");
 	if (in2 == nullptr) {
 		fclose(in1);
-		fprintf(stderr, "Unable to open %s", argv[2]);
+		fprintf(stderr, "Unable to open %s", path2);
 		perror(", ");
 		return -3;
 	}
 
 	struct stat stat_buf;
 	if (fstat(fileno(in1), &stat_buf) == -1) {
-		fprintf(stderr, "Error: Unable to stat %s\n", argv[1]);
+		fprintf(stderr, "Error: Unable to stat %s\n", path1);
 		fclose(in1);
 		fclose(in2);
 		return -3;
 	}
 	if (!S_ISREG(stat_buf.st_mode)) {
-		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", argv[1]);
+		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", path1);
 		fclose(in1);
 		fclose(in2);
 		return -3;
 	}
-	const size_t in1_size = stat_buf.st_size;
+	size_t in1_size = stat_buf.st_size;
 	if (fstat(fileno(in2), &stat_buf) == -1) {
-		fprintf(stderr, "Error: Unable to stat %s\n", argv[2]);
+		fprintf(stderr, "Error: Unable to stat %s\n", path2);
 		fclose(in1);
 		fclose(in2);
 		return -3;
 	}
 	if (!S_ISREG(stat_buf.st_mode)) {
-		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", argv[2]);
+		fprintf(stderr, "Error: I'm not able to work with anything but regular files. (%s)\n", path2);
 		fclose(in1);
 		fclose(in2);
 		return -3;
 	}
-	const size_t in2_size = stat_buf.st_size;
-
-	f_in_info_t fin1 = {
-			.f_in = in1,
-			.size = in1_size,
-			.fd = fileno(in1)
-		};
-	f_in_info_t fin2 = {
-			.f_in = in2,
-			.size = in2_size,
-			.fd = fileno(in2)
-		};
+	size_t in2_size = stat_buf.st_size;
 
-	if (fin1.size == 0 || fin2.size == 0) {
-		if (fin1.size == 0) {
-			fclose(in1);
-			fclose(in2);
-			fprintf(stderr, "Error: I can't work with zero-length file %s.\n", argv[1]);
-			return -3;
-		}
-		if (fin2.size == 0) {
-			fclose(in1);
-			fclose(in2);
-			fprintf(stderr, "Error: I can't work with zero-length file %s.\n", argv[2]);
-			return -3;
-		}
-	}
-	if (lseek(fin1.fd, 0, SEEK_DATA) == -1 && errno == ENXIO) {
+	// qcow2 images are compared by their virtual disks.
+	static qcow2_t q1, q2;
+	const bool is_qcow1 = qcow2_probe(fileno(in1));
+	const bool is_qcow2 = qcow2_probe(fileno(in2));
+	if ((is_qcow1 && !qcow2_open(&q1, fileno(in1), path1)) || (is_qcow2 && !qcow2_open(&q2, fileno(in2), path2))) {
 		fclose(in1);
 		fclose(in2);
-		fprintf(stderr, "Error: File is non-zero but is completely sparse, with no data:\n\t%s.\n", argv[1]);
 		return -3;
 	}
-	if (lseek(fin2.fd, 0, SEEK_DATA) == -1 && errno == ENXIO) {
-		fclose(in1);
-		fclose(in2);
-		fprintf(stderr, "Error: File is non-zero but is completely sparse, with no data:\n\t%s.\n", argv[2]);
-		return -3;
-	}
-	
-
-	const uint8_t *const in1map = mmap(NULL, fin1.size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE | MAP_NONBLOCK, fin1.fd, 0);
-	if (in1map == MAP_FAILED) {
-		fprintf(stderr, "Error: unable to mmap %s, ", argv[1]);
-		perror("");
-		fclose(in1);
-		fclose(in2);
-		return -4;
+	if (is_qcow1)
+		in1_size = q1.size;
+	if (is_qcow2)
+		in2_size = q2.size;
+
+	const f_in_info_t fin[2] = {
+			{
+				.f_in = in1,
+				.size = in1_size,
+				.fd = fileno(in1),
+				.qcow = is_qcow1 ? &q1 : nullptr
+			},
+			{
+				.f_in = in2,
+				.size = in2_size,
+				.fd = fileno(in2),
+				.qcow = is_qcow2 ? &q2 : nullptr
+			},
+		};
+	const char *const path[2] = { path1, path2 };
+
+	// Where each input's data is, once, and where they share it. Everything below works from these.
+	extmap_t ext[2] = { }, both = { };
+	int ret = -3;
+	for (int i = 0; i < 2; i++) {
+		if (fin[i].size == 0) {
+			fprintf(stderr, "Error: I can't work with zero-length file %s.\n", path[i]);
+			goto out;
+		}
+		if (!extmap_load(&ext[i], fin[i].fd, fin[i].size, fin[i].qcow != nullptr ? fin_seek_qcow2 : nullptr, fin[i].qcow)) {
+			fprintf(stderr, "Error: Unable to find the data in %s", path[i]);
+			perror(", ");
+			ret = -4;
+			goto out;
+		}
+		if (ext[i].n == 0) {
+			fprintf(stderr, "Error: File is non-zero but is completely sparse, with no data:\n\t%s.\n", path[i]);
+			goto out;
+		}
 	}
-	madvise((void *)in1map, fin1.size, MADV_DONTDUMP);
-
-	const uint8_t *const in2map = mmap(NULL, fin2.size, PROT_READ, MAP_PRIVATE | MAP_NORESERVE | MAP_NONBLOCK, fin2.fd, 0);
-	if (in2map == MAP_FAILED) {
-		fprintf(stderr, "Error: unable to mmap %s, ", argv[2]);
-		perror("");
-		munmap((void *)in1map, in1_size);
-		fclose(in1);
-		fclose(in2);
-		return -4;
+	if (!extmap_intersect(&both, &ext[0], &ext[1])) {
+		fprintf(stderr, "Unable to allocate the extent maps.\n");
+		ret = -4;
+		goto out;
 	}
-	madvise((void *)in2map, fin2.size, MADV_DONTDUMP);
-
 
 	const int PAGE_SIZE = sysconf(_SC_PAGESIZE);
-	const int PAGE_SIZE_bits = PAGE_SIZE - 1;
-	const size_t PAGE_SIZE_bits_not = (size_t)0 - PAGE_SIZE;
-
-	zero = malloc(PAGE_SIZE);
-	if (zero == nullptr) {
-		fprintf(stderr, "Unable to allocate %i bytes for zero block.\n", PAGE_SIZE);
-		goto err;
-
-	}
-
-	size_t f_off = 0;
-	size_t unmap_off = 0;	// both will have the same ranges mapped.
-
-	// Keep track of how much file data is in each.
-	size_t procsz1 = 0, procsz2 = 0;
-	bool subset1 = true, subset2=true;
-	size_t next_hole = 0;
-	
-	{
-		// Set the first data block.
-		size_t data_1 = lseek(fin1.fd, 0, SEEK_DATA);
-		size_t data_2 = lseek(fin2.fd, 0, SEEK_DATA);
-		size_t hole_1 = lseek(fin1.fd, data_1, SEEK_HOLE);
-		size_t hole_2 = lseek(fin1.fd, data_2, SEEK_HOLE);
-
-		// Don't go beyond the start of the other file's data
-		hole_1 = MIN(hole_1, data_2);
-		hole_2 = MIN(hole_2, data_1);
-		next_hole = MIN(hole_1, hole_2);
-
-		madvise((void *)in1map + data_1, fin1.size - data_1, MADV_SEQUENTIAL | MADV_DONTDUMP);
-		madvise((void *)in2map + data_2, fin2.size - data_2, MADV_SEQUENTIAL | MADV_DONTDUMP);
-
-		// Find a byte offset that both files have
-		do {
-
-			if (settings.subset || settings.show_greatest) {
-				// We need to do accounting - subset checking, and show-greatest.
-				if (data_1 < data_2) {
-					size_t datasz_off = 0;
-					// Compare for null blocks in single file's data
-					compnull(next_hole - data_1, in1map + data_1, &datasz_off, !settings.show_greatest);
-					if (datasz_off > 0) {
-						if (subset2) {
-							// There is valid data in data1, before the next block of data2. So it's not a subset.
-							subset2 = false;
-						}
-						if (settings.show_greatest)
-							procsz1 += datasz_off;
-					}
-
-				}
-				else if (data_2 < data_1) {
-					size_t datasz_off = 0;
-					compnull(next_hole - data_2, in2map + data_2, &datasz_off, !settings.show_greatest);
-					if (datasz_off > 0) {
-						if (subset1) {
-							// data2 has data not in data1. So data2 is not a subset of 1.
-							subset1 = false;
-						}
-						if (settings.show_greatest)
-							procsz2 += datasz_off;
-					}
-				}
-			}
-
-			data_1 = lseek(fin1.fd, next_hole, SEEK_DATA);
-			data_2 = lseek(fin2.fd, next_hole, SEEK_DATA);
-			hole_1 = lseek(fin1.fd, data_1, SEEK_HOLE);
-			hole_2 = lseek(fin2.fd, data_2, SEEK_HOLE);
-			next_hole = MIN(hole_1, hole_2);
-
-			if (data_1 == (size_t)-1 || data_2 == (size_t)-1) {
-				fprintf(stderr, "Error: Files do not share any data blocks.\n");
-				return -2;
-			}
-		} while (data_1 != data_2);
-
-		// they're equal.
-		f_off = data_1;
-
-		//already set: next_hole = MIN(hole_1, hole_2);
-	}
-
-	const off_t max_size = MIN(fin1.size, fin2.size);
-	if (f_off >= max_size) {
-		// this should result in an ENXIO, above
-		fprintf(stderr, "Error: Files do not share any data blocks.\n");
-		return -2;
-	}
-
-	// Setup: madvise.
-	//madvise(in1map, in1_size, MADV_SEQUENTIAL);
-	//madvise(in2map, in2_size, MADV_SEQUENTIAL);
-	off_t madv_off = 0;
-	{
-		// At the moment, f_off is a pull-page or 0, so it's aligned.
-		const size_t remaining = MIN(4<<20, max_size - f_off);
-		if (remaining > (4 << 20)) {
-			madvise((void *)in1map + f_off, remaining, MADV_WILLNEED);
-			madvise((void *)in2map + f_off, remaining, MADV_WILLNEED);
-			madv_off = f_off + remaining;
-		}
-	}
-
-	if (f_off > PAGE_SIZE) {
-		// We haven't unmapped anything yet, so take care of it.
-		mumap(in1map, in2map, f_off, &unmap_off);
-	}
-
-	// We stop at the last part of the file with data. After that, they're null-equal.
-	while (f_off < max_size) {
-		// Informational, /proc/.../fdinfo/
-		lseek(fin1.fd, f_off, SEEK_SET);
-		lseek(fin2.fd, f_off, SEEK_SET);
-
-		if (f_off >= next_hole) {
-			size_t in1_hole = 0, in2_hole = 0;
-
-			size_t new_off = find_next_data(&fin1, &in1_hole, f_off);
-			size_t new_off2 = find_next_data(&fin2, &in2_hole, f_off);
-						
-			if ((new_off == -1 || new_off2 == -1) && (new_off != -1 || new_off2 != -1)) {
-				// accounting,
-				if (settings.subset) {
-					if (new_off == -1) {
-						// there's data in 2 that isn't in 1.
-						subset2 = true;
-					}
-					else if (new_off2 == -1) {
-						subset1 = true;
-					}
-				}
-
-				int finfd;
-				size_t fin_off, fin_hole, finsize;
-				const uint8_t *finmap;
-
-				if (new_off == -1) {
-					// process the remainder of file2 and add its size into the processed size
-					// NOTE! We're only considering non-zero pages. Not individual bytes.
-					finfd = fin2.fd;
-					fin_off = new_off2;
-					finsize = fin2.size;
-					finmap = in2map;
-				}
-				else {
-					// new_off2 is -1
-					finfd = fin1.fd;
-					fin_off = new_off;
-					finsize = fin1.size;
-					finmap = in1map;
-				}
-
-				do {
-					lseek(finfd, fin_off, SEEK_SET);
-					fin_hole = lseek(finfd, fin_off, SEEK_HOLE);
-
-					if (fin_off - unmap_off > PAGE_SIZE)
-						mumap(in1map, in2map, fin_off, &unmap_off);
-
-					madvise((void *)finmap + fin_off, fin_hole - fin_off, MADV_WILLNEED);
-
-					size_t zerooffcmp = fin_off;
-					// Data is page-aligned, check the pages for null-pages.
-					while (fin_off + zerooffcmp < fin_hole) {
-						// Examine this block. Is it a zero-page? Then it *could* be a hole, but isn't.
-						// Don't count it as allocated.
-					   	if (memcmp(zero, finmap + fin_off + zerooffcmp, PAGE_SIZE) == 0)
-							finsize -= PAGE_SIZE;
-
-						zerooffcmp += PAGE_SIZE;
-					}
-
-					// next hole will be at eof, or earlier
-					finsize += fin_hole - fin_off;
-				} while ((fin_off = lseek(finfd, fin_hole, SEEK_DATA)) > fin_hole);
-
-				
-				// And we're done, because the rest of the file is the same - so we're done.
-				break;
-			}
-			else if (new_off == -1 && new_off2 == -1) {
-				// Empty to end-of-file.
-				break;
-			}
-
-			f_off = MIN(new_off, new_off2);
-
-			next_hole = MIN(in1_hole, in2_hole);
-
-			if (unlikely(next_hole == (size_t)(off_t)-1))
-				next_hole = max_size;
-		}
-
-		// unmap_off is always aligned, so I don't need to align this.
-		if (f_off - unmap_off >= PAGE_SIZE) {
-			// I check this every 1MB -- or after every hole
-			mumap(in1map, in2map, f_off, &unmap_off);
+	const size_t total = MAX(fin[0].size, fin[1].size);
+	size_t lo = 0, hi = total;
+	if (shard.ranged && !shard_range(&shard, total, PAGE_SIZE, &lo, &hi))
+		goto out;
+	shard_rec_t rec = shard_new(SHARD_NULLDIFF, lo, hi, total, fin[0].size, fin[1].size);
+	if (show_greatest)
+		rec.flags |= SH_GREATEST;
+	if (dedupe.on && (fin[0].qcow != nullptr || fin[1].qcow != nullptr)) {
+		fprintf(stderr, "Error: --dedupe shares blocks of files, not of qcow2 images' disks.\n");
+		goto out;
+	}
+	dedupe.same = (extmap_t){ .size = MIN(fin[0].size, fin[1].size) };
+
+	// The delta starts out all hole, as long as the longer input. It mustn't be one of them.
+	if (delta.path != nullptr) {
+		struct stat ds, s[2];
+		delta.fd = open(delta.path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+		if (delta.fd == -1 || fstat(delta.fd, &ds) == -1 || fstat(fin[0].fd, &s[0]) == -1 || fstat(fin[1].fd, &s[1]) == -1) {
+			fprintf(stderr, "Unable to open %s", delta.path);
+			perror(", ");
+			goto out;
 		}
-
-		// madv_off is the end of the _SEQUENTIAL range. update it every 1MB.
-		if (f_off - madv_off > (1 << 20)) {
-			madv_off = f_off & PAGE_SIZE_bits_not;
-			const int madv_len = MIN(2 << 20, next_hole - madv_off);
-
-			// These were "willneed", now they're "sequential"
-			madvise((void *)in1map + madv_off, madv_len, MADV_SEQUENTIAL);
-			madvise((void *)in2map + madv_off, madv_len, MADV_SEQUENTIAL);
-
-			if (max_size > (2 << 20)) {
-				const int madv_len = MIN(2 << 20, next_hole - (madv_off + (2 << 20)));
-				madvise((void *)in1map + madv_off + (2 << 20), madv_len, MADV_WILLNEED);
-				madvise((void *)in2map + madv_off + (2 << 20), madv_len, MADV_WILLNEED);
+		for (int i = 0; i < 2; i++) {
+			if (ds.st_dev == s[i].st_dev && ds.st_ino == s[i].st_ino) {
+				fprintf(stderr, "Error: --delta %s is %s.\n", delta.path, path[i]);
+				goto out;
 			}
 		}
+		delta.buf = malloc(PAGE_SIZE);
+		if (delta.buf == nullptr || ftruncate(delta.fd, 0) != 0 || ftruncate(delta.fd, total) != 0) {
+			fprintf(stderr, "Error: Unable to set up the delta in %s", delta.path);
+			perror(", ");
+			ret = -4;
+			goto out;
+		}
+	}
 
-
-		// compare 1MB at a time, and then loop for madvise.
-		// Take the aligned 1MB block, add 1MB to that, and min of that and next_hole.
-		int compsize = MIN(MIN(max_size, 1 << 20), next_hole - f_off);
-		//int compsize = MIN((f_off & ~((size_t)(1 << 20) - 1)) + (1 << 20), next_hole) - f_off;
-		int compblock = MIN(PAGE_SIZE, compsize);
-		while (compsize > 0) {
-			bool is_ok = false;
-		   	if (memcmp(in1map + f_off, in2map + f_off, compblock) == 0) {
-				// Both null.
-				is_ok = true;
-			}
-			else if (memcmp(in1map + f_off, zero, compblock) == 0) {
-				if (settings.show_greatest)
-					procsz2 += compblock;
-				if (subset2)
-					subset2 = false;
-				is_ok = true;
-			}
-			else if (memcmp(in2map + f_off, zero, compblock) == 0) {
-				if (settings.show_greatest)
-					procsz1 += compblock;
-				if (subset1)
-					subset1 = false;
-				is_ok = true;
-			}
-			if (!is_ok) {
-				// The blocks mismatch and neither is null. Stop the loop!
-				break;
+	// Sharing no data decides the whole comparison, without reading any; a delta still wants
+	// in2's.
+	if (shard.ranged || both.n > 0 || delta.fd != -1) {
+		const uint8_t *map[2] = { };
+		for (int i = 0; i < 2; i++) {
+			map[i] = fin_mmap(&fin[i]);
+			if (map[i] == MAP_FAILED) {
+				fprintf(stderr, "Error: unable to mmap %s, ", path[i]);
+				perror("");
+				if (i == 1)
+					munmap((void *)map[0], fin[0].size);
+				ret = -4;
+				goto out;
 			}
-
-			f_off += compblock;
-			compsize -= compblock;
-
-			if (unlikely(compsize < compblock))
-				compblock = compsize;
+			madvise((void *)map[i], fin[i].size, MADV_DONTDUMP);
 		}
 
-		if (f_off - unmap_off >= PAGE_SIZE) {
-			// I check this every 1MB -- or after every hole
-			mumap(in1map, in2map, f_off, &unmap_off);
+		size_t hit = -1;
+		if (opts.sample > 0) {
+			hit = sample_scan(fin, map, &both, opts.sample, PAGE_SIZE);
+			if (hit != (size_t)-1 && opts.lowest)
+				fprintf(stderr, "Files mismatch (sampled at byte %zu); looking for the first one.\n", hit);
 		}
+		if (hit != (size_t)-1 && !opts.lowest)
+			shard_first(&rec, hit);
+		else
+			range_compare(fin, map, ext, &both, lo, hi, &rec);
 
-		if (likely(compsize == 0))
-			continue;
-		// Else, check parts of the block.
-
-		// The first step is to take half the buffer, as the whole block didn't check out.
-		int maxcomp = MIN(PAGE_SIZE, next_hole - f_off);
-		int blocksize = MIN(PAGE_SIZE, next_hole - f_off);
-		int checked = 0;
-		while (checked < maxcomp) {
-			// This reduces the size until the mismatch is found. Then it stops.
-			blocksize >>= 1;
-
-			if (blocksize == 0) {
-				//fprintf(stderr, "Breaking because 0 blocksize.\n");
-				break;
-			}
-
-			// As long as we have buffer for it, use the larger comparison functions.
-			// blocksize > inleft1 - checked, inleft2 - checked..
-			if (blocksize + checked > maxcomp) {
-				// Not enough data; shrink the block size..
-				// Notice: this may shrink the block size < 16. This is permissible in the
-				// end-of-file case; it'll go down to the small-comparison.
-				//fprintf(stderr, "Breaking because blocksize too big.\n");
-				continue;
-			}
-
-			const size_t blockoff = f_off + checked;
-			if (blocksize >= 16) {
-				if (memcmp(in1map + blockoff, in2map + blockoff, blocksize) == 0) {
-					checked += blocksize;
-					//fwrite(in1buf + checked, blocksize, 1, stdout);
-					goto recalc_blocksize;
-				}
-				if (memcmp(in1map + blockoff, zero, blocksize) == 0) {
-					checked += blocksize;
-					if (settings.show_greatest)
-						procsz2 += blocksize;	// Block2 is not null.
-					if (subset2)
-						subset2 = false;
-					//fwrite(in2buf + checked, bufavail, 1, stdout);
-					goto recalc_blocksize;
-				}
-				if (memcmp(in2map + blockoff, zero, blocksize) == 0) {
-					checked += blocksize;
-					if (settings.show_greatest)
-						procsz1 += blocksize;	// Block 1 is not null.
-					if (subset1)
-						subset1 = false;
-					//fwrite(in1buf + checked, bufavail, 1, stdout);
-					goto recalc_blocksize;
-				}
-
-				// We didn't goto, ...
-				// File mismatch detected in this block. Shrink block size and try again.
-				//fprintf(stderr, "sizing down blocksize for mismatch block.\n");
-				continue;
-			}
-
-			// really small size. Just do it byte-for-byte.
-
-			//fprintf(stderr, "curblock: %i; Checking small at index %i; block size: %i\n", curblock, checked, blocksize);
-			const uint8_t *const in1buf = in1map + blockoff;
-			const uint8_t *const in2buf = in2map + blockoff;
-			for (int i = 0; i < blocksize; i++) {
-				if (in1buf[i] == in2buf[i]) {
-					// procsz1 += 1; procsz2 += 1;
-					//fwrite(in1buf + checked + i, 1, 1, stdout);
-					continue;
-				}
-				else if (in1buf[i] == 0) {
-					//fwrite(in2buf + checked + i, 1, 1, stdout);
-					if (settings.show_greatest)
-						procsz2 += 1;
-					if (subset2)
-						subset2 = false;
-					continue;
-				}
-				else if (0 == in2buf[i]) {
-					//fwrite(in1buf + checked + i, 1, 1, stdout);
-					if (settings.show_greatest)
-						procsz1 += 1;
-					if (subset1)
-						subset1 = false;
-					continue;
-				}
-
-				// We have a file mis-match. This isn't permissible.
-				fprintf(stderr, "Files mismatch\n");
-				fprintf(stderr, "Files mismatch (at byte %li)\n", blockoff + i);
-
-				munmap((void *)in1map + unmap_off, fin1.size - unmap_off);
-				munmap((void *)in2map + unmap_off, fin2.size - unmap_off);
-				fclose(fin1.f_in);
-				fclose(fin2.f_in);
-
-				free((void *)zero);
-
-				return -1;
-			}
-			checked += blocksize;
-			//fprintf(stderr, "done: Checking small at index %i; block size: %i\n", curblock, checked, blocksize);
-
-recalc_blocksize:
-			if (checked == PAGE_SIZE) {
-				// done.
-				//fprintf(stderr, "Checked == BUF_SIZE\n");
-				continue;
-			}
-
-			while ( blocksize <= maxcomp - checked && blocksize <= PAGE_SIZE) {
-				// We just completed a full block. Bump the blocksize back up.
-				// This lets us check the second half of this failed block.
-				blocksize <<= 1;
-			}
-			//fprintf(stderr, "Set blocksize to %i\n", blocksize);
-		} // While we haven't checked whole files..
-
-		f_off += checked;
-
-		// Now that we've left the comparison loop, either one file is done or both blocks match.
-	} // while there is a not-eof file
-	  
-	// TODO: I've checked up to the _shared_ max size. Now I need to handle any additional, if I'm looking for
-	// "greatest data size" between the files.
-	if (settings.show_greatest) {
-		if (fin1.size > max_size) {
-			size_t f_off = max_size;
-			do {
-				f_off = lseek(fin1.fd, f_off, SEEK_DATA);
-				if (f_off == -1)
-					break;
-				next_hole = lseek(fin1.fd, f_off, SEEK_HOLE);
-				while (f_off < next_hole) {
-					size_t computed;
-					const int blocksz = MIN(PAGE_SIZE, next_hole - f_off);
-					compnull(blocksz, in1map + f_off, &computed, false);
-					procsz1 += computed;
-					f_off += blocksz;
-				}
-			} while (f_off < fin1.size);
-		}
-		// No else - it's possible that we stopped before end-of-file on both of them, because one had
-		// a hole at the end.
-		if (fin2.size > max_size) {
-			size_t f_off = max_size;
-			do {
-				f_off = lseek(fin2.fd, f_off, SEEK_DATA);
-				if (f_off == -1)
-					break;
-				next_hole = lseek(fin2.fd, f_off, SEEK_HOLE);
-				while (f_off < next_hole) {
-					size_t computed;
-					const int blocksz = MIN(PAGE_SIZE, next_hole - f_off);
-					compnull(blocksz, in2map + f_off, &computed, false);
-					procsz1 += computed;
-					f_off += blocksz;
-				}
-			} while (f_off < fin2.size);
-		}
+		munmap((void *)map[0], fin[0].size);
+		munmap((void *)map[1], fin[1].size);
 	}
 
-	// TODO: Insert file-length check.
-
-	printf("Files are the same, possibly excluding null bytes.\n");
-
-	unsigned char retcode = 0;
-	if (settings.show_greatest) {
-		if (procsz1 > procsz2) {
-			printf("File 1 has more data that file 2.\n");
-			retcode |= RET_GREATEST_1;
+	if (delta.fd != -1) {
+		if ((rec.flags & SH_FIRST) || delta.failed) {
+			unlink(delta.path);
+			fprintf(stderr, "Removed %s: %s.\n", delta.path, delta.failed ? "it couldn't be written" : "the files conflict");
+		}
+		else if (fsync(delta.fd) != 0) {
+			fprintf(stderr, "Error: Unable to write the delta to %s", delta.path);
+			perror(", ");
+			delta.failed = true;
 		}
-		else if (procsz2 > procsz1) {
-			printf("File 2 has more data that file 1.\n");
-			retcode |= RET_GREATEST_2;
+		else {
+			fprintf(stderr, "%s adds %zu bytes to %s, in %zu bytes of %s.\n", path2, delta.added, path1, delta.written, delta.path);
 		}
 	}
-	if (subset1)
-		retcode |= RET_SUBSET_1;
-	if (subset2)
-		retcode |= RET_SUBSET_2;
-
-	free((void *)zero);
-
-	if (fin1.size - unmap_off > 0)
-		munmap((void *)in1map + unmap_off, fin1.size - unmap_off);
-	if (fin2.size - unmap_off > 0)
-		munmap((void *)in2map + unmap_off, fin2.size - unmap_off);
 
-	fclose(fin1.f_in);
-	fclose(fin2.f_in);
-
-	return retcode;
-
-err:
-	if (zero != nullptr)
-		free((void *)zero);
-
-	if (in1map != nullptr && fin1.size - unmap_off > 0)
-		munmap((void *)in1map + unmap_off, fin1.size - unmap_off);
-	if (in2map != nullptr && fin2.size - unmap_off > 0)
-		munmap((void *)in2map + unmap_off, fin2.size - unmap_off);
-	fclose(fin1.f_in);
-	fclose(fin2.f_in);
+	if (dedupe.on && !(rec.flags & SH_FIRST)) {
+		if (dedupe.failed)
+			fprintf(stderr, "Unable to allocate the dedupe list; nothing was deduped.\n");
+		else
+			dedupe_submit(fin, path);
+	}
 
-	return 1;
+	if (shard.out == nullptr)
+		ret = shard_report_diff(&rec);
+	else
+		ret = shard_write(shard.out, &rec, nullptr, nullptr) ? 0 : -4;
+	if (delta.failed)
+		ret = -4;
+
+out:
+	if (delta.fd != -1)
+		close(delta.fd);
+	free(delta.buf);
+	extmap_free(&dedupe.same);
+	extmap_free(&ext[0]);
+	extmap_free(&ext[1]);
+	extmap_free(&both);
+	fclose(in1);
+	fclose(in2);
+	return ret;
 }
@@ -0,0 +1,140 @@
+// for fallocate
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <sys/param.h>
+
+#include "shard.h"
+
+typedef struct {
+		shard_rec_t rec;
+		shard_exts_t ext;
+		char *name;	// The input's name, if the shard recorded it.
+	} part_t;
+
+static int part_cmp(const void *const a, const void *const b) {
+	const part_t *const pa = a, *const pb = b;
+	return pa->rec.offset < pb->rec.offset ? -1 : pa->rec.offset > pb->rec.offset;
+}
+
+static bool punch(const int fd, const uint64_t from, const uint64_t to) {
+	if (to <= from)
+		return true;
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) == 0;
+}
+
+// The sharded nullcombine output: set its length, and punch out everything no shard wrote, in
+// case the file held something before.
+static bool finish_output(const char *const path, const part_t parts[const static 1], const size_t n, const uint64_t total) {
+	const int fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "Error opening %s", path);
+		perror(", ");
+		return false;
+	}
+
+	bool ok = ftruncate(fd, total) == 0;
+	uint64_t done = 0;
+	for (size_t p = 0; ok && p < n; p++) {
+		for (size_t i = 0; ok && i < parts[p].ext.n; i++) {
+			const shard_ext_t *const e = &parts[p].ext.ext[i];
+			ok = punch(fd, done, e->off);
+			done = e->off + e->len;
+		}
+	}
+	if (ok)
+		ok = punch(fd, done, total);
+	if (!ok)
+		perror("Error: finishing the output");
+	close(fd);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+
+	// Puts the partial results of --shard runs together into the answer an unsharded run gives,
+	// with the same messages and return code. The shards must cover the whole range, once.
+	//
+	// nullmerge [-o output] shard...
+	// -o output: for nullcombine shards, the file they wrote into. Its length is set, and the
+	// 	stretches no shard wrote are punched out.
+	const char *out_path = nullptr;
+	int fidx = 1;
+	if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+		out_path = argv[2];
+		fidx = 3;
+	}
+	if (fidx >= argc) {
+		fprintf(stderr, "Error: You must specify the partial results to merge.\n");
+		return 1;
+	}
+
+	const size_t n = argc - fidx;
+	part_t *const parts = calloc(n, sizeof(*parts));
+	if (parts == nullptr) {
+		fprintf(stderr, "Unable to allocate memory for %zu partial results.\n", n);
+		return 1;
+	}
+	for (size_t p = 0; p < n; p++) {
+		if (!shard_read(argv[fidx + p], &parts[p].rec, &parts[p].ext, &parts[p].name))
+			return 1;
+	}
+	qsort(parts, n, sizeof(*parts), part_cmp);
+
+	shard_rec_t all = parts[0].rec;
+	if (all.offset != 0) {
+		fprintf(stderr, "Error: no partial result covers [0, %lu).\n", (unsigned long)all.offset);
+		return 1;
+	}
+	for (size_t p = 1; p < n; p++) {
+		if (!shard_fold(&all, &parts[p].rec))
+			return 1;
+	}
+	if (all.length != all.total) {
+		fprintf(stderr, "Error: no partial result covers [%lu, %lu).\n", (unsigned long)all.length, (unsigned long)all.total);
+		return 1;
+	}
+
+	int ret = 0;
+	switch (all.tool) {
+		case SHARD_NULLDIFF:
+			ret = shard_report_diff(&all);
+			break;
+		case SHARD_NULLCOMBINE:
+			if (all.flags & SH_FIRST) {
+				fprintf(stderr, "Error: Files mismatch\n");
+				fprintf(stderr, "Error: Files mismatch (at byte %lu)\n", (unsigned long)all.first);
+				ret = 1;
+			}
+			else if (out_path != nullptr && !finish_output(out_path, parts, n, all.total)) {
+				ret = 1;
+			}
+			break;
+		case SHARD_HASNULL:
+			ret = (all.flags & SH_FIRST) ? 1 : 0;
+			if (ret == 1)
+				shard_report_null(parts[0].name != nullptr ? parts[0].name : "", all.flags & SH_SHOW_NULL, all.flags & SH_SHOW_FILE);
+			break;
+		case SHARD_HASHOLE:
+			ret = (all.flags & SH_FIRST) ? 1 : 0;
+			break;
+		default:
+			fprintf(stderr, "Error: unknown partial result type %u.\n", all.tool);
+			ret = 1;
+			break;
+	}
+
+	for (size_t p = 0; p < n; p++) {
+		free(parts[p].ext.ext);
+		free(parts[p].name);
+	}
+	free(parts);
+	return ret;
+}
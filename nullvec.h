@@ -0,0 +1,145 @@
+#ifndef __NULLVEC_H_
+
+#define __NULLVEC_H_
+
+// Vectorized null checks, shared by the tools.
+// Written with GCC vector extensions, so -march=native picks the widest unit the machine has.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "likely.h"
+
+#define NULLVEC_SIZE	32
+
+typedef uint8_t nullvec_t __attribute__((vector_size(NULLVEC_SIZE)));
+
+static inline nullvec_t nullvec_load(const uint8_t *const p) {
+	nullvec_t v;
+	memcpy(&v, p, sizeof(v));	// Unaligned load.
+	return v;
+}
+
+static inline bool nullvec_any(const nullvec_t v) {
+	uint64_t w[NULLVEC_SIZE / 8];
+	memcpy(w, &v, sizeof(w));
+	uint64_t acc = 0;
+	for (unsigned i = 0; i < NULLVEC_SIZE / 8; i++)
+		acc |= w[i];
+	return acc != 0;
+}
+
+// True if all n bytes are zero.
+static inline bool nullvec_iszero(const uint8_t *const data, const size_t n) {
+	size_t off = 0;
+	// Four vectors at a time, so the OR chain doesn't serialize on one register.
+	for (; off + 4 * NULLVEC_SIZE <= n; off += 4 * NULLVEC_SIZE) {
+		const nullvec_t v = nullvec_load(data + off) | nullvec_load(data + off + NULLVEC_SIZE)
+				| nullvec_load(data + off + 2 * NULLVEC_SIZE) | nullvec_load(data + off + 3 * NULLVEC_SIZE);
+		if (nullvec_any(v))
+			return false;
+	}
+	for (; off + NULLVEC_SIZE <= n; off += NULLVEC_SIZE) {
+		if (nullvec_any(nullvec_load(data + off)))
+			return false;
+	}
+	for (; off < n; off++) {
+		if (data[off] != 0)
+			return false;
+	}
+	return true;
+}
+
+// True if the n bytes at a and b are the same. Made for matching a block against a pattern.
+static inline bool nullvec_equal(const uint8_t *const a, const uint8_t *const b, const size_t n) {
+	size_t off = 0;
+	for (; off + 4 * NULLVEC_SIZE <= n; off += 4 * NULLVEC_SIZE) {
+		const nullvec_t v = (nullvec_load(a + off) ^ nullvec_load(b + off))
+				| (nullvec_load(a + off + NULLVEC_SIZE) ^ nullvec_load(b + off + NULLVEC_SIZE))
+				| (nullvec_load(a + off + 2 * NULLVEC_SIZE) ^ nullvec_load(b + off + 2 * NULLVEC_SIZE))
+				| (nullvec_load(a + off + 3 * NULLVEC_SIZE) ^ nullvec_load(b + off + 3 * NULLVEC_SIZE));
+		if (nullvec_any(v))
+			return false;
+	}
+	for (; off + NULLVEC_SIZE <= n; off += NULLVEC_SIZE) {
+		if (nullvec_any(nullvec_load(a + off) ^ nullvec_load(b + off)))
+			return false;
+	}
+	for (; off < n; off++) {
+		if (a[off] != b[off])
+			return false;
+	}
+	return true;
+}
+
+// Number of non-zero bytes in data.
+static inline size_t nullvec_count_nonzero(const uint8_t *const data, const size_t n) {
+	size_t count = 0;
+	size_t off = 0;
+	while (off + NULLVEC_SIZE <= n) {
+		// Per-lane counters are bytes; fold them before they can wrap.
+		nullvec_t acc = { };
+		const size_t stop = off + MIN(n - off, 255 * NULLVEC_SIZE) / NULLVEC_SIZE * NULLVEC_SIZE;
+		for (; off < stop; off += NULLVEC_SIZE) {
+			const nullvec_t v = nullvec_load(data + off);
+			acc -= (nullvec_t)(v != 0);	// A true lane is -1.
+		}
+		for (unsigned i = 0; i < NULLVEC_SIZE; i++)
+			count += acc[i];
+	}
+	for (; off < n; off++)
+		count += data[off] != 0;
+	return count;
+}
+
+// Merge n bytes of a and b into out, in one pass: wherever one side is null, take the other.
+// Where both hold different non-null bytes, take a if prefer < 0 and b if prefer > 0; with no
+// preference, stop and return the offset of the first such byte, leaving out incomplete.
+// Returns n otherwise. out may be a or b.
+//
+// If nullmask isn't nullptr, it gets a bit for each NULLVEC_SIZE span of out that came out all
+// null (the last span may be short), for writing the output sparse.
+static inline size_t nullvec_merge(uint8_t *const out, const uint8_t *const a, const uint8_t *const b, const size_t n, const int prefer, uint64_t *const nullmask) {
+	if (nullmask != nullptr)
+		memset(nullmask, 0, (n / NULLVEC_SIZE + 64) / 64 * sizeof(*nullmask));
+
+	size_t off = 0;
+	for (; off + NULLVEC_SIZE <= n; off += NULLVEC_SIZE) {
+		const nullvec_t va = nullvec_load(a + off);
+		const nullvec_t vb = nullvec_load(b + off);
+		const nullvec_t za = (nullvec_t)(va == 0);
+		const nullvec_t zb = (nullvec_t)(vb == 0);
+
+		if (prefer == 0) {
+			const nullvec_t conflict = ~za & ~zb & (nullvec_t)(va != vb);
+			if (unlikely(nullvec_any(conflict))) {
+				for (unsigned i = 0; i < NULLVEC_SIZE; i++) {
+					if (conflict[i])
+						return off + i;
+				}
+			}
+		}
+
+		// The preferred side, filled in from the other where it's null.
+		const nullvec_t vo = prefer > 0 ? vb | (va & zb) : va | (vb & za);
+		memcpy(out + off, &vo, sizeof(vo));
+		if (nullmask != nullptr && !nullvec_any(vo))
+			nullmask[off / NULLVEC_SIZE / 64] |= 1ULL << (off / NULLVEC_SIZE % 64);
+	}
+
+	bool tail_null = true;
+	for (size_t i = off; i < n; i++) {
+		const uint8_t x = a[i], y = b[i];
+		if (x != y && x != 0 && y != 0 && prefer == 0)
+			return i;
+		out[i] = prefer > 0 ? (y != 0 ? y : x) : (x != 0 ? x : y);
+		tail_null &= out[i] == 0;
+	}
+	if (nullmask != nullptr && off < n && tail_null)
+		nullmask[off / NULLVEC_SIZE / 64] |= 1ULL << (off / NULLVEC_SIZE % 64);
+	return n;
+}
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __OPTS_H_
+
+#define __OPTS_H_
+
+// Long options that are taken out of argv before a tool's own parsing sees it, so that every tool
+// can share them (--offset, --fill, --max-bandwidth, ...) without knowing about them. Each is
+// given as --name value or --name=value, or is a flag; an optional value only comes as
+// --name=value. A "--" ends the options, and it and everything after it stay where they are.
+
+#include <stddef.h>
+#include <string.h>
+
+typedef enum {
+		OPT_FLAG,	// --name
+		OPT_VALUE,	// --name value, --name=value
+		OPT_OPTIONAL,	// --name, --name=value
+	} opt_arg_t;
+
+typedef struct {
+		const char *name;
+		opt_arg_t arg;
+	} opt_t;
+
+// Take the options in opts out of argv, calling take(ctx, which, value) for each one found:
+// which is its index in opts, and value nullptr if it has none. Stops at the first take() that
+// returns false, and returns false too.
+static inline bool opt_strip(int argc[const static 1], char **const argv, const size_t n, const opt_t opts[const static n], bool (*const take)(void *ctx, size_t which, const char *value), void *const ctx) {
+	int kept = 1;
+	for (int i = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--") == 0) {
+			while (i < *argc)
+				argv[kept++] = argv[i++];
+			break;
+		}
+
+		size_t which = n;
+		const char *value = nullptr;
+		for (size_t o = 0; o < n && which == n; o++) {
+			const size_t len = strlen(opts[o].name);
+			if (strncmp(argv[i], opts[o].name, len) != 0)
+				continue;
+			if (argv[i][len] == '=' && opts[o].arg != OPT_FLAG)
+				value = argv[i] + len + 1;
+			else if (argv[i][len] == '\0' && opts[o].arg == OPT_VALUE && i + 1 < *argc)
+				value = argv[++i];
+			else if (argv[i][len] != '\0' || opts[o].arg == OPT_VALUE)
+				continue;
+			which = o;
+		}
+		if (which == n)
+			argv[kept++] = argv[i];
+		else if (!take(ctx, which, value))
+			return false;
+	}
+	argv[kept] = nullptr;
+	*argc = kept;
+	return true;
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __PROBES_H_
+
+#define __PROBES_H_
+
+// USDT probes, for tracing a live run with bpftrace or perf without rebuilding it:
+//
+//	bpftrace -l 'usdt:./nulldiff:*'
+//	bpftrace -e 'usdt:./nulldiff:nulldiff:unmap { @ = sum(arg1); }' -p $PID
+//
+// probe(name, args...) takes up to three integer arguments. With <sys/sdt.h>, a probe is a nop in
+// the code and a note in the binary, so one nobody is attached to costs next to nothing. Without
+// it, probes compile away.
+
+#if __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define PROBE_ARITY(_0, _1, _2, _3, n, ...)	n
+#define PROBE_CAT(a, b)	a ## b
+#define PROBE_PICK(n)	PROBE_CAT(STAP_PROBE, n)
+#define probe(...)	PROBE_PICK(PROBE_ARITY(__VA_ARGS__, 3, 2, 1, ))(nulldiff, __VA_ARGS__)
+
+#else
+
+// Still "use" the arguments, so that values kept only for a probe don't warn.
+#define probe(name, ...)	((void)sizeof((unsigned long long[]){ 0 __VA_OPT__(, __VA_ARGS__) }))
+
+#endif
+
+#endif
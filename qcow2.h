@@ -0,0 +1,297 @@
+#ifndef __QCOW2_H_
+
+#define __QCOW2_H_
+
+// Read-only qcow2 input.
+//
+// The L1/L2 tables are read once into a sorted list of data runs. Unallocated clusters and
+// zero clusters are holes, exactly like SEEK_DATA/SEEK_HOLE holes in a raw image, and data
+// clusters are read straight from the image file. Compressed clusters, backing files,
+// encryption, external data files and extended L2 entries aren't supported; those images still
+// need `qemu-img convert`.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#define QCOW2_MAGIC	0x514649fbU	// "QFI\xfb"
+
+#define QCOW2_INCOMPAT_DIRTY	(1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT	(1ULL << 1)
+#define QCOW2_INCOMPAT_DATA_FILE	(1ULL << 2)
+#define QCOW2_INCOMPAT_COMPRESSION	(1ULL << 3)
+#define QCOW2_INCOMPAT_EXTL2	(1ULL << 4)
+
+#define QCOW2_OFLAG_COMPRESSED	(1ULL << 62)
+#define QCOW2_OFLAG_ZERO	(1ULL << 0)
+#define QCOW2_OFFSET_MASK	0x00fffffffffffe00ULL
+
+typedef struct {
+		uint64_t voff;	// Offset in the virtual disk.
+		uint64_t hoff;	// Offset in the image file.
+		uint64_t len;
+	} qcow2_ext_t;
+
+typedef struct {
+		int fd;
+		uint64_t size;	// Virtual disk size.
+		uint32_t cluster_bits;
+		qcow2_ext_t *ext;	// Data runs, sorted by voff, contiguous in both spaces.
+		size_t n;
+	} qcow2_t;
+
+// Is the file behind fd a qcow2 image?
+static inline bool qcow2_probe(const int fd) {
+	uint32_t magic;
+	return pread(fd, &magic, sizeof(magic), 0) == sizeof(magic) && be32toh(magic) == QCOW2_MAGIC;
+}
+
+static inline bool qcow2_pread_all(const int fd, void *const buf, const size_t n, const off_t off) {
+	size_t got = 0;
+	while (got < n) {
+		const ssize_t r = pread(fd, (uint8_t *)buf + got, n - got, off + got);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return false;
+		}
+		got += r;
+	}
+	return true;
+}
+
+static inline bool qcow2_add(qcow2_t q[const static 1], size_t cap[const static 1], const uint64_t voff, const uint64_t hoff, const uint64_t len) {
+	if (q->n > 0) {
+		qcow2_ext_t *const last = &q->ext[q->n - 1];
+		if (last->voff + last->len == voff && last->hoff + last->len == hoff) {
+			last->len += len;
+			return true;
+		}
+	}
+	if (q->n == *cap) {
+		*cap = *cap ? *cap * 2 : 1024;
+		qcow2_ext_t *const ext = realloc(q->ext, *cap * sizeof(*ext));
+		if (ext == nullptr)
+			return false;
+		q->ext = ext;
+	}
+	q->ext[q->n++] = (qcow2_ext_t){ .voff = voff, .hoff = hoff, .len = len };
+	return true;
+}
+
+// Parse the image on fd. Returns false, with a message on stderr, if it can't be used.
+static inline bool qcow2_open(qcow2_t q[const static 1], const int fd, const char *const path) {
+	*q = (qcow2_t){ .fd = fd };
+
+	uint8_t hdr[104] = { };
+	if (!qcow2_pread_all(fd, hdr, 72, 0)) {
+		fprintf(stderr, "Error: %s: short qcow2 header.\n", path);
+		return false;
+	}
+	#define QH32(o)	({ uint32_t v_; memcpy(&v_, hdr + (o), 4); be32toh(v_); })
+	#define QH64(o)	({ uint64_t v_; memcpy(&v_, hdr + (o), 8); be64toh(v_); })
+
+	const uint32_t version = QH32(4);
+	if (version != 2 && version != 3) {
+		fprintf(stderr, "Error: %s: qcow2 version %u isn't supported.\n", path, version);
+		return false;
+	}
+	if (version == 3 && !qcow2_pread_all(fd, hdr + 72, 32, 72)) {
+		fprintf(stderr, "Error: %s: short qcow2 header.\n", path);
+		return false;
+	}
+
+	const uint64_t backing = QH64(8);
+	q->cluster_bits = QH32(20);
+	q->size = QH64(24);
+	const uint32_t crypt = QH32(32);
+	const uint32_t l1_size = QH32(36);
+	const uint64_t l1_off = QH64(40);
+	const uint64_t incompat = version == 3 ? QH64(72) : 0;
+	#undef QH32
+	#undef QH64
+
+	if (backing != 0) {
+		fprintf(stderr, "Error: %s: qcow2 images with a backing file aren't supported.\n", path);
+		return false;
+	}
+	if (crypt != 0) {
+		fprintf(stderr, "Error: %s: encrypted qcow2 images aren't supported.\n", path);
+		return false;
+	}
+	if (incompat & (QCOW2_INCOMPAT_CORRUPT | QCOW2_INCOMPAT_DATA_FILE | QCOW2_INCOMPAT_EXTL2 | ~(uint64_t)0x1f)) {
+		fprintf(stderr, "Error: %s: qcow2 features 0x%lx aren't supported.\n", path, (unsigned long)incompat);
+		return false;
+	}
+	if (q->cluster_bits < 9 || q->cluster_bits > 21) {
+		fprintf(stderr, "Error: %s: bad qcow2 cluster size.\n", path);
+		return false;
+	}
+
+	const uint64_t cluster = 1ULL << q->cluster_bits;
+	const uint64_t l2_entries = cluster / sizeof(uint64_t);
+	const uint64_t l1_needed = (q->size + cluster * l2_entries - 1) / (cluster * l2_entries);
+	if (l1_size < l1_needed) {
+		fprintf(stderr, "Error: %s: qcow2 L1 table is too small for the disk.\n", path);
+		return false;
+	}
+
+	uint64_t *const l1 = malloc(MAX(l1_needed, 1) * sizeof(*l1));
+	uint64_t *const l2 = malloc(cluster);
+	size_t cap = 0;
+	bool ok = l1 != nullptr && l2 != nullptr;
+	if (!ok)
+		fprintf(stderr, "Unable to allocate qcow2 tables for %s.\n", path);
+	if (ok && !qcow2_pread_all(fd, l1, l1_needed * sizeof(*l1), l1_off)) {
+		fprintf(stderr, "Error: %s: unable to read the qcow2 L1 table.\n", path);
+		ok = false;
+	}
+
+	for (uint64_t i = 0; ok && i < l1_needed; i++) {
+		const uint64_t l2_off = be64toh(l1[i]) & QCOW2_OFFSET_MASK;
+		if (l2_off == 0)
+			continue;	// Nothing allocated under this entry.
+		if (!qcow2_pread_all(fd, l2, cluster, l2_off)) {
+			fprintf(stderr, "Error: %s: unable to read a qcow2 L2 table.\n", path);
+			ok = false;
+			break;
+		}
+
+		for (uint64_t j = 0; j < l2_entries; j++) {
+			const uint64_t voff = (i * l2_entries + j) * cluster;
+			if (voff >= q->size)
+				break;
+			const uint64_t entry = be64toh(l2[j]);
+			if (entry & QCOW2_OFLAG_COMPRESSED) {
+				fprintf(stderr, "Error: %s: compressed qcow2 clusters aren't supported.\n", path);
+				ok = false;
+				break;
+			}
+			const uint64_t hoff = entry & QCOW2_OFFSET_MASK;
+			if (hoff == 0 || (entry & QCOW2_OFLAG_ZERO))
+				continue;	// Unallocated, or reads as zeros: a hole.
+
+			if (!qcow2_add(q, &cap, voff, hoff, MIN(cluster, q->size - voff))) {
+				fprintf(stderr, "Unable to allocate qcow2 extents for %s.\n", path);
+				ok = false;
+				break;
+			}
+		}
+	}
+
+	free(l1);
+	free(l2);
+	if (!ok) {
+		free(q->ext);
+		q->ext = nullptr;
+	}
+	return ok;
+}
+
+static inline void qcow2_close(qcow2_t q[const static 1]) {
+	free(q->ext);
+	q->ext = nullptr;
+	q->n = 0;
+}
+
+// Index of the first run that ends after off.
+static inline size_t qcow2_find(const qcow2_t q[const static 1], const uint64_t off) {
+	size_t lo = 0, hi = q->n;
+	while (lo < hi) {
+		const size_t mid = (lo + hi) / 2;
+		if (q->ext[mid].voff + q->ext[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// lseek() for SEEK_DATA and SEEK_HOLE, in virtual disk offsets. -1 with ENXIO past the data, or
+// past the end.
+static inline off_t qcow2_seek(const qcow2_t q[const static 1], const off_t off, const int whence) {
+	if (off < 0 || (uint64_t)off >= q->size) {
+		errno = ENXIO;
+		return -1;
+	}
+
+	size_t i = qcow2_find(q, off);
+	if (whence == SEEK_DATA) {
+		if (i == q->n) {
+			errno = ENXIO;
+			return -1;
+		}
+		return MAX((uint64_t)off, q->ext[i].voff);
+	}
+
+	// SEEK_HOLE: runs that touch in the virtual disk are one stretch of data.
+	if (i == q->n || q->ext[i].voff > (uint64_t)off)
+		return off;
+	uint64_t end = q->ext[i].voff + q->ext[i].len;
+	while (++i < q->n && q->ext[i].voff == end)
+		end += q->ext[i].len;
+	return MIN(end, q->size);
+}
+
+// pread() from the virtual disk. Holes read as zeros.
+static inline ssize_t qcow2_pread(const qcow2_t q[const static 1], void *const buf, size_t n, const off_t off) {
+	if ((uint64_t)off >= q->size)
+		return 0;
+	n = MIN(n, q->size - off);
+
+	uint8_t *const out = buf;
+	size_t done = 0;
+	size_t i = qcow2_find(q, off);
+	while (done < n) {
+		const uint64_t pos = off + done;
+		if (i == q->n || q->ext[i].voff > pos) {
+			// Hole up to the next run.
+			const uint64_t end = i == q->n ? off + n : MIN(off + n, q->ext[i].voff);
+			memset(out + done, 0, end - pos);
+			done = end - off;
+			continue;
+		}
+		const uint64_t in_run = pos - q->ext[i].voff;
+		const size_t len = MIN(n - done, q->ext[i].len - in_run);
+		if (!qcow2_pread_all(q->fd, out + done, len, q->ext[i].hoff + in_run))
+			return done > 0 ? (ssize_t)done : -1;
+		done += len;
+		i++;
+	}
+	return done;
+}
+
+// Map the whole virtual disk read-only. Holes are anonymous zero pages; each data run is mapped
+// from the image file at its virtual offset. Returns MAP_FAILED on error.
+static inline const uint8_t *qcow2_mmap(const qcow2_t q[const static 1]) {
+	const size_t pagesize = sysconf(_SC_PAGESIZE);
+	if ((1ULL << q->cluster_bits) < pagesize) {
+		errno = EINVAL;
+		return MAP_FAILED;
+	}
+
+	uint8_t *const base = mmap(NULL, q->size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED)
+		return MAP_FAILED;
+
+	for (size_t i = 0; i < q->n; i++) {
+		const qcow2_ext_t *const e = &q->ext[i];
+		if (mmap(base + e->voff, e->len, PROT_READ, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, q->fd, e->hoff) == MAP_FAILED) {
+			// Usually vm.max_map_count, on a badly fragmented image.
+			const int err = errno;
+			munmap(base, q->size);
+			errno = err;
+			return MAP_FAILED;
+		}
+	}
+	return base;
+}
+
+#endif
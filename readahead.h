@@ -0,0 +1,343 @@
+#ifndef __READAHEAD_H_
+
+#define __READAHEAD_H_
+
+// Adaptive readahead for the mmap scans.
+//
+// A helper thread keeps a window of data prefetched ahead of the scan cursor, for one or two
+// mapped files at once. It only touches data extents, so holes don't use up the window. The
+// window grows when the scan catches up with the prefetched data (the scan is waiting on the
+// disk), and shrinks back when it's more than RA_LEAD_MS of scanning ahead (the disk is waiting
+// on the scan).
+//
+// Pages are brought in with MADV_POPULATE_READ, which also lets the helper time the reads. On
+// kernels without it, or if the thread can't start, it falls back to MADV_WILLNEED hints from
+// the scanning thread itself.
+//
+// The scan reports its position with ra_advance(), which is cheap enough to call per block.
+// With a throttle (ra_set_throttle), the scan pays for the data it has passed every time it
+// reaches the next window boundary, and waits there if it's over.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+
+#include "likely.h"
+#include "probes.h"
+#include "throttle.h"
+
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ	22
+#endif
+
+#define RA_MAX_FILES	2
+#define RA_WIN_MIN	(1 << 20)
+#define RA_WIN_START	(4 << 20)
+#define RA_WIN_MAX	(256 << 20)
+#define RA_CHUNK	(1 << 20)	// Populate granularity; the helper rechecks the cursor this often.
+#define RA_LEAD_MS	250	// Scan time the window should cover.
+#define RA_UNMAP_STEP	(16 << 20)	// Callers unmap behind the cursor in steps this big.
+
+typedef struct {
+		const uint8_t *base;	// Mapping of the whole file.
+		size_t size;
+		int fd;	// Own file description, so extent lookups don't move the caller's offset.
+		// Extent lookups for inputs that aren't plain files (see ra_set_seek); else lseek(fd).
+		off_t (*seek)(const void *ctx, off_t off, int whence);
+		const void *seek_ctx;
+	} ra_file_t;
+
+typedef struct {
+		ra_file_t file[RA_MAX_FILES];
+		int nfiles;
+
+		atomic_size_t window;	// Bytes to keep prefetched ahead of the cursor, holes excepted.
+		atomic_size_t cursor;	// Where the scan is.
+		atomic_size_t ahead;	// Everything below this has been prefetched.
+		size_t next_kick;	// Cursor position at which to wake the helper (or hint again).
+		throttle_t *throttle;	// Or nullptr.
+		size_t charged;	// The data below this is paid for.
+
+		bool threaded;
+		atomic_bool stop;
+		atomic_bool waiting;	// The helper is asleep on cond.
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+
+		// Helper-side measurements.
+		struct timespec t_last;
+		size_t cursor_last;
+		double scan_rate;	// Bytes per second the scan consumes.
+		double io_rate;	// Bytes per second populate achieves.
+	} ra_ctl_t;
+
+static inline double ra_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Next data at or after off in file f, and where that data ends. Returns false past the last data.
+static inline bool ra_next_data(const ra_file_t f[const static 1], const size_t off, size_t data[const static 1], size_t hole[const static 1]) {
+	if (off >= f->size)
+		return false;
+	if (f->seek != nullptr) {
+		const off_t d = f->seek(f->seek_ctx, off, SEEK_DATA);
+		if (d == -1)
+			return false;
+		const off_t h = f->seek(f->seek_ctx, d, SEEK_HOLE);
+		*data = d;
+		*hole = h == -1 ? f->size : MIN((size_t)h, f->size);
+		return true;
+	}
+	if (f->fd == -1) {
+		*data = off;
+		*hole = f->size;
+		return true;
+	}
+	const off_t d = lseek(f->fd, off, SEEK_DATA);
+	if (d == -1)
+		return false;
+	const off_t h = lseek(f->fd, d, SEEK_HOLE);
+	*data = d;
+	*hole = h == -1 ? f->size : MIN((size_t)h, f->size);
+	return true;
+}
+
+// Prefetch the data in [from, to) of every file. Returns the data bytes covered.
+static inline size_t ra_fetch(ra_ctl_t ra[const static 1], const size_t from, const size_t to, const int advice) {
+	size_t bytes = 0;
+	for (int i = 0; i < ra->nfiles; i++) {
+		const ra_file_t *const f = &ra->file[i];
+		size_t off = from;
+		size_t data, hole;
+		while (off < to && ra_next_data(f, off, &data, &hole) && data < to) {
+			const size_t end = MIN(hole, to);
+			// madvise wants a page-aligned start.
+			const size_t start = data & -(size_t)sysconf(_SC_PAGESIZE);
+			probe(ra_window, start, end, advice);
+			// ENOMEM: the scan already jumped past this and unmapped it. Nothing to do.
+			madvise((void *)(f->base + start), end - start, advice);
+			bytes += end - data;
+			off = end;
+		}
+	}
+	return bytes;
+}
+
+// Data bytes in [from, to) of every file.
+static inline size_t ra_data(const ra_ctl_t ra[const static 1], const size_t from, const size_t to) {
+	size_t bytes = 0;
+	for (int i = 0; i < ra->nfiles; i++) {
+		size_t off = from, data, hole;
+		while (off < to && ra_next_data(&ra->file[i], off, &data, &hole) && data < to) {
+			bytes += MIN(hole, to) - data;
+			off = hole;
+		}
+	}
+	return bytes;
+}
+
+static inline void ra_adapt(ra_ctl_t ra[const static 1], const bool stalled) {
+	const double now = ra_now();
+	const double dt = now - (ra->t_last.tv_sec + ra->t_last.tv_nsec / 1e9);
+	const size_t cursor = atomic_load_explicit(&ra->cursor, memory_order_relaxed);
+	if (dt > 0.01) {
+		const double rate = (cursor - ra->cursor_last) / dt;
+		ra->scan_rate = ra->scan_rate == 0 ? rate : (ra->scan_rate * 3 + rate) / 4;
+		ra->cursor_last = cursor;
+		clock_gettime(CLOCK_MONOTONIC, &ra->t_last);
+	}
+
+	if (stalled) {
+		// The scan ran into pages we hadn't brought in yet.
+		ra->window = MIN(ra->window * 2, RA_WIN_MAX);
+	}
+	else if (ra->scan_rate > 0) {
+		// Enough to cover the lead time at the current scan rate -- and at least one read's worth
+		// at the measured disk rate, so a slow disk always has something queued.
+		size_t want = ra->scan_rate * RA_LEAD_MS / 1000;
+		if (ra->io_rate > 0)
+			want = MAX(want, (size_t)(ra->io_rate * RA_LEAD_MS / 1000 / 4));
+		if (want < ra->window / 2)
+			ra->window = MAX(ra->window * 3 / 4, RA_WIN_MIN);
+	}
+}
+
+static void *ra_helper(void *arg) {
+	ra_ctl_t *const ra = arg;
+	bool primed = false;
+
+	while (!atomic_load(&ra->stop)) {
+		const size_t cursor = atomic_load_explicit(&ra->cursor, memory_order_relaxed);
+		size_t ahead = atomic_load_explicit(&ra->ahead, memory_order_relaxed);
+		ra_adapt(ra, primed && ahead <= cursor);
+		primed = true;
+
+		if (ahead < cursor)
+			ahead = cursor;
+		// Holes don't count against the window.
+		size_t skipped = 0;
+		while (ahead - cursor < ra->window + skipped && !atomic_load(&ra->stop)) {
+			// Hop over any stretch that's a hole in every file.
+			size_t next = SIZE_MAX, data, hole;
+			for (int i = 0; i < ra->nfiles; i++) {
+				if (ra_next_data(&ra->file[i], ahead, &data, &hole))
+					next = MIN(next, data);
+			}
+			if (next == SIZE_MAX)
+				break;	// No data left in any of them.
+			if (next > ahead) {
+				skipped += next - ahead;
+				ahead = next;
+			}
+
+			const size_t end = ahead + RA_CHUNK;
+			const double t0 = ra_now();
+			const size_t bytes = ra_fetch(ra, ahead, end, MADV_POPULATE_READ);
+			const double dt = ra_now() - t0;
+			if (bytes > 0 && dt > 0) {
+				const double rate = bytes / dt;
+				ra->io_rate = ra->io_rate == 0 ? rate : (ra->io_rate * 7 + rate) / 8;
+			}
+
+			ahead = end;
+			atomic_store_explicit(&ra->ahead, ahead, memory_order_relaxed);
+
+			// The scan jumped past us; start again from where it is.
+			if (atomic_load_explicit(&ra->cursor, memory_order_relaxed) > ahead)
+				break;
+		}
+
+		// Sleep until the scan has used up half the window.
+		pthread_mutex_lock(&ra->lock);
+		atomic_store(&ra->waiting, true);
+		if (!atomic_load(&ra->stop)) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += RA_LEAD_MS * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&ra->cond, &ra->lock, &ts);
+		}
+		atomic_store(&ra->waiting, false);
+		pthread_mutex_unlock(&ra->lock);
+	}
+	return nullptr;
+}
+
+// Set up readahead over nfiles mapped files, starting at offset start. Nothing is read until
+// ra_start().
+static inline void ra_init(ra_ctl_t ra[const static 1], const int nfiles, const uint8_t *const bases[const static nfiles], const size_t sizes[const static nfiles], const int fds[const static nfiles], const size_t start) {
+	*ra = (ra_ctl_t){ .nfiles = MIN(nfiles, RA_MAX_FILES), .window = RA_WIN_START };
+	atomic_init(&ra->cursor, start);
+	atomic_init(&ra->ahead, start);
+	ra->charged = start;
+	atomic_init(&ra->stop, false);
+	atomic_init(&ra->waiting, false);
+	ra->cursor_last = start;
+	clock_gettime(CLOCK_MONOTONIC, &ra->t_last);
+
+	for (int i = 0; i < ra->nfiles; i++) {
+		ra->file[i].base = bases[i];
+		ra->file[i].size = sizes[i];
+
+		char fdpath[sizeof("/proc/self/fd/") + 12];
+		sprintf(fdpath, "/proc/self/fd/%i", fds[i]);
+		ra->file[i].fd = open(fdpath, O_RDONLY | O_CLOEXEC);
+	}
+
+	pthread_mutex_init(&ra->lock, nullptr);
+	pthread_cond_init(&ra->cond, nullptr);
+}
+
+// Look up file i's extents with seek() rather than lseek() on its descriptor. seek() must be
+// callable from the helper thread. Call between ra_init() and ra_start().
+static inline void ra_set_seek(ra_ctl_t ra[const static 1], const int i, off_t (*seek)(const void *, off_t, int), const void *const ctx) {
+	ra->file[i].seek = seek;
+	ra->file[i].seek_ctx = ctx;
+}
+
+// Charge the data the scan reads to t. Call between ra_init() and ra_start().
+static inline void ra_set_throttle(ra_ctl_t ra[const static 1], throttle_t *const t) {
+	ra->throttle = t != nullptr && t->on ? t : nullptr;
+}
+
+// Start prefetching the first window.
+static inline void ra_start(ra_ctl_t ra[const static 1]) {
+	const size_t start = atomic_load(&ra->cursor);
+
+	// Does the kernel know MADV_POPULATE_READ? Try it on a page we'll want anyway.
+	bool populate = false;
+	for (int i = 0; i < ra->nfiles && !populate; i++) {
+		if (start < ra->file[i].size) {
+			const size_t pg = start & -(size_t)sysconf(_SC_PAGESIZE);
+			populate = madvise((void *)(ra->file[i].base + pg), 1, MADV_POPULATE_READ) == 0 || errno != EINVAL;
+		}
+	}
+
+	ra->threaded = populate && pthread_create(&ra->thread, nullptr, ra_helper, ra) == 0;
+	if (!ra->threaded) {
+		ra_fetch(ra, start, start + ra->window, MADV_WILLNEED);
+		atomic_store(&ra->ahead, start + ra->window);
+	}
+	ra->next_kick = start + ra->window / 2;
+}
+
+// The scan is at cursor.
+static inline void ra_advance(ra_ctl_t ra[const static 1], const size_t cursor) {
+	atomic_store_explicit(&ra->cursor, cursor, memory_order_relaxed);
+	if (likely(cursor < ra->next_kick))
+		return;
+
+	if (ra->throttle != nullptr && cursor > ra->charged) {
+		throttle_io(ra->throttle, ra_data(ra, ra->charged, cursor));
+		ra->charged = cursor;
+	}
+
+	const size_t ahead = atomic_load_explicit(&ra->ahead, memory_order_relaxed);
+	if (ra->threaded) {
+		if (atomic_load(&ra->waiting)) {
+			pthread_mutex_lock(&ra->lock);
+			pthread_cond_signal(&ra->cond);
+			pthread_mutex_unlock(&ra->lock);
+		}
+	}
+	else {
+		// No helper: hint the next window ourselves.
+		const size_t from = MAX(ahead, cursor);
+		ra_fetch(ra, from, cursor + ra->window, MADV_WILLNEED);
+		atomic_store_explicit(&ra->ahead, cursor + ra->window, memory_order_relaxed);
+	}
+	ra->next_kick = cursor + MAX(ra->window / 2, RA_CHUNK);
+}
+
+static inline void ra_destroy(ra_ctl_t ra[const static 1]) {
+	if (ra->threaded) {
+		pthread_mutex_lock(&ra->lock);
+		atomic_store(&ra->stop, true);
+		pthread_cond_signal(&ra->cond);
+		pthread_mutex_unlock(&ra->lock);
+		pthread_join(ra->thread, nullptr);
+	}
+	pthread_mutex_destroy(&ra->lock);
+	pthread_cond_destroy(&ra->cond);
+
+	for (int i = 0; i < ra->nfiles; i++) {
+		if (ra->file[i].fd != -1)
+			close(ra->file[i].fd);
+	}
+}
+
+#endif
@@ -0,0 +1,104 @@
+#ifndef __SHA1_H_
+
+#define __SHA1_H_
+
+// SHA-1 (FIPS 180-4), for checking pieces of v1 torrents. Portable rounds only: it's there to
+// recognize data, not to resist anyone, and the pieces are read off the disk far slower than
+// they hash.
+//
+// Little-endian hosts only, like the rest of the tools.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef struct {
+		uint32_t h[5];
+		uint64_t len;	// Bytes hashed.
+		uint8_t buf[64];	// Partial block; len % 64 bytes of it are used.
+	} sha1_t;
+
+static inline void sha1_init(sha1_t s[const static 1]) {
+	static const uint32_t iv[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	memcpy(s->h, iv, sizeof(iv));
+	s->len = 0;
+}
+
+static inline uint32_t sha1_rol(const uint32_t x, const int r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline void sha1_blocks(uint32_t h[const static 5], const uint8_t *p, size_t n) {
+	for (; n > 0; n--, p += 64) {
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++) {
+			uint32_t v;
+			memcpy(&v, p + 4 * i, 4);
+			w[i] = __builtin_bswap32(v);
+		}
+		for (int i = 16; i < 80; i++)
+			w[i] = sha1_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			}
+			else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			}
+			else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			}
+			else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			const uint32_t t = sha1_rol(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = sha1_rol(b, 30);
+			b = a;
+			a = t;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+}
+
+static inline void sha1_update(sha1_t s[const static 1], const void *const data, size_t n) {
+	const uint8_t *p = data;
+	const size_t used = s->len % 64;
+	s->len += n;
+	if (used > 0) {
+		const size_t take = n < 64 - used ? n : 64 - used;
+		memcpy(s->buf + used, p, take);
+		p += take;
+		n -= take;
+		if (used + take < 64)
+			return;
+		sha1_blocks(s->h, s->buf, 1);
+	}
+	sha1_blocks(s->h, p, n / 64);
+	memcpy(s->buf, p + n / 64 * 64, n % 64);
+}
+
+static inline void sha1_final(sha1_t s[const static 1], uint8_t digest[const static 20]) {
+	const uint64_t bits = __builtin_bswap64(s->len * 8);
+	static const uint8_t pad[64] = { 0x80 };
+	sha1_update(s, pad, 1 + (119 - s->len % 64) % 64);
+	sha1_update(s, &bits, sizeof(bits));
+	for (int i = 0; i < 5; i++) {
+		const uint32_t v = __builtin_bswap32(s->h[i]);
+		memcpy(digest + 4 * i, &v, 4);
+	}
+}
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef __SHA256_H_
+
+#define __SHA256_H_
+
+// SHA-256 (FIPS 180-4), for checking merged output against a published checksum as it's
+// written. With -march=native on a CPU that has the SHA extensions, blocks go through them;
+// otherwise through the portable rounds.
+//
+// Little-endian hosts only, like the rest of the tools.
+//
+// sha256_zeros() hashes a run of null bytes without a buffer. The message schedule of an
+// all-zero block is all zero, so those blocks skip the schedule and just do the rounds.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifdef __SHA__
+#include <immintrin.h>
+#endif
+
+typedef struct {
+		uint32_t h[8];
+		uint64_t len;	// Bytes hashed.
+		uint8_t buf[64];	// Partial block; len % 64 bytes of it are used.
+	} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+
+static inline void sha256_init(sha256_t s[const static 1]) {
+	static const uint32_t iv[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+		};
+	memcpy(s->h, iv, sizeof(iv));
+	s->len = 0;
+}
+
+static inline uint32_t sha256_ror(const uint32_t x, const int r) {
+	return (x >> r) | (x << (32 - r));
+}
+
+// The 64 rounds over a message schedule w.
+static inline void sha256_rounds(uint32_t h[const static 8], const uint32_t w[const static 64]) {
+	uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+	for (int i = 0; i < 64; i++) {
+		const uint32_t t1 = k + (sha256_ror(e, 6) ^ sha256_ror(e, 11) ^ sha256_ror(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		const uint32_t t2 = (sha256_ror(a, 2) ^ sha256_ror(a, 13) ^ sha256_ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += k;
+}
+
+#ifdef __SHA__
+
+// The SHA extensions keep the state as ABEF and CDGH.
+static inline void sha256_blocks(uint32_t h[const static 8], const uint8_t *p, size_t n) {
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]), 0xb1);	// CDAB
+	__m128i s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]), 0x1b);	// EFGH
+	__m128i s0 = _mm_alignr_epi8(t, s1, 8);	// ABEF
+	s1 = _mm_blend_epi16(s1, t, 0xf0);	// CDGH
+
+	for (; n > 0; n--, p += 64) {
+		const __m128i abef = s0, cdgh = s1;
+		__m128i m[4], msg;
+		for (int i = 0; i < 4; i++)
+			m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + 16 * i)), bswap);
+
+		for (int i = 0; i < 16; i++) {
+			msg = _mm_add_epi32(m[i % 4], _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+			s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+			if (i < 12) {
+				// Schedule the words four groups ahead.
+				const __m128i next = _mm_add_epi32(_mm_sha256msg1_epu32(m[i % 4], m[(i + 1) % 4]), _mm_alignr_epi8(m[(i + 3) % 4], m[(i + 2) % 4], 4));
+				m[i % 4] = _mm_sha256msg2_epu32(next, m[(i + 3) % 4]);
+			}
+			s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+		}
+
+		s0 = _mm_add_epi32(s0, abef);
+		s1 = _mm_add_epi32(s1, cdgh);
+	}
+
+	t = _mm_shuffle_epi32(s0, 0x1b);	// FEBA
+	s1 = _mm_shuffle_epi32(s1, 0xb1);	// DCHG
+	_mm_storeu_si128((__m128i *)&h[0], _mm_blend_epi16(t, s1, 0xf0));	// DCBA
+	_mm_storeu_si128((__m128i *)&h[4], _mm_alignr_epi8(s1, t, 8));	// HGFE
+}
+
+#else
+
+static inline void sha256_blocks(uint32_t h[const static 8], const uint8_t *p, size_t n) {
+	for (; n > 0; n--, p += 64) {
+		uint32_t w[64];
+		for (int i = 0; i < 16; i++) {
+			uint32_t v;
+			memcpy(&v, p + 4 * i, 4);
+			w[i] = __builtin_bswap32(v);
+		}
+		for (int i = 16; i < 64; i++) {
+			const uint32_t s0 = sha256_ror(w[i - 15], 7) ^ sha256_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			const uint32_t s1 = sha256_ror(w[i - 2], 17) ^ sha256_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+		sha256_rounds(h, w);
+	}
+}
+
+#endif
+
+static inline void sha256_update(sha256_t s[const static 1], const void *const data, size_t n) {
+	const uint8_t *p = data;
+	const size_t used = s->len % 64;
+	s->len += n;
+	if (used > 0) {
+		const size_t take = n < 64 - used ? n : 64 - used;
+		memcpy(s->buf + used, p, take);
+		p += take;
+		n -= take;
+		if (used + take < 64)
+			return;
+		sha256_blocks(s->h, s->buf, 1);
+	}
+	sha256_blocks(s->h, p, n / 64);
+	memcpy(s->buf, p + n / 64 * 64, n % 64);
+}
+
+// Hash n null bytes.
+static inline void sha256_zeros(sha256_t s[const static 1], size_t n) {
+	static const uint8_t zero[4096];
+	const size_t used = s->len % 64;
+	if (used > 0) {
+		const size_t take = n < 64 - used ? n : 64 - used;
+		sha256_update(s, zero, take);
+		n -= take;
+	}
+	s->len += n / 64 * 64;
+#ifdef __SHA__
+	// The hardware rounds beat skipping the schedule.
+	for (size_t b = n / 64; b > 0; ) {
+		const size_t blocks = b < sizeof(zero) / 64 ? b : sizeof(zero) / 64;
+		sha256_blocks(s->h, zero, blocks);
+		b -= blocks;
+	}
+#else
+	static const uint32_t w[64];
+	for (size_t b = n / 64; b > 0; b--)
+		sha256_rounds(s->h, w);
+#endif
+	sha256_update(s, zero, n % 64);
+}
+
+static inline void sha256_final(sha256_t s[const static 1], uint8_t digest[const static 32]) {
+	const uint64_t bits = __builtin_bswap64(s->len * 8);
+	static const uint8_t pad[64] = { 0x80 };
+	sha256_update(s, pad, 1 + (119 - s->len % 64) % 64);
+	sha256_update(s, &bits, sizeof(bits));
+	for (int i = 0; i < 8; i++) {
+		const uint32_t v = __builtin_bswap32(s->h[i]);
+		memcpy(digest + 4 * i, &v, 4);
+	}
+}
+
+#endif
@@ -0,0 +1,289 @@
+#ifndef __SHARD_H_
+
+#define __SHARD_H_
+
+// Byte-range sharding. Every tool takes --offset and --length, to work on one block-aligned
+// range of its inputs, and --shard file, to write what it found there as a partial result
+// instead of answering. nullmerge puts the partial results of shards that cover the whole range
+// together into the answer an unsharded run gives.
+//
+// A partial result is a shard_rec_t, followed by rec.nextents output extents (nullcombine) and
+// rec.namelen bytes of the input's name (hasnull -f).
+// Everything is in host byte order: the shards are meant for machines sharing the storage,
+// not for archiving.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/param.h>
+
+#include "opts.h"
+
+#define SHARD_MAGIC	"NDSHRD02"
+
+typedef enum {
+		SHARD_NULLDIFF = 1,
+		SHARD_NULLCOMBINE,
+		SHARD_HASNULL,
+		SHARD_HASHOLE,
+	} shard_tool_t;
+
+enum {
+		SH_FIRST	= 1 << 0,	// first holds the first conflict, or the first null block or hole.
+		SH_SHARED	= 1 << 1,	// Both inputs have data in the range.
+		SH_NOT_SUBSET_1	= 1 << 2,	// The first input has data the second doesn't, so isn't a subset.
+		SH_NOT_SUBSET_2	= 1 << 3,	// And the other way around.
+		SH_GREATEST	= 1 << 4,	// nulldiff -g: report which input has more data.
+		SH_SHOW_NULL	= 1 << 5,	// hasnull -b: say so when there's a null block.
+		SH_SHOW_FILE	= 1 << 6,	// hasnull -f: name the input when there's a null block.
+	};
+
+// nulldiff's return bits.
+enum {
+		SHARD_RET_SUBSET_1	= 1 << 0,
+		SHARD_RET_SUBSET_2	= 1 << 1,
+		SHARD_RET_GREATEST_1	= 1 << 2,
+		SHARD_RET_GREATEST_2	= 1 << 3,
+	};
+
+typedef struct {
+		char magic[8];
+		uint32_t tool;
+		uint32_t flags;
+		uint64_t offset;	// The range this covers.
+		uint64_t length;
+		uint64_t total;	// End of the whole job's range.
+		uint64_t size[2];	// Input sizes, so that shards of different inputs don't mix.
+		uint64_t first;
+		uint64_t data[2];	// Bytes of data each input has that the other doesn't.
+		uint64_t nextents;
+		uint64_t namelen;
+	} shard_rec_t;
+
+typedef struct {
+		uint64_t off;
+		uint64_t len;
+	} shard_ext_t;
+
+typedef struct {
+		shard_ext_t *ext;
+		size_t n;
+		size_t cap;
+	} shard_exts_t;
+
+typedef struct {
+		size_t offset;
+		size_t length;	// 0: to the end.
+		const char *out;	// --shard: where the partial result goes.
+		bool ranged;	// Any of the three was given.
+	} shard_opts_t;
+
+// Add [off, off + len), joining it to the last extent if they touch.
+static inline bool shard_ext_add(shard_exts_t e[const static 1], const uint64_t off, const uint64_t len) {
+	if (len == 0)
+		return true;
+	if (e->n > 0 && e->ext[e->n - 1].off + e->ext[e->n - 1].len == off) {
+		e->ext[e->n - 1].len += len;
+		return true;
+	}
+	if (e->n == e->cap) {
+		const size_t cap = e->cap ? e->cap * 2 : 256;
+		shard_ext_t *const ext = realloc(e->ext, cap * sizeof(*ext));
+		if (ext == nullptr)
+			return false;
+		e->ext = ext;
+		e->cap = cap;
+	}
+	e->ext[e->n++] = (shard_ext_t){ .off = off, .len = len };
+	return true;
+}
+
+static inline bool shard_number(const char *const opt, const char *const s, size_t v[const static 1]) {
+	char *end;
+	errno = 0;
+	*v = strtoull(s, &end, 0);
+	if (*s == '\0' || *end != '\0' || errno != 0) {
+		fprintf(stderr, "Error: bad number for %s: %s\n", opt, s);
+		return false;
+	}
+	return true;
+}
+
+static const opt_t shard_optv[] = {
+		{ "--offset", OPT_VALUE },
+		{ "--length", OPT_VALUE },
+		{ "--shard", OPT_VALUE },
+	};
+
+static inline bool shard_take(void *const ctx, const size_t which, const char *const value) {
+	shard_opts_t *const o = ctx;
+	o->ranged = true;
+	if (which == 2) {
+		o->out = value;
+		return true;
+	}
+	return shard_number(shard_optv[which].name, value, which == 0 ? &o->offset : &o->length);
+}
+
+// Take --offset, --length and --shard out of argv, so that the tool's own parsing never sees them.
+static inline bool shard_strip(int argc[const static 1], char **const argv, shard_opts_t o[const static 1]) {
+	*o = (shard_opts_t){ };
+	return opt_strip(argc, argv, sizeof(shard_optv) / sizeof(*shard_optv), shard_optv, shard_take, o);
+}
+
+// The range [lo, hi) the options pick out of [0, total). Both ends must be on a block boundary,
+// except that the range may run to the end.
+static inline bool shard_range(const shard_opts_t o[const static 1], const size_t total, const size_t block, size_t lo[const static 1], size_t hi[const static 1]) {
+	if (o->offset % block != 0 || (o->length % block != 0 && o->offset + o->length < total)) {
+		fprintf(stderr, "Error: --offset and --length must be multiples of %zu bytes.\n", block);
+		return false;
+	}
+	*lo = MIN(o->offset, total);
+	*hi = o->length == 0 ? total : MIN(o->offset + o->length, total);
+	return true;
+}
+
+static inline shard_rec_t shard_new(const shard_tool_t tool, const size_t lo, const size_t hi, const size_t total, const size_t size1, const size_t size2) {
+	shard_rec_t rec = {
+			.tool = tool,
+			.offset = lo,
+			.length = hi - lo,
+			.total = total,
+			.size = { size1, size2 },
+		};
+	memcpy(rec.magic, SHARD_MAGIC, sizeof(rec.magic));
+	return rec;
+}
+
+// Note a conflict, null block or hole at off. The lowest one wins.
+static inline void shard_first(shard_rec_t rec[const static 1], const uint64_t off) {
+	if (!(rec->flags & SH_FIRST) || off < rec->first)
+		rec->first = off;
+	rec->flags |= SH_FIRST;
+}
+
+// Write a partial result. e and name, the input's name for the report, may be nullptr.
+static inline bool shard_write(const char *const path, shard_rec_t rec[const static 1], const shard_exts_t *const e, const char *const name) {
+	rec->nextents = e != nullptr ? e->n : 0;
+	rec->namelen = name != nullptr ? strlen(name) : 0;
+	FILE *const f = fopen(path, "wb");
+	bool ok = f != nullptr && fwrite(rec, sizeof(*rec), 1, f) == 1
+			&& (rec->nextents == 0 || fwrite(e->ext, sizeof(*e->ext), e->n, f) == e->n)
+			&& (name == nullptr || fwrite(name, 1, rec->namelen, f) == rec->namelen);
+	if (f != nullptr && fclose(f) != 0)
+		ok = false;
+	if (!ok) {
+		fprintf(stderr, "Error: unable to write the partial result to %s\n", path);
+		return false;
+	}
+	return true;
+}
+
+// Read a partial result. e, if not nullptr, gets its extents, and name, if not nullptr, the
+// input's name (malloc()ed, or nullptr if it has none).
+static inline bool shard_read(const char *const path, shard_rec_t rec[const static 1], shard_exts_t *const e, char **const name) {
+	FILE *const f = fopen(path, "rb");
+	bool ok = f != nullptr && fread(rec, sizeof(*rec), 1, f) == 1 && memcmp(rec->magic, SHARD_MAGIC, sizeof(rec->magic)) == 0;
+	if (ok && e != nullptr) {
+		*e = (shard_exts_t){ };
+		if (rec->nextents > 0) {
+			e->ext = malloc(rec->nextents * sizeof(*e->ext));
+			ok = e->ext != nullptr && fread(e->ext, sizeof(*e->ext), rec->nextents, f) == rec->nextents;
+			e->n = e->cap = ok ? rec->nextents : 0;
+		}
+	}
+	if (ok && name != nullptr) {
+		*name = nullptr;
+		if (rec->namelen > 0) {
+			if (e == nullptr)
+				ok = fseek(f, rec->nextents * sizeof(shard_ext_t), SEEK_CUR) == 0;
+			*name = ok && rec->namelen < PATH_MAX ? malloc(rec->namelen + 1) : nullptr;
+			ok = *name != nullptr && fread(*name, 1, rec->namelen, f) == rec->namelen;
+			if (ok)
+				(*name)[rec->namelen] = '\0';
+		}
+	}
+	if (f != nullptr)
+		fclose(f);
+	if (!ok)
+		fprintf(stderr, "Error: %s isn't a readable partial result.\n", path);
+	return ok;
+}
+
+// Fold shard b, which must start where the merged shards in a end, into a.
+static inline bool shard_fold(shard_rec_t a[const static 1], const shard_rec_t b[const static 1]) {
+	if (a->tool != b->tool || a->total != b->total || a->size[0] != b->size[0] || a->size[1] != b->size[1]
+			|| (a->flags & SH_GREATEST) != (b->flags & SH_GREATEST)) {
+		fprintf(stderr, "Error: the partial results are from different jobs.\n");
+		return false;
+	}
+	if (b->offset > a->offset + a->length) {
+		fprintf(stderr, "Error: no partial result covers [%lu, %lu).\n", (unsigned long)(a->offset + a->length), (unsigned long)b->offset);
+		return false;
+	}
+	if (b->offset < a->offset + a->length) {
+		fprintf(stderr, "Error: partial results overlap at %lu.\n", (unsigned long)b->offset);
+		return false;
+	}
+	if (b->flags & SH_FIRST)
+		shard_first(a, b->first);
+	a->flags |= b->flags & ~SH_FIRST;
+	a->length += b->length;
+	a->data[0] += b->data[0];
+	a->data[1] += b->data[1];
+	a->nextents += b->nextents;
+	return true;
+}
+
+// hasnull's report of a null block in fpath, going by its -b and -f.
+static inline void shard_report_null(const char *const fpath, const bool opt_shownull, const bool opt_showfile) {
+	if (opt_shownull) {
+		if (opt_showfile) {
+			printf("Null encountered: %s\n", fpath);
+		}
+		else {
+			printf("Null encountered\n");
+		}
+	}
+	else if (opt_showfile) {
+		printf("%s\n", fpath);
+	}
+}
+
+// nulldiff's answer for a whole range: its messages, and its return code.
+static inline int shard_report_diff(const shard_rec_t rec[const static 1]) {
+	if (rec->flags & SH_FIRST) {
+		fprintf(stderr, "Files mismatch\n");
+		fprintf(stderr, "Files mismatch (at byte %lu)\n", (unsigned long)rec->first);
+		return -1;
+	}
+	if (!(rec->flags & SH_SHARED)) {
+		fprintf(stderr, "Error: Files do not share any data blocks.\n");
+		return -2;
+	}
+
+	printf("Files are the same, possibly excluding null bytes.\n");
+
+	unsigned char retcode = 0;
+	if (rec->flags & SH_GREATEST) {
+		if (rec->data[0] > rec->data[1]) {
+			printf("File 1 has more data that file 2.\n");
+			retcode |= SHARD_RET_GREATEST_1;
+		}
+		else if (rec->data[1] > rec->data[0]) {
+			printf("File 2 has more data that file 1.\n");
+			retcode |= SHARD_RET_GREATEST_2;
+		}
+	}
+	if (!(rec->flags & SH_NOT_SUBSET_1))
+		retcode |= SHARD_RET_SUBSET_1;
+	if (!(rec->flags & SH_NOT_SUBSET_2))
+		retcode |= SHARD_RET_SUBSET_2;
+	return retcode;
+}
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef __THROTTLE_H_
+
+#define __THROTTLE_H_
+
+// Keeping a scan from crowding out everything else on the storage it reads:
+//
+//	--max-bandwidth rate	cap the data read at rate bytes per second (K, M, G suffixes). Holes
+//				cost nothing. A token bucket, charged at window boundaries, so
+//				the cap holds on average with a window's worth of burst.
+//	--ioprio idle|be:N	I/O scheduling class for the whole process, set by throttle_start().
+//	--psi pct		back off while /proc/pressure/io says some task spent more than pct
+//				percent of the last 10 seconds stalled on I/O, and carry on once it
+//				drops below. The scan's own reads count towards the pressure too, so
+//				pick a threshold above what it causes on its own.
+//
+// throttle_io() is thread-safe; a throttle that wasn't asked for costs a branch.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+
+#include "likely.h"
+#include "probes.h"
+#include "opts.h"
+
+#define THROTTLE_BURST_MS	250	// Bucket depth, in time at the capped rate.
+#define THROTTLE_BURST_MIN	(1 << 20)
+#define THROTTLE_PSI_CHECK_MS	500	// Look at the pressure at most this often.
+#define THROTTLE_PSI_BACKOFF_MS	100	// First pause; doubles while the pressure stays up.
+#define THROTTLE_PSI_BACKOFF_MAX_MS	5000
+
+typedef struct {
+		bool on;
+		double rate;	// Bytes per second; 0: no cap.
+		double tokens;
+		double t_last;
+		double psi;	// Pressure threshold, percent; 0: don't look.
+		double psi_next;	// When to look again.
+		double resume;	// Backing off from the pressure until then.
+		int ioprio;	// 0: leave it be.
+		pthread_mutex_t lock;
+	} throttle_t;
+
+static inline double throttle_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void throttle_sleep(const double secs) {
+	struct timespec ts = { .tv_sec = secs, .tv_nsec = (secs - (time_t)secs) * 1e9 };
+	while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+// The "some avg10" figure of /proc/pressure/io, or -1 if there's no PSI.
+static inline double throttle_pressure(void) {
+	char buf[256];
+	const int fd = open("/proc/pressure/io", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	const char *const avg = strstr(buf, "some avg10=");
+	return avg != nullptr ? strtod(avg + strlen("some avg10="), nullptr) : -1;
+}
+
+static inline bool throttle_rate(const char *const s, double rate[const static 1]) {
+	char *end;
+	*rate = strtod(s, &end);
+	switch (*end | 0x20) {
+		case 'k': *rate *= 1 << 10; end++; break;
+		case 'm': *rate *= 1 << 20; end++; break;
+		case 'g': *rate *= 1 << 30; end++; break;
+	}
+	if (end == s || *end != '\0' || !(*rate > 0)) {
+		fprintf(stderr, "Error: bad rate for --max-bandwidth: %s\n", s);
+		return false;
+	}
+	return true;
+}
+
+static inline bool throttle_ioprio(const char *const s, int prio[const static 1]) {
+	if (strcmp(s, "idle") == 0)
+		*prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+	else if (strncmp(s, "be:", 3) == 0 && s[3] >= '0' && s[3] <= '7' && s[4] == '\0')
+		*prio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, s[3] - '0');
+	else {
+		fprintf(stderr, "Error: --ioprio wants idle or be:0 to be:7, not %s\n", s);
+		return false;
+	}
+	return true;
+}
+
+static inline bool throttle_take(void *const ctx, const size_t which, const char *const value) {
+	throttle_t *const t = ctx;
+	if (which == 0)
+		return throttle_rate(value, &t->rate);
+	if (which == 1)
+		return throttle_ioprio(value, &t->ioprio);
+
+	char *end;
+	t->psi = strtod(value, &end);
+	if (end == value || *end != '\0' || !(t->psi > 0 && t->psi < 100)) {
+		fprintf(stderr, "Error: --psi wants a percentage: %s\n", value);
+		return false;
+	}
+	if (throttle_pressure() < 0)
+		fprintf(stderr, "Warning: no /proc/pressure/io here; --psi does nothing.\n");
+	return true;
+}
+
+// Take --max-bandwidth, --ioprio and --psi out of argv, so that the tool's own parsing never
+// sees them. Nothing takes effect until throttle_start().
+static inline bool throttle_strip(int argc[const static 1], char **const argv, throttle_t t[const static 1]) {
+	static const opt_t opts[] = {
+			{ "--max-bandwidth", OPT_VALUE },
+			{ "--ioprio", OPT_VALUE },
+			{ "--psi", OPT_VALUE },
+		};
+	*t = (throttle_t){ };
+	if (!opt_strip(argc, argv, sizeof(opts) / sizeof(*opts), opts, throttle_take, t))
+		return false;
+
+	t->on = t->rate > 0 || t->psi > 0;
+	t->t_last = throttle_now();
+	t->tokens = MAX(t->rate * THROTTLE_BURST_MS / 1000, THROTTLE_BURST_MIN);
+	pthread_mutex_init(&t->lock, nullptr);
+	return true;
+}
+
+// The arguments all check out and the work is about to start: set the I/O class.
+static inline bool throttle_start(const throttle_t t[const static 1]) {
+	if (t->ioprio != 0 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, t->ioprio) != 0) {
+		perror("Error: --ioprio");
+		return false;
+	}
+	return true;
+}
+
+// bytes were just read. Sleeps as long as it takes to stay under the cap, and for as long as
+// the pressure is over the threshold.
+static inline void throttle_io(throttle_t *const t, const size_t bytes) {
+	if (likely(t == nullptr || !t->on))
+		return;
+
+	double wait = 0;
+	bool check = false;
+	pthread_mutex_lock(&t->lock);
+	const double now = throttle_now();
+	if (t->rate > 0) {
+		const double burst = MAX(t->rate * THROTTLE_BURST_MS / 1000, THROTTLE_BURST_MIN);
+		t->tokens = MIN(t->tokens + (now - t->t_last) * t->rate, burst) - bytes;
+		t->t_last = now;
+		// In debt: wait until it's paid off. Other threads take on more debt meanwhile, and
+		// wait for theirs after ours.
+		if (t->tokens < 0)
+			wait = -t->tokens / t->rate;
+	}
+	// Every thread backs off together.
+	if (t->resume > now)
+		wait = MAX(wait, t->resume - now);
+	if (t->psi > 0 && now >= t->psi_next) {
+		t->psi_next = now + THROTTLE_PSI_CHECK_MS / 1000.0;
+		check = true;
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	if (wait > 0) {
+		probe(throttle, bytes, (uint64_t)(wait * 1e6));
+		throttle_sleep(wait);
+	}
+	for (int ms = THROTTLE_PSI_BACKOFF_MS; check && throttle_pressure() > t->psi; ms = MIN(ms * 2, THROTTLE_PSI_BACKOFF_MAX_MS)) {
+		probe(psi_backoff, ms);
+		pthread_mutex_lock(&t->lock);
+		t->resume = throttle_now() + ms / 1000.0;
+		pthread_mutex_unlock(&t->lock);
+		throttle_sleep(ms / 1000.0);
+	}
+}
+
+#endif
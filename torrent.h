@@ -0,0 +1,280 @@
+#ifndef __TORRENT_H_
+
+#define __TORRENT_H_
+
+// Piece hashes from a .torrent file, for telling which pieces of a partial download are right.
+//
+// Single-file torrents only: an image is one file, and the pieces of a v1 torrent with several
+// files run across them. v1 pieces are SHA-1'd whole. v2 pieces (BEP 52) are the roots of
+// SHA-256 merkle trees over 16 KiB blocks, from the "piece layers"; a file of one piece has no
+// layer, and its "pieces root" is the root of its own tree. Hybrid torrents are checked by
+// their v2 hashes.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include "sha1.h"
+#include "sha256.h"
+
+#define TORRENT_BLOCK	(16 << 10)	// v2 merkle leaf size.
+#define TORRENT_DEPTH	64	// Deepest bencode nesting taken.
+
+typedef struct {
+		int version;	// 1 or 2.
+		uint64_t length;	// Of the file.
+		uint64_t piece_len;
+		size_t npieces;
+		const uint8_t *hashes;	// npieces of them: 20 bytes each for v1, 32 for v2.
+		uint8_t *meta;	// The whole .torrent file, which hashes points into.
+	} torrent_t;
+
+// bencode: every value is parsed in place, as a span of meta.
+
+// The end of the value at p, or nullptr if it isn't one.
+static inline const uint8_t *bencode_skip(const uint8_t *p, const uint8_t *const end, const int depth) {
+	if (p >= end || depth > TORRENT_DEPTH)
+		return nullptr;
+	if (*p == 'i') {
+		const uint8_t *const e = memchr(p, 'e', end - p);
+		return e != nullptr ? e + 1 : nullptr;
+	}
+	if (*p == 'l' || *p == 'd') {
+		for (p++; p < end && *p != 'e'; ) {
+			p = bencode_skip(p, end, depth + 1);
+			if (p == nullptr)
+				return nullptr;
+		}
+		return p < end ? p + 1 : nullptr;
+	}
+	uint64_t len = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++) {
+		if (len > (uint64_t)(end - p))
+			return nullptr;
+		len = len * 10 + (*p - '0');
+	}
+	if (p >= end || *p != ':' || len > (uint64_t)(end - p - 1))
+		return nullptr;
+	return p + 1 + len;
+}
+
+// The string at p, or false if it isn't one.
+static inline bool bencode_str(const uint8_t *p, const uint8_t *const end, const uint8_t *s[const static 1], size_t len[const static 1]) {
+	if (p == nullptr || p >= end || *p < '0' || *p > '9')
+		return false;
+	const uint8_t *const next = bencode_skip(p, end, 0);
+	if (next == nullptr)
+		return false;
+	*len = 0;
+	for (; *p != ':'; p++)
+		*len = *len * 10 + (*p - '0');
+	*s = p + 1;
+	return true;
+}
+
+static inline bool bencode_int(const uint8_t *p, const uint8_t *const end, int64_t v[const static 1]) {
+	if (p == nullptr || p >= end || *p != 'i' || bencode_skip(p, end, 0) == nullptr)
+		return false;
+	char *e;
+	*v = strtoll((const char *)p + 1, &e, 10);
+	return *e == 'e' && e > (const char *)p + 1;
+}
+
+// The value under key in the dictionary at p, or nullptr.
+static inline const uint8_t *bencode_get(const uint8_t *p, const uint8_t *const end, const void *const key, const size_t keylen) {
+	if (p == nullptr || p >= end || *p != 'd')
+		return nullptr;
+	for (p++; p < end && *p != 'e'; ) {
+		const uint8_t *k;
+		size_t klen;
+		if (!bencode_str(p, end, &k, &klen))
+			return nullptr;
+		const uint8_t *const value = k + klen;
+		if (klen == keylen && memcmp(k, key, keylen) == 0)
+			return value;
+		p = bencode_skip(value, end, 1);
+		if (p == nullptr)
+			return nullptr;
+	}
+	return nullptr;
+}
+
+#define bencode_key(p, end, key)	bencode_get(p, end, key, strlen(key))
+
+// The v2 layout: true and t filled in if info has a usable one, false with a message if it has
+// one that isn't usable, and false with t->version still 0 if it has none at all.
+static inline bool torrent_v2(torrent_t t[const static 1], const uint8_t *const root, const uint8_t *const info, const uint8_t *const end, const char *const path) {
+	int64_t version;
+	const uint8_t *const tree = bencode_key(info, end, "file tree");
+	if (!bencode_int(bencode_key(info, end, "meta version"), end, &version) || version != 2 || tree == nullptr)
+		return false;
+	t->version = 2;
+
+	// One file: down a chain of single-entry directories to an entry that's a file, a dictionary
+	// with the empty key.
+	const uint8_t *file = nullptr;
+	for (const uint8_t *node = tree; node != nullptr && node < end && *node == 'd' && file == nullptr; ) {
+		const uint8_t *name;
+		size_t namelen;
+		if (!bencode_str(node + 1, end, &name, &namelen))
+			break;
+		const uint8_t *const value = name + namelen;
+		const uint8_t *const next = bencode_skip(value, end, 1);
+		if (next == nullptr || next >= end || *next != 'e')
+			break;	// More than one entry.
+		file = bencode_get(value, end, "", 0);
+		node = value;
+	}
+	int64_t length;
+	const uint8_t *proot;
+	size_t rootlen;
+	if (file == nullptr) {
+		fprintf(stderr, "Error: %s describes more than one file; an image is one.\n", path);
+		return false;
+	}
+	if (!bencode_int(bencode_key(file, end, "length"), end, &length) || length <= 0
+			|| !bencode_str(bencode_key(file, end, "pieces root"), end, &proot, &rootlen) || rootlen != 32) {
+		fprintf(stderr, "Error: %s has no length or pieces root for its file.\n", path);
+		return false;
+	}
+
+	if ((t->piece_len & (t->piece_len - 1)) != 0 || t->piece_len < TORRENT_BLOCK) {
+		fprintf(stderr, "Error: %s has a piece length that isn't a power of two of at least 16 KiB.\n", path);
+		return false;
+	}
+	t->length = length;
+	t->npieces = (t->length + t->piece_len - 1) / t->piece_len;
+	if (t->npieces == 1) {
+		t->hashes = proot;
+		return true;
+	}
+	const uint8_t *layer;
+	size_t layerlen;
+	if (!bencode_str(bencode_get(bencode_key(root, end, "piece layers"), end, proot, 32), end, &layer, &layerlen)
+			|| layerlen != 32 * t->npieces) {
+		fprintf(stderr, "Error: %s has no piece layer for its file.\n", path);
+		return false;
+	}
+	t->hashes = layer;
+	return true;
+}
+
+// Load the piece hashes of the .torrent at path. Prints why not, if not.
+static inline bool torrent_load(torrent_t t[const static 1], const char *const path) {
+	*t = (torrent_t){ };
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "Unable to open %s", path);
+		perror(", ");
+		if (fd != -1)
+			close(fd);
+		return false;
+	}
+	t->meta = malloc(MAX(st.st_size, 1));
+	if (t->meta == nullptr || read(fd, t->meta, st.st_size) != st.st_size) {
+		fprintf(stderr, "Unable to read %s.\n", path);
+		close(fd);
+		free(t->meta);
+		return false;
+	}
+	close(fd);
+
+	const uint8_t *const end = t->meta + st.st_size;
+	const uint8_t *const info = bencode_key(t->meta, end, "info");
+	int64_t piece_len;
+	if (info == nullptr || bencode_skip(t->meta, end, 0) == nullptr
+			|| !bencode_int(bencode_key(info, end, "piece length"), end, &piece_len)
+			|| piece_len <= 0) {
+		fprintf(stderr, "Error: %s isn't a torrent I can use.\n", path);
+		free(t->meta);
+		return false;
+	}
+	t->piece_len = piece_len;
+
+	if (torrent_v2(t, t->meta, info, end, path))
+		return true;
+	if (t->version == 2) {
+		free(t->meta);
+		return false;
+	}
+
+	const uint8_t *pieces;
+	size_t piecelen;
+	int64_t length;
+	if (bencode_key(info, end, "files") != nullptr) {
+		fprintf(stderr, "Error: %s describes more than one file; an image is one.\n", path);
+		free(t->meta);
+		return false;
+	}
+	if (!bencode_int(bencode_key(info, end, "length"), end, &length) || length <= 0
+			|| !bencode_str(bencode_key(info, end, "pieces"), end, &pieces, &piecelen)
+			|| piecelen != 20 * ((length + t->piece_len - 1) / t->piece_len)) {
+		fprintf(stderr, "Error: %s has no usable piece hashes.\n", path);
+		free(t->meta);
+		return false;
+	}
+	t->version = 1;
+	t->length = length;
+	t->npieces = piecelen / 20;
+	t->hashes = pieces;
+	return true;
+}
+
+static inline void torrent_free(torrent_t t[const static 1]) {
+	free(t->meta);
+	*t = (torrent_t){ };
+}
+
+// Bytes in piece p.
+static inline size_t torrent_piece_size(const torrent_t t[const static 1], const size_t p) {
+	return MIN(t->piece_len, t->length - p * t->piece_len);
+}
+
+// Does buf hold piece p? n must be torrent_piece_size(). leaves is scratch space for v2, room
+// for piece_len / TORRENT_BLOCK hashes.
+static inline bool torrent_verify(const torrent_t t[const static 1], const size_t p, const uint8_t *const buf, const size_t n, uint8_t (*const leaves)[32]) {
+	if (t->version == 1) {
+		sha1_t s;
+		uint8_t digest[20];
+		sha1_init(&s);
+		sha1_update(&s, buf, n);
+		sha1_final(&s, digest);
+		return memcmp(digest, t->hashes + 20 * p, 20) == 0;
+	}
+
+	// The tree of a piece spans piece_len, past the end of the file too, except in a file of one
+	// piece: that one only spans a power of two blocks. Leaves past the end are zero.
+	const size_t nblocks = (n + TORRENT_BLOCK - 1) / TORRENT_BLOCK;
+	size_t width = t->npieces > 1 ? t->piece_len / TORRENT_BLOCK : 1;
+	while (width < nblocks)
+		width *= 2;
+	for (size_t b = 0; b < width; b++) {
+		if (b >= nblocks) {
+			memset(leaves[b], 0, 32);
+			continue;
+		}
+		sha256_t s;
+		sha256_init(&s);
+		sha256_update(&s, buf + b * TORRENT_BLOCK, MIN(TORRENT_BLOCK, n - b * TORRENT_BLOCK));
+		sha256_final(&s, leaves[b]);
+	}
+	for (; width > 1; width /= 2) {
+		for (size_t b = 0; b < width / 2; b++) {
+			sha256_t s;
+			sha256_init(&s);
+			sha256_update(&s, leaves[2 * b], 64);
+			sha256_final(&s, leaves[b]);
+		}
+	}
+	return memcmp(leaves[0], t->hashes + 32 * p, 32) == 0;
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __XCACHE_H_
+
+#define __XCACHE_H_
+
+// Scan results cached in an extended attribute (user.nulldiff.scan), so that a file that hasn't
+// changed since it was last scanned can be answered without reading it.
+//
+// The record holds what was learned (hole, null, an optional census) and the file's identity
+// when it was scanned: size, mtime, inode and generation. Writing the attribute itself moves
+// ctime, so the record also carries the time it was written, and ctime may not be later than
+// that by more than XC_CTIME_SLACK. Any other change to the file moves ctime past it.
+//
+// Caching is best-effort: files we may not set attributes on, and filesystems without user
+// attributes, are just scanned every time.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <sys/xattr.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define XC_NAME	"user.nulldiff.scan"
+#define XC_MAGIC	"NDX1"
+#define XC_CTIME_SLACK	2000000000LL	// ns
+#define XC_PAYLOAD_MAX	1024
+
+enum {
+		XC_HOLE_KNOWN	= 1 << 0,
+		XC_HOLE	= 1 << 1,	// Has a hole before end-of-file.
+		XC_NULL_KNOWN	= 1 << 2,
+		XC_NULL	= 1 << 3,	// Has a hole or an all-null block of `granularity` bytes.
+		XC_PAYLOAD	= 1 << 4,	// A tool-specific payload follows the record.
+	};
+
+typedef struct {
+		char magic[4];
+		uint32_t flags;
+		uint32_t granularity;	// Block size the null check used.
+		uint32_t payload;	// Bytes of payload.
+		uint64_t size;
+		int64_t mtime_ns;
+		uint64_t ino;
+		uint64_t gen;
+		int64_t stamp_ns;	// When the record was written.
+	} xc_rec_t;
+
+static inline int64_t xc_ns(const struct timespec ts) {
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline uint64_t xc_generation(const int fd) {
+	int gen = 0;
+	if (ioctl(fd, FS_IOC_GETVERSION, &gen) != 0)
+		return 0;	// Not every filesystem has one; the other checks still hold.
+	return (unsigned)gen;
+}
+
+// Load fd's record. Returns true if it's valid for the file as st describes it; payload, if
+// not nullptr, gets up to payload_size bytes of its payload. On false, rec holds nothing known.
+static inline bool xc_load(const int fd, const struct stat st[const static 1], xc_rec_t rec[const static 1], void *const payload, const size_t payload_size) {
+	uint8_t buf[sizeof(*rec) + XC_PAYLOAD_MAX];
+	const ssize_t n = fgetxattr(fd, XC_NAME, buf, sizeof(buf));
+	*rec = (xc_rec_t){ };
+	if (n < (ssize_t)sizeof(*rec))
+		return false;
+
+	xc_rec_t r;
+	memcpy(&r, buf, sizeof(r));
+	if (memcmp(r.magic, XC_MAGIC, sizeof(r.magic)) != 0 || r.payload > n - sizeof(r)
+			|| r.size != (uint64_t)st->st_size || r.mtime_ns != xc_ns(st->st_mtim) || r.ino != st->st_ino
+			|| xc_ns(st->st_ctim) > r.stamp_ns + XC_CTIME_SLACK || r.gen != xc_generation(fd))
+		return false;
+
+	*rec = r;
+	if (payload != nullptr)
+		memcpy(payload, buf + sizeof(r), MIN(r.payload, payload_size));
+	return true;
+}
+
+// Store rec, with its identity taken from st, as fd's record. st must be from before the scan,
+// so that a change made during it invalidates the record.
+static inline void xc_store(const int fd, const struct stat st[const static 1], xc_rec_t rec[const static 1], const void *const payload, const size_t payload_size) {
+	uint8_t buf[sizeof(*rec) + XC_PAYLOAD_MAX];
+	if (payload_size > XC_PAYLOAD_MAX)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	memcpy(rec->magic, XC_MAGIC, sizeof(rec->magic));
+	rec->payload = payload_size;
+	rec->size = st->st_size;
+	rec->mtime_ns = xc_ns(st->st_mtim);
+	rec->ino = st->st_ino;
+	rec->gen = xc_generation(fd);
+	rec->stamp_ns = xc_ns(now);
+	rec->flags = payload_size > 0 ? rec->flags | XC_PAYLOAD : rec->flags & ~XC_PAYLOAD;
+
+	memcpy(buf, rec, sizeof(*rec));
+	if (payload_size > 0)
+		memcpy(buf + sizeof(*rec), payload, payload_size);
+	fsetxattr(fd, XC_NAME, buf, sizeof(*rec) + payload_size, 0);
+}
+
+#endif